@@ -0,0 +1,62 @@
+//
+//  affinity.c
+//  myhttpd
+//
+//  Created by Yishuai Li on 01/20/2017.
+//  Copyright © 2017 DeepSpec. All rights reserved.
+//
+
+#define _GNU_SOURCE
+
+#include "affinity.h"
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+
+int affinity_parse(const char *list, int *cpus, int max)
+{
+    const char *p = list;
+    char *end;
+    long first, last;
+    int n = 0;
+
+    while (*p != 0)
+    {
+        first = strtol(p, &end, 10);
+        if (end == p || first < 0)
+            return -1;
+        last = first;
+        p = end;
+        if (*p == '-')
+        {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first)
+                return -1;
+            p = end;
+        }
+        for (; first <= last; first++)
+        {
+            if (n == max || first >= AFFINITY_MAX)
+                return -1;
+            cpus[n++] = (int)first;
+        }
+        if (*p == ',')
+            p++;
+        else if (*p != 0)
+            return -1;
+    }
+    return n > 0 ? n : -1;
+}
+
+int affinity_pin(pthread_t thread, int cpu)
+{
+#ifdef __linux__
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(thread, sizeof(set), &set);
+#else
+    return ENOSYS;
+#endif
+}
@@ -0,0 +1,290 @@
+//
+//  log.c
+//  myhttpd
+//
+//  Created by Yishuai Li on 01/20/2017.
+//  Copyright © 2017 DeepSpec. All rights reserved.
+//
+
+#include "log.h"
+#include "types.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Entries per thread ring, must be a power of two.
+ */
+#define LOG_RING_SIZE 0x100
+/**
+ * Fill level at which a writing thread wakes the drain early; below it the
+ * records wait for the periodic drain.
+ */
+#define LOG_RING_HIGH (LOG_RING_SIZE * 3 / 4)
+#define LOG_ENTRY_SIZE 0x100
+#define LOG_TEXT_SIZE (LOG_ENTRY_SIZE - 16)
+
+/**
+ * One record: CLOCK_REALTIME nanoseconds, level, ring number and the
+ * formatted text, truncated to fit.
+ */
+typedef struct {
+    uint64_t time;
+    uint16_t level;
+    uint16_t thread;
+    uint32_t length;
+    char text[LOG_TEXT_SIZE];
+} log_entry_t;
+
+/**
+ * A ring is ACTIVE while its thread lives, DEAD once the thread exited,
+ * and FREE for another thread to adopt once the writer has drained it.
+ */
+typedef enum {
+    LOG_RING_ACTIVE,
+    LOG_RING_DEAD,
+    LOG_RING_FREE
+} log_ring_state;
+
+/**
+ * Single-producer/single-consumer ring: its thread advances `head`, the
+ * writer advances `tail`.  Rings are never freed, only adopted again, so
+ * the writer can walk the list without locks.
+ */
+typedef struct log_ring {
+    struct log_ring *next;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t dropped;
+    uint64_t reported;
+    uint32_t state;
+    uint16_t id;
+    log_entry_t entries[LOG_RING_SIZE];
+} log_ring_t;
+
+int log_level = LOG_LEVEL_INFO;
+log_ring_t *log_rings;
+uint16_t log_threads;
+__thread log_ring_t *log_ring;
+pthread_key_t log_key;
+pthread_once_t log_once = PTHREAD_ONCE_INIT;
+pthread_t log_thread;
+bool log_running;
+doorbell_t log_bell;
+
+static const char *log_names[] = {
+    [LOG_LEVEL_ERROR] = "error",
+    [LOG_LEVEL_WARN] = "warn",
+    [LOG_LEVEL_INFO] = "info",
+    [LOG_LEVEL_DEBUG] = "debug",
+};
+
+static void output(const char *buf, size_t length)
+{
+    ssize_t r;
+
+    while (length > 0)
+    {
+        r = write(STDERR_FILENO, buf, length);
+        if (r <= 0)
+            return;
+        buf += r;
+        length -= r;
+    }
+}
+
+/**
+ * Write out everything queued so far.  Only the writer thread, or
+ * log_close() once the writer is gone, calls this.
+ */
+static void drain()
+{
+    char out[BUFFER_SIZE];
+    size_t used = 0;
+    log_ring_t *ring;
+    log_entry_t *entry;
+    uint64_t head, dropped;
+    struct tm tm;
+    time_t sec;
+    char stamp[16];
+
+    for (ring = load_acquire(&log_rings); ring != NULL; ring = ring->next)
+    {
+        head = load_acquire(&ring->head);
+        for (; ring->tail != head; store_release(&ring->tail, ring->tail + 1))
+        {
+            entry = &ring->entries[ring->tail & (LOG_RING_SIZE - 1)];
+            if (sizeof(out) - used < 2 * LOG_ENTRY_SIZE)
+            {
+                output(out, used);
+                used = 0;
+            }
+            sec = entry->time / 1000000000;
+            localtime_r(&sec, &tm);
+            strftime(stamp, sizeof(stamp), "%H:%M:%S", &tm);
+            used += snprintf(out + used, sizeof(out) - used,
+                             "%s.%06u [%s] %u: %.*s\n",
+                             stamp,
+                             (unsigned)(entry->time % 1000000000 / 1000),
+                             log_names[entry->level],
+                             entry->thread,
+                             (int)entry->length,
+                             entry->text);
+        }
+        dropped = load_acquire(&ring->dropped);
+        if (dropped != ring->reported)
+        {
+            if (sizeof(out) - used < 2 * LOG_ENTRY_SIZE)
+            {
+                output(out, used);
+                used = 0;
+            }
+            used += snprintf(out + used, sizeof(out) - used,
+                             "[warn] %u: %llu records dropped\n", ring->id,
+                             (unsigned long long)(dropped - ring->reported));
+            ring->reported = dropped;
+        }
+        if (load_acquire(&ring->state) == LOG_RING_DEAD &&
+            load_acquire(&ring->head) == ring->tail)
+            store_release(&ring->state, LOG_RING_FREE);
+    }
+    output(out, used);
+}
+
+static void *writer(void *cls)
+{
+    const struct timespec period = { 0, 100000000 };
+    spinner_t spin;
+    uint32_t bell;
+    bool running;
+
+    (void)cls;
+    spinner_init(&spin, 0, 0);
+    do {
+        bell = doorbell_peek(&log_bell);
+        running = load_acquire(&log_running);
+        drain();
+        if (running)
+            doorbell_wait_timed(&log_bell, bell, &spin, &period);
+    } while (running);
+    return NULL;
+}
+
+static void detach(void *cls)
+{
+    log_ring_t *ring = cls;
+
+    store_release(&ring->state, LOG_RING_DEAD);
+    doorbell_ring(&log_bell);
+}
+
+static void start()
+{
+    sigset_t all, old;
+
+    pthread_key_create(&log_key, detach);
+    store_release(&log_running, true);
+    /* the writer must not take signals meant for the main thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    errno = pthread_create(&log_thread, NULL, writer, NULL);
+    if (errno != 0)
+        store_release(&log_running, false);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    atexit(log_close);
+}
+
+static log_ring_t *attach()
+{
+    log_ring_t *ring;
+    uint32_t state;
+
+    pthread_once(&log_once, start);
+    for (ring = load_acquire(&log_rings); ring != NULL; ring = ring->next)
+    {
+        state = LOG_RING_FREE;
+        if (compare_swap(&ring->state, &state, LOG_RING_ACTIVE))
+            break;
+    }
+    if (ring == NULL)
+    {
+        ring = calloc(1, sizeof(log_ring_t));
+        if (ring == NULL)
+            return NULL;
+        ring->id = __atomic_add_fetch(&log_threads, 1, __ATOMIC_RELAXED);
+        ring->next = load_acquire(&log_rings);
+        while (!compare_swap(&log_rings, &ring->next, ring))
+            ;
+    }
+    pthread_setspecific(log_key, ring);
+    log_ring = ring;
+    return ring;
+}
+
+void log_init()
+{
+    const char *env = getenv("LOG_LEVEL");
+    int i;
+
+    if (env == NULL)
+        return;
+    for (i = LOG_LEVEL_ERROR; i <= LOG_LEVEL_DEBUG; i++)
+        if (strcasecmp(env, log_names[i]) == 0)
+            log_level = i;
+    if (env[0] >= '0' && env[0] <= '9')
+        log_level = atoi(env);
+}
+
+void log_write(int level, const char *format, ...)
+{
+    log_ring_t *ring = log_ring;
+    log_entry_t *entry;
+    struct timespec now;
+    va_list ap;
+    int length;
+
+    if (ring == NULL && (ring = attach()) == NULL)
+        return;
+    if (ring->head - load_acquire(&ring->tail) == LOG_RING_SIZE)
+    {
+        store_release(&ring->dropped, ring->dropped + 1);
+        return;
+    }
+    entry = &ring->entries[ring->head & (LOG_RING_SIZE - 1)];
+    clock_gettime(CLOCK_REALTIME, &now);
+    entry->time = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    entry->level = level < LOG_LEVEL_ERROR ? LOG_LEVEL_ERROR :
+                   level > LOG_LEVEL_DEBUG ? LOG_LEVEL_DEBUG : level;
+    entry->thread = ring->id;
+    va_start(ap, format);
+    length = vsnprintf(entry->text, sizeof(entry->text), format, ap);
+    va_end(ap);
+    if (length < 0)
+        length = 0;
+    if (length >= (int)sizeof(entry->text))
+        length = sizeof(entry->text) - 1;
+    while (length > 0 && entry->text[length - 1] == '\n')
+        length--;
+    entry->length = length;
+    store_release(&ring->head, ring->head + 1);
+    if (ring->head - load_acquire(&ring->tail) == LOG_RING_HIGH)
+        doorbell_ring(&log_bell);
+}
+
+void log_close()
+{
+    if (!load_acquire(&log_running))
+        return;
+    store_release(&log_running, false);
+    doorbell_ring(&log_bell);
+    pthread_join(log_thread, NULL);
+    drain();
+}
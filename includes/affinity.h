@@ -0,0 +1,30 @@
+//
+//  affinity.h
+//  myhttpd
+//
+//  Created by Yishuai Li on 01/20/2017.
+//  Copyright © 2017 DeepSpec. All rights reserved.
+//
+
+#ifndef affinity_h
+#define affinity_h
+
+#include <pthread.h>
+
+/**
+ * Most CPUs a list may name.
+ */
+#define AFFINITY_MAX 0x100
+
+/**
+ * Parse a CPU list such as "0,2-3" into `cpus`.  Returns the number of
+ * CPUs named, or -1 if the list is malformed or names more than `max`.
+ */
+int affinity_parse(const char *list, int *cpus, int max);
+/**
+ * Pin `thread` to `cpu`; 0 on success, an errno value otherwise.
+ * Fails with ENOSYS where threads cannot be pinned.
+ */
+int affinity_pin(pthread_t thread, int cpu);
+
+#endif /* affinity_h */
@@ -0,0 +1,96 @@
+//
+//  backend.h
+//  myhttpd
+//
+//  Created by lastland on 03/01/2017.
+//  Copyright © 2017 DeepSpec. All rights reserved.
+//
+
+#ifndef backend_h
+#define backend_h
+
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include "types.h"
+
+struct epoll_event;
+
+/**
+ * The system calls a daemon makes on its sockets.  Each daemon picks a
+ * backend when it is created and makes every socket call through it, so
+ * the same binary can talk to the kernel directly or through ipcd.
+ * Members take and return the same values as their libc namesakes.
+ */
+struct httpd_backend {
+    const char *name;
+
+    /**
+     * Prepare the backend before the first call; 0 on success.
+     */
+    int (*init)(void);
+    void (*fini)(void);
+
+    int (*socket)(int domain, int type, int protocol);
+    int (*bind)(int socket, const struct sockaddr *address,
+                socklen_t address_len);
+    int (*listen)(int socket, int backlog);
+    int (*accept)(int socket, struct sockaddr *address,
+                  socklen_t *address_len);
+#ifdef __linux__
+    int (*accept4)(int socket, struct sockaddr *address,
+                   socklen_t *address_len, int flags);
+#endif
+    ssize_t (*recv)(int socket, void *buffer, size_t length, int flags);
+    ssize_t (*send)(int socket, const void *buffer, size_t length,
+                    int flags);
+    int (*select)(int nfds, fd_set *readfds, fd_set *writefds,
+                  fd_set *errorfds, struct timeval *timeout);
+    int (*poll)(struct pollfd *fds, nfds_t nfds, int timeout);
+#ifdef __linux__
+    int (*epoll_create1)(int flags);
+    int (*epoll_ctl)(int epfd, int op, int fd, struct epoll_event *event);
+    int (*epoll_wait)(int epfd, struct epoll_event *events, int maxevents,
+                      int timeout);
+#endif
+    int (*fcntl)(int fildes, int cmd, int arg);
+    int (*setsockopt)(int socket, int level, int option_name,
+                      const void *option_value, socklen_t option_len);
+    int (*close)(int fildes);
+    /**
+     * setsockopt() for options whose failure the caller ignores.  The call
+     * may be queued and carried out with the next one, so 0 only means it
+     * was accepted.
+     */
+    int (*post_setsockopt)(int socket, int level, int option_name,
+                           const void *option_value, socklen_t option_len);
+
+    /**
+     * Make a freshly accepted socket non-blocking and close-on-exec.
+     */
+    int (*make_nonblocking_noninheritable)(int socket);
+
+    /**
+     * Readiness engine kept on the other side of the backend, NULL when
+     * the daemon should select() instead.  `watch` queues a change of the
+     * one-shot interest set (see watch_args_t) and `ready` waits up to
+     * `timeout` milliseconds for events, as ipc_watch() and ipc_ready().
+     */
+    int (*watch)(int op, int fd, uint32_t events, uint64_t data);
+    int (*ready)(watch_event_t *events, int maxevents, int timeout);
+
+    /**
+     * Memory shared with the other side of the backend, NULL when there is
+     * none.  `recv` into and `send` from it pass it by reference instead
+     * of copying it, see ipc_region_allocate().
+     */
+    void *(*pool_allocate)(size_t size);
+    void (*pool_release)(void *memory, size_t size);
+};
+
+extern const struct httpd_backend httpd_direct_backend;
+extern const struct httpd_backend httpd_ipc_backend;
+extern const struct httpd_backend httpd_hybrid_backend;
+
+#endif /* backend_h */
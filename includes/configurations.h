@@ -9,7 +9,8 @@
 #ifndef configurations_h
 #define configurations_h
 
-#define DEBUG 1
+/* Build with -DDEBUG to include the IPC self test; logging verbosity is
+ * controlled by LOG_LEVEL_MAX at compile time and LOG_LEVEL at run time. */
 
 #ifdef __linux__
 #define HAVE_SOCKADDR_IN_SIN_LEN 0
@@ -14,5 +14,6 @@
 httpd_status httpd_connection_handle_read(struct httpd_connection* conn);
 httpd_status httpd_connection_handle_write(struct httpd_connection* conn);
 httpd_status httpd_connection_handle_idle(struct httpd_connection* conn);
+void httpd_connection_timed_out(struct httpd_connection* conn);
 
 #endif /* connection_h */
@@ -0,0 +1,181 @@
+//
+//  doorbell.h
+//  myhttpd
+//
+//  Created by Yishuai Li on 01/20/2017.
+//  Copyright © 2017 DeepSpec. All rights reserved.
+//
+
+#include <sched.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#ifndef doorbell_h
+#define doorbell_h
+
+/**
+ * Upper bound of the adaptive spin budget, in polls of the doorbell.
+ */
+#define DOORBELL_SPIN_MAX 0x4000
+/**
+ * Upper bound of the fixed budget of a busy-polling waiter, roughly a
+ * second of polls.
+ */
+#define DOORBELL_POLL_MAX 0x1000000
+/**
+ * Polls between yields of a busy-polling waiter, so that a peer sharing
+ * its CPU still gets to run.
+ */
+#define DOORBELL_POLL_YIELD 0x400
+
+/**
+ * Wake-up word shared between processes.  The ringer bumps `seq`; a
+ * waiter sleeps until `seq` differs from the value it last observed.
+ * `waiters` lets the ringer skip the wake-up syscall when nobody sleeps.
+ */
+typedef struct {
+    uint32_t seq;
+    uint32_t waiters;
+} doorbell_t;
+
+/**
+ * Per-waiter spin state.  `max` is the configured budget (0 disables
+ * spinning), `budget` adapts to how often spinning pays off unless the
+ * waiter is `busy`, in which case it always spins for the whole budget.
+ */
+typedef struct {
+    uint32_t max;
+    uint32_t budget;
+    uint32_t busy;
+} spinner_t;
+
+/**
+ * Tell the CPU we are spinning, so that it saves power and lets the
+ * sibling hyperthread run.
+ */
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield" ::: "memory");
+#else
+    __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+static inline uint32_t doorbell_peek(doorbell_t *db)
+{
+    return __atomic_load_n(&db->seq, __ATOMIC_ACQUIRE);
+}
+
+static inline void doorbell_ring(doorbell_t *db)
+{
+    __atomic_add_fetch(&db->seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&db->waiters, __ATOMIC_SEQ_CST) == 0)
+        return;
+#ifdef __linux__
+    syscall(SYS_futex, &db->seq, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+#endif
+}
+
+static inline void spinner_init(spinner_t *spin, uint32_t max, int busy)
+{
+    uint32_t limit = busy ? DOORBELL_POLL_MAX : DOORBELL_SPIN_MAX;
+
+    spin->max = max < limit ? max : limit;
+    spin->budget = spin->max;
+    spin->busy = busy != 0;
+}
+
+/**
+ * Block until `db` has been rung since `seen` was peeked, or until the
+ * relative `timeout` (NULL for none) elapses.  Polls for up to the
+ * spinner's budget first, then sleeps in the kernel.  Unless the spinner
+ * is busy, the budget doubles whenever a spin succeeds and halves whenever
+ * it is wasted.  Returns 0 when rung and -1 on timeout.
+ */
+static inline int doorbell_wait_timed(doorbell_t *db, uint32_t seen,
+                                      spinner_t *spin,
+                                      const struct timespec *timeout)
+{
+    struct timespec deadline, now, left;
+    int ret = 0;
+    uint32_t i;
+
+    for (i = 0; i < spin->budget; i++)
+    {
+        if (doorbell_peek(db) != seen)
+        {
+            if (spin->budget < spin->max)
+                spin->budget = spin->budget * 2 < spin->max ?
+                               spin->budget * 2 : spin->max;
+            return 0;
+        }
+        if (spin->busy && (i + 1) % DOORBELL_POLL_YIELD == 0)
+            sched_yield();
+        else
+            cpu_relax();
+    }
+    if (!spin->busy)
+    {
+        if (spin->budget > 1)
+            spin->budget /= 2;
+        else if (spin->max != 0)
+            spin->budget = 1;
+    }
+
+    if (timeout != NULL)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout->tv_sec;
+        deadline.tv_nsec += timeout->tv_nsec;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+    __atomic_add_fetch(&db->waiters, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&db->seq, __ATOMIC_SEQ_CST) == seen)
+    {
+        if (timeout != NULL)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            left.tv_sec = deadline.tv_sec - now.tv_sec;
+            left.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+            if (left.tv_nsec < 0)
+            {
+                left.tv_sec--;
+                left.tv_nsec += 1000000000L;
+            }
+            if (left.tv_sec < 0)
+            {
+                ret = -1;
+                break;
+            }
+        }
+#ifdef __linux__
+        syscall(SYS_futex, &db->seq, FUTEX_WAIT, seen,
+                timeout != NULL ? &left : NULL, NULL, 0);
+#else
+        struct timespec nap = { 0, 20000 };
+        nanosleep(&nap, NULL);
+#endif
+    }
+    __atomic_sub_fetch(&db->waiters, 1, __ATOMIC_SEQ_CST);
+    return ret;
+}
+
+static inline void doorbell_wait(doorbell_t *db, uint32_t seen,
+                                 spinner_t *spin)
+{
+    doorbell_wait_timed(db, seen, spin, NULL);
+}
+
+#endif /* doorbell_h */
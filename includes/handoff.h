@@ -0,0 +1,32 @@
+//
+//  handoff.h
+//  ipcd
+//
+//  Created by Yishuai Li on 02/09/2017.
+//  Copyright © 2017 DeepSpec. All rights reserved.
+//
+
+#include "types.h"
+
+#ifndef handoff_h
+#define handoff_h
+
+/**
+ * Listening sockets ipcd accepts on behalf of hybrid servers at once.
+ */
+#define MAX_HANDOFFS 16
+
+/**
+ * Start a thread accepting on `socket` and sending each connection to the
+ * datagram socket at `address`.  The thread stops by itself, closing
+ * `socket`, once nobody receives at `address` any more.
+ */
+int handoff_start(int socket, const struct sockaddr_un *address,
+                  socklen_t address_len, stats_t *stats);
+/**
+ * Stop accepting on `socket`, if a handoff thread does.
+ */
+void handoff_stop(int socket);
+void handoff_stop_all();
+
+#endif /* handoff_h */
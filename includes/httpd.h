@@ -124,7 +124,136 @@ enum HTTPD_ResponseMemoryMode
 };
 
 
-struct httpd_daemon* create_daemon(uint16_t, HTTPD_AccessHandlerCallback, void*);
+/**
+ * Options passed to create_daemon after the handler, each followed by its
+ * value.  The list ends with HTTPD_OPTION_END.
+ */
+enum HTTPD_OPTION
+{
+    
+    /**
+     * No more options.
+     */
+    HTTPD_OPTION_END = 0,
+    
+    /**
+     * How the daemon makes its socket calls, followed by an
+     * `enum HTTPD_Backend`.  Defaults to HTTPD_BACKEND_IPC.
+     */
+    HTTPD_OPTION_BACKEND = 1,
+    
+    /**
+     * Whether to place connection memory pools in memory shared with the
+     * backend, followed by an `int` (HTTPD_YES or HTTPD_NO).  Only the IPC
+     * backend shares memory; ipcd then receives requests into and sends
+     * responses from the pools in place.  Defaults to HTTPD_NO.
+     */
+    HTTPD_OPTION_SHARED_POOLS = 2,
+    
+    /**
+     * CPU to pin the daemon's thread to, followed by an `int`; -1, the
+     * default, leaves it to the scheduler.  With a thread pool the n-th
+     * thread is pinned to the n-th CPU from there.
+     */
+    HTTPD_OPTION_CPU = 3,
+    
+    /**
+     * How the daemon waits for its sockets, followed by an
+     * `enum HTTPD_EventLoop`.  Defaults to HTTPD_EVENT_LOOP_AUTO.
+     */
+    HTTPD_OPTION_EVENT_LOOP = 4,
+    
+    /**
+     * Number of event loop threads, followed by an `unsigned int`.  Each
+     * thread listens on a socket of its own, bound to the same port with
+     * SO_REUSEPORT so that the kernel spreads connections among them, and
+     * serves its connections alone.  Defaults to 1.
+     */
+    HTTPD_OPTION_THREAD_POOL_SIZE = 5,
+    
+    /**
+     * Connections accepted at most per wake-up of the listening socket,
+     * followed by an `unsigned int`; the rest wait for the next iteration
+     * so that a connection storm does not starve established clients.
+     * Defaults to 32.
+     */
+    HTTPD_OPTION_ACCEPT_BUDGET = 6,
+    
+    /**
+     * Seconds a client may take, followed by an `unsigned int`: to send a
+     * whole request from its first byte, to start the next request on a
+     * kept-alive connection, and to make progress while a request body or
+     * a response is transferred.  The connection is closed once any of
+     * these runs out; 0 never times a connection out.  Defaults to 30.
+     */
+    HTTPD_OPTION_CONNECTION_TIMEOUT = 7
+    
+};
+
+enum HTTPD_EventLoop
+{
+    
+    /**
+     * The backend's own readiness engine if it has one, else epoll where
+     * available, else poll.
+     */
+    HTTPD_EVENT_LOOP_AUTO = 0,
+    
+    /**
+     * select() over read and write sets kept up to date as connections
+     * change what they wait for; limited to FD_SETSIZE sockets.
+     */
+    HTTPD_EVENT_LOOP_SELECT = 1,
+    
+    /**
+     * Edge-triggered epoll, re-registering a connection only when the
+     * events it waits for change.  Linux only.
+     */
+    HTTPD_EVENT_LOOP_EPOLL = 2,
+    
+    /**
+     * The backend's readiness engine; only the IPC backend has one.
+     */
+    HTTPD_EVENT_LOOP_BACKEND = 3,
+    
+    /**
+     * poll() over an array kept up to date as connections come and go;
+     * limited only by the process's descriptor limit.
+     */
+    HTTPD_EVENT_LOOP_POLL = 4,
+    
+    /**
+     * io_uring: connections arrive through a multishot accept and report
+     * readiness through multishot polls, all submitted and reaped with
+     * one system call per iteration.  Linux and the direct backend only;
+     * falls back to epoll when the kernel lacks support.
+     */
+    HTTPD_EVENT_LOOP_URING = 5
+    
+};
+
+enum HTTPD_Backend
+{
+    
+    /**
+     * Proxy every socket call through ipcd.
+     */
+    HTTPD_BACKEND_IPC = 0,
+    
+    /**
+     * Call the kernel directly.
+     */
+    HTTPD_BACKEND_DIRECT = 1,
+    
+    /**
+     * Let ipcd listen and accept, but serve each connection directly
+     * once ipcd has handed it over.
+     */
+    HTTPD_BACKEND_HYBRID = 2
+    
+};
+
+struct httpd_daemon* create_daemon(uint16_t, HTTPD_AccessHandlerCallback, void*, ...);
 
 void stop_daemon(struct httpd_daemon* daemon);
 
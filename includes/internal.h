@@ -12,9 +12,21 @@
 
 #define HTTPD_BUF_INC_SIZE 1024
 #define HTTPD_POOL_SIZE_DEFAULT (32 * 1024)
+#define HTTPD_ACCEPT_BUDGET_DEFAULT 32
+#define HTTPD_CONNECTION_SLAB_SIZE 64
+#define HTTPD_CONNECTION_TIMEOUT_DEFAULT 30
+
+/**
+ * The timer wheel of a loop: slots of HTTPD_WHEEL_TICK milliseconds, so
+ * that a revolution spans about half a minute.
+ */
+#define HTTPD_WHEEL_SLOTS 256
+#define HTTPD_WHEEL_TICK 128
 
 #include "httpd.h"
+#include "backend.h"
 #include "memorypool.h"
+#include "uring.h"
 
 #define MAX(a,b) (((a)<(b)) ? (b) : (a))
 #define MIN(a,b) (((a)<(b)) ? (a) : (b))
@@ -209,8 +221,41 @@ struct httpd_HTTP_header {
 };
 
 
+/**
+ * A socket's registration with the backend's readiness engine, epoll or
+ * io_uring: whether it was added, the events it is armed for (none once a
+ * one-shot registration has fired) and the events reported since the
+ * daemon last looked.  `ready` persists until a call would block; while
+ * it or the connection's handler leaves work to do, the connection is
+ * `queued` on the daemon's run queue, linked through `next`.  `tag` tells
+ * io_uring's current poll request of the socket from those it has
+ * cancelled.
+ */
+struct httpd_watch {
+    int added;
+    uint32_t armed;
+    uint32_t ready;
+    int queued;
+    struct httpd_connection* next;
+    uint32_t tag;
+};
+
+
+/**
+ * A connection's place in its loop's timer wheel: the slot it is listed
+ * on, if `armed`, and the deadline it was filed under.
+ */
+struct httpd_timer {
+    struct httpd_connection* prev;
+    struct httpd_connection* next;
+    uint64_t expires;
+    size_t slot;
+    int armed;
+};
+
+
 struct httpd_connection {
-    struct sockaddr* addr;
+    struct sockaddr_storage addr;
     socklen_t addr_len;
     struct httpd_daemon* daemon;
     httpd_socket socket;
@@ -234,6 +279,11 @@ struct httpd_connection {
     struct httpd_connection* prev;
     struct httpd_connection* next;
     enum httpd_connectionEventLoopInfo event_loop_info;
+    struct httpd_watch watch;
+    size_t poll_index;
+    struct httpd_timer timer;
+    uint64_t last_activity;
+    uint64_t request_start;
     
     int in_idle;
     
@@ -273,6 +323,16 @@ struct httpd_connection {
 };
 
 
+/**
+ * Connection records are carved from slabs and recycled through a free
+ * list of their loop, each keeping the pool of its last connection.
+ */
+struct httpd_connection_slab {
+    struct httpd_connection_slab* next;
+    struct httpd_connection connections[HTTPD_CONNECTION_SLAB_SIZE];
+};
+
+
 struct httpd_response {
     struct httpd_HTTP_header *first_header;
     char* data;
@@ -291,21 +351,91 @@ struct httpd_response {
 };
 
 struct httpd_daemon {
+    const struct httpd_backend* backend;
     httpd_socket socket;
+    struct httpd_watch watch;
     httpd_thread_handle pid;
+    int running;
+    int cpu;
+    enum HTTPD_EventLoop event_loop;
+    int epfd;
+    uring_t uring;
+    int uring_multishot;
+    uint32_t uring_tag;
+    /**
+     * Called whenever a connection's event_loop_info changes, so that the
+     * loop can update its registration; NULL if the loop does not care.
+     */
+    void (*interest_changed)(struct httpd_connection* conn);
     httpd_status shutdown;
     
     unsigned int connections;
     unsigned int connection_limit;
     struct httpd_connection* connections_head;
     struct httpd_connection* connections_tail;
+    /**
+     * Connections closed during the current iteration, unlinked from the
+     * list above; their sockets are closed and they are freed together at
+     * the end of the iteration.
+     */
+    struct httpd_connection* cleanup_head;
+    struct httpd_connection* cleanup_tail;
+    struct httpd_connection_slab* slabs;
+    struct httpd_connection* free_connections;
+    struct httpd_connection** watched;
+    size_t watched_size;
+    /**
+     * The connections to run in the next iteration, in order.  Whatever
+     * the loop, only these reach their handlers.
+     */
+    struct httpd_connection* queue_head;
+    struct httpd_connection* queue_tail;
+    /**
+     * The select() sets, kept up to date as connections come, change
+     * interest and go; `max_fd` only ever grows.
+     */
+    fd_set read_set;
+    fd_set write_set;
+    httpd_socket max_fd;
+    /**
+     * The poll() set: the listening socket first, then one entry per
+     * connection, compacted by moving the last entry into a freed slot.
+     * `polled` holds the connection of each entry.
+     */
+    struct pollfd* pollfds;
+    struct httpd_connection** polled;
+    size_t poll_count;
+    size_t poll_size;
     int at_limit;
+    unsigned int accept_budget;
+    /**
+     * The loop's clock in milliseconds, read once per iteration, and its
+     * timer wheel: `wheel[i]` lists the connections whose deadline falls
+     * in a tick congruent to i, and the deadlines of ticks up to
+     * `wheel_tick` have been enforced.
+     */
+    uint64_t now;
+    uint64_t connection_timeout;
+    struct httpd_connection* wheel[HTTPD_WHEEL_SLOTS];
+    uint64_t wheel_tick;
+    unsigned int timers;
     
     size_t pool_size;
     size_t pool_increment;
+    httpd_status shared_pools;
     
     HTTPD_AccessHandlerCallback default_handler;
     void *default_handler_cls;
+    
+    /**
+     * Event loops of a thread pool, each a copy of this daemon with its
+     * own listening socket, connections and thread; the daemon that
+     * created them runs no loop itself.  `master` points back from a
+     * worker.
+     */
+    struct httpd_daemon* worker_pool;
+    unsigned int worker_pool_size;
+    struct httpd_daemon* master;
 };
 
 
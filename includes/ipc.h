@@ -7,53 +7,241 @@
 //
 
 #include "types.h"
+#include <poll.h>
 
 #ifndef ipc_h
 #define ipc_h
 
-int accept(int socket,
-           struct sockaddr * __restrict address,
-           socklen_t * __restrict address_len);
-int bind(int socket,
-         const struct sockaddr *address,
-         socklen_t address_len);
-int close1(int fildes);
-int fcntl3(int fildes,
-           int cmd,
-           int arg);
-int fcntl2(int fildes,
-           int cmd);
-int listen(int socket,
-           int backlog);
-ssize_t recv(int socket,
-             void *buffer,
-             size_t length,
-             int flags);
-int select(int nfds,
-           fd_set *__restrict readfds,
-           fd_set *__restrict writefds,
-           fd_set *__restrict errorfds,
-           struct timeval *__restrict timeout);
-ssize_t send(int socket,
-             const void *buffer,
-             size_t length,
-             int flags);
-int setsockopt(int socket,
-               int level,
-               int option_name,
-               const void *option_value,
-               socklen_t option_len);
-int socket(int domain,
-           int type,
-           int protocol);
+struct epoll_event;
+struct iovec;
+struct msghdr;
+
+/*
+ * Counterparts of the socket calls that ipcd executes on the server's
+ * behalf.  They take and return the same values as their libc namesakes.
+ */
+int ipc_accept(int socket,
+               struct sockaddr * __restrict address,
+               socklen_t * __restrict address_len);
+#ifdef __linux__
+int ipc_accept4(int socket,
+                struct sockaddr * __restrict address,
+                socklen_t * __restrict address_len,
+                int flags);
+#endif
+int ipc_bind(int socket,
+             const struct sockaddr *address,
+             socklen_t address_len);
+int ipc_closefd(int fildes);
+#ifdef __linux__
+int ipc_epoll_create1(int flags);
+int ipc_epoll_ctl(int epfd,
+                  int op,
+                  int fd,
+                  struct epoll_event *event);
+int ipc_epoll_wait(int epfd,
+                   struct epoll_event *events,
+                   int maxevents,
+                   int timeout);
+#endif
+int ipc_fcntl(int fildes,
+              int cmd,
+              int arg);
+/**
+ * Have ipcd accept connections on the listening `socket` and pass them to
+ * the datagram socket bound at `address`, see handoff_t.
+ */
+int ipc_handoff(int socket,
+                const struct sockaddr_un *address,
+                socklen_t address_len);
+int ipc_listen(int socket,
+               int backlog);
+/**
+ * Arrays beyond one payload window are polled a window at a time; only the
+ * first window waits for `timeout`, and only if the others are all quiet.
+ */
+int ipc_poll(struct pollfd *fds,
+             nfds_t nfds,
+             int timeout);
+ssize_t ipc_recv(int socket,
+                 void *buffer,
+                 size_t length,
+                 int flags);
+int ipc_select(int nfds,
+               fd_set *__restrict readfds,
+               fd_set *__restrict writefds,
+               fd_set *__restrict errorfds,
+               struct timeval *__restrict timeout);
+ssize_t ipc_send(int socket,
+                 const void *buffer,
+                 size_t length,
+                 int flags);
+#ifdef __linux__
+ssize_t ipc_sendfile(int out_fd,
+                     int in_fd,
+                     off_t *offset,
+                     size_t count);
+#endif
+ssize_t ipc_sendmsg(int socket,
+                    const struct msghdr *message,
+                    int flags);
+int ipc_setsockopt(int socket,
+                   int level,
+                   int option_name,
+                   const void *option_value,
+                   socklen_t option_len);
+int ipc_shutdown(int socket,
+                 int how);
+int ipc_socket(int domain,
+               int type,
+               int protocol);
+ssize_t ipc_writev(int fildes,
+                   const struct iovec *iov,
+                   int iovcnt);
+
+/**
+ * Change the interest set of this thread's readiness engine in ipcd, see
+ * watch_args_t.  ipc_prep_watch() queues the change for the next
+ * ipc_ready() instead of waiting for it.
+ */
+int ipc_watch(int op,
+              int fd,
+              uint32_t events,
+              uint64_t data);
+/**
+ * Publish the queued calls, then take up to `maxevents` events from the
+ * channel's event ring, waiting up to `timeout` milliseconds (-1 for ever)
+ * for the first one.  Returns the number of events taken.
+ */
+int ipc_ready(watch_event_t *events,
+              int maxevents,
+              int timeout);
 #ifdef DEBUG
 int test(int a, int b);
 #endif
 
-int ipc_init(const char *mem_name, const char *sem_name);
+int ipc_init(const char *mem_name);
 void ipc_close();
+
+/**
+ * Take `size` bytes from the region this process shares with ipcd, NULL
+ * if it is exhausted or cannot be created.  ipc_recv() and ipc_send() on
+ * such memory pass it to ipcd by offset instead of copying it through the
+ * ring.
+ */
+void *ipc_region_allocate(size_t size);
+void ipc_region_release(void *memory, size_t size);
+
+/**
+ * Reserve the next ring slot for a call to `op`.  The caller fills in
+ * `args` and hands the slot over with ipc_submit().  Waits while the slot
+ * is still in use by the call RING_SLOTS before it.  Returns NULL with
+ * errno set if this thread has no channel to ipcd, e.g. because all
+ * MAX_CHANNELS are taken.
+ */
+msg_t *ipc_prepare(opcode op);
+/**
+ * Publish every prepared slot to ipcd.
+ */
+void ipc_submit();
+/**
+ * Block until ipcd has executed `msg`, publishing it first if needed.
+ * Its `ret` and `args` stay valid until RING_SLOTS further calls have been
+ * prepared.  Calls complete in submission order, so waiting for the last
+ * call of a batch waits for the whole batch.
+ */
+void ipc_wait(msg_t *msg);
+/**
+ * Wait for `msg` and return its result, setting errno if it failed.  A NULL
+ * `msg` from a failed prepare yields -1 with errno left as it was.
+ */
+ssize_t ipc_result(msg_t *msg);
+/**
+ * Per-opcode counters and latency histograms kept by ipcd, or NULL before
+ * ipc_init().
+ */
+const stats_t *ipc_stats();
+
+/*
+ * Submission helpers: each reserves a slot and fills it in without
+ * publishing it, so that a burst of independent calls can be handed to
+ * ipcd with a single ipc_submit() and reaped with a single ipc_wait().
+ * Payloads longer than BUFFER_SIZE are truncated to one window unless
+ * they lie in the shared region; addresses and socket options too long
+ * for their fixed fields make the call fail with EINVAL.  Like
+ * ipc_prepare() they return NULL when no slot can be reserved, and callers
+ * must check before touching the message.
+ */
+msg_t *ipc_prep_accept(int socket,
+                       socklen_t address_len);
+msg_t *ipc_prep_accept4(int socket,
+                        socklen_t address_len,
+                        int flags);
+msg_t *ipc_prep_bind(int socket,
+                     const struct sockaddr *address,
+                     socklen_t address_len);
+msg_t *ipc_prep_close(int fildes);
+msg_t *ipc_prep_epoll_create1(int flags);
+msg_t *ipc_prep_epoll_ctl(int epfd,
+                          int op,
+                          int fd,
+                          uint32_t events,
+                          uint64_t data);
+msg_t *ipc_prep_epoll_wait(int epfd,
+                           int maxevents,
+                           int timeout);
+msg_t *ipc_prep_fcntl(int fildes,
+                      int cmd,
+                      int arg);
+msg_t *ipc_prep_handoff(int socket,
+                        const struct sockaddr_un *address,
+                        socklen_t address_len);
+msg_t *ipc_prep_listen(int socket,
+                       int backlog);
+msg_t *ipc_prep_poll(const struct pollfd *fds,
+                     nfds_t nfds,
+                     int timeout);
+msg_t *ipc_prep_recv(int socket,
+                     size_t length,
+                     int flags);
+msg_t *ipc_prep_select(int nfds,
+                       const fd_set *readfds,
+                       const fd_set *writefds,
+                       const fd_set *errorfds,
+                       const struct timeval *timeout);
+msg_t *ipc_prep_send(int socket,
+                     const void *buffer,
+                     size_t length,
+                     int flags);
+msg_t *ipc_prep_sendfile(int out_fd,
+                         int in_fd,
+                         int64_t offset,
+                         size_t count);
+msg_t *ipc_prep_sendmsg(int socket,
+                        const struct msghdr *message,
+                        int flags);
+msg_t *ipc_prep_setsockopt(int socket,
+                           int level,
+                           int option_name,
+                           const void *option_value,
+                           socklen_t option_len);
+msg_t *ipc_prep_shutdown(int socket,
+                         int how);
+msg_t *ipc_prep_socket(int domain,
+                       int type,
+                       int protocol);
+msg_t *ipc_prep_watch(int op,
+                      int fd,
+                      uint32_t events,
+                      uint64_t data);
+msg_t *ipc_prep_writev(int fildes,
+                       const struct iovec *iov,
+                       int iovcnt);
 #ifdef DEBUG
-void ipc_test();
+/**
+ * Time `rounds` TEST round trips through ipcd and print their latency.
+ */
+void ipc_test(unsigned rounds);
 #endif
 
 #endif /* ipc_h */
@@ -9,9 +9,49 @@
 #ifndef ipcd_h
 #define ipcd_h
 
+#include "affinity.h"
 #include "types.h"
 
-int ipcd_init(const char *mem_name, const char *sem_name);
-void ipcd_close(const char *mem_name, const char *sem_name);
+/**
+ * Spin budget advertised to both sides of the channel, 0 disables spinning.
+ * With `ipcd_busy` set both sides spend the whole budget on every wait
+ * instead of adapting it.
+ */
+extern unsigned ipcd_spin;
+extern int ipcd_busy;
+
+/**
+ * CPUs to pin channel workers to, round robin; none when the count is 0.
+ */
+extern int ipcd_cpus[AFFINITY_MAX];
+extern int ipcd_cpu_count;
+
+/**
+ * Trace file to record every completed call to, or to answer calls from
+ * instead of executing them.  NULL disables either.
+ */
+extern const char *ipcd_record;
+extern const char *ipcd_replay;
+
+/**
+ * Requests to serve from virtual clients over an in-memory network, 0 to
+ * use the kernel's.  See vnet.h.
+ */
+extern unsigned long ipcd_vnet;
+extern unsigned ipcd_vnet_clients;
+extern const char *ipcd_vnet_request;
+
+/**
+ * The `length` bytes named by payload `offset` on the channel of `ring`,
+ * in its arena or in the server's shared region, or NULL if out of range.
+ */
+void *ipcd_payload(ring_t *ring, size_t offset, size_t length);
+
+int ipcd_init(const char *mem_name);
+/**
+ * Print the per-opcode counters and latency percentiles to stderr.
+ */
+void ipcd_stats();
+void ipcd_close(const char *mem_name);
 
 #endif /* ipcd_h */
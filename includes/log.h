@@ -0,0 +1,55 @@
+//
+//  log.h
+//  myhttpd
+//
+//  Created by Yishuai Li on 01/20/2017.
+//  Copyright © 2017 DeepSpec. All rights reserved.
+//
+
+#ifndef log_h
+#define log_h
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+
+/**
+ * Most verbose level compiled in; calls above it cost nothing.
+ */
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX LOG_LEVEL_DEBUG
+#endif
+
+/**
+ * Most verbose level logged at run time, LOG_LEVEL_INFO unless the
+ * LOG_LEVEL environment variable (error, warn, info or debug) says
+ * otherwise when log_init() runs.
+ */
+extern int log_level;
+
+void log_init();
+/**
+ * Format a record into the calling thread's log ring without blocking.
+ * A background thread writes the rings out to stderr; records that find
+ * their ring full are counted and dropped.
+ */
+void log_write(int level, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+/**
+ * Write out everything logged so far and stop the writer thread.
+ */
+void log_close();
+
+#define log_at(level, ...) \
+    do { \
+        if ((level) <= LOG_LEVEL_MAX && (level) <= log_level) \
+            log_write((level), __VA_ARGS__); \
+    } while (0)
+
+#define log_error(...) log_at(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_info(...) log_at(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+#endif /* log_h */
@@ -13,10 +13,23 @@
 
 struct MemoryPool;
 
-struct MemoryPool* httpd_pool_create(size_t max);
+/**
+ * Create a pool of `max` bytes.  With a `backend` that has a shared region
+ * the memory is taken from it, so that the backend can receive into and
+ * send from the pool without copying; otherwise, or once the region is
+ * exhausted, the pool is private.
+ */
+struct MemoryPool* httpd_pool_create(size_t max,
+                                     const struct httpd_backend* backend);
 
 void httpd_pool_destroy(struct MemoryPool* pool);
 
+/**
+ * Empty `pool` for another connection, keeping its memory mapped.  What
+ * was allocated is zeroed again, as in a fresh pool.
+ */
+void httpd_pool_recycle(struct MemoryPool* pool);
+
 void* httpd_pool_allocate(struct MemoryPool* pool,
                           size_t size, httpd_status from_end);
 
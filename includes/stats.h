@@ -0,0 +1,65 @@
+//
+//  stats.h
+//  myhttpd
+//
+//  Created by Yishuai Li on 01/20/2017.
+//  Copyright © 2017 DeepSpec. All rights reserved.
+//
+
+#include "types.h"
+#include <time.h>
+
+#ifndef stats_h
+#define stats_h
+
+static inline uint64_t stats_clock()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static inline unsigned stats_bucket(uint64_t ns)
+{
+    return ns == 0 ? 0 : 63 - __builtin_clzll(ns);
+}
+
+static inline void stats_add(stats_t *stats, opcode op, stats_phase phase,
+                             uint64_t ns)
+{
+    opstats_t *ops;
+    uint64_t max;
+
+    if (stats == NULL || (unsigned)op >= STATS_OPCODES)
+        return;
+    ops = &stats->ops[op];
+    __atomic_add_fetch(&ops->total[phase], ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&ops->buckets[phase][stats_bucket(ns)], 1,
+                       __ATOMIC_RELAXED);
+    max = __atomic_load_n(&ops->max[phase], __ATOMIC_RELAXED);
+    while (ns > max &&
+           !__atomic_compare_exchange_n(&ops->max[phase], &max, ns, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/**
+ * Account for one call completed by ipcd, picked up at `start` and
+ * finished at `end`.
+ */
+static inline void stats_complete(stats_t *stats, const msg_t *msg,
+                                  uint64_t start, uint64_t end)
+{
+    if (stats == NULL || (unsigned)msg->op >= OPCODE_COUNT)
+        return;
+    __atomic_add_fetch(&stats->ops[msg->op].calls, 1, __ATOMIC_RELAXED);
+    if (msg->err != 0)
+        __atomic_add_fetch(&stats->ops[msg->op].errors, 1, __ATOMIC_RELAXED);
+    stats_add(stats, msg->op, STATS_QUEUE,
+              msg->submitted != 0 && start > msg->submitted ?
+              start - msg->submitted : 0);
+    stats_add(stats, msg->op, STATS_EXECUTE, end - start);
+}
+
+#endif /* stats_h */
@@ -0,0 +1,59 @@
+//
+//  trace.h
+//  ipcd
+//
+//  Created by Yishuai Li on 02/09/2017.
+//  Copyright © 2017 DeepSpec. All rights reserved.
+//
+
+#include "types.h"
+
+#ifndef trace_h
+#define trace_h
+
+#define TRACE_MAGIC 0x54435049
+#define TRACE_VERSION 5
+
+/**
+ * A trace file starts with this header and continues with one record per
+ * completed call, in completion order across all channels.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+} trace_header_t;
+
+/**
+ * Fixed part of a record.  It is followed by `args_size` bytes of the
+ * call's arguments as they stood after execution, `in_size` bytes of
+ * request payload and `out_size` bytes of response payload.  `timestamp`
+ * is CLOCK_MONOTONIC nanoseconds when ipcd picked the call up and
+ * `duration` the nanoseconds it spent executing it.
+ */
+typedef struct {
+    uint64_t timestamp;
+    uint32_t duration;
+    uint16_t channel;
+    uint16_t op;
+    int32_t  err;
+    uint32_t args_size;
+    uint32_t in_size;
+    uint32_t out_size;
+    ret_t    ret;
+} trace_record_t;
+
+int trace_record_open(const char *path);
+void trace_record(int channel, ring_t *ring, const msg_t *msg,
+                  uint64_t start, uint64_t end);
+
+/**
+ * Answer `msg` from the next record of `channel` instead of executing it.
+ * Returns -1 once the channel's records are used up or the server asked
+ * for a different call than the one recorded.
+ */
+int trace_replay_open(const char *path);
+int trace_replay(int channel, ring_t *ring, msg_t *msg);
+
+void trace_close();
+
+#endif /* trace_h */
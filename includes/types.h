@@ -6,16 +6,20 @@
 //  Copyright © 2017 DeepSpec. All rights reserved.
 //
 
+#include "doorbell.h"
 #include <stddef.h>
 #include <stdint.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
 
 #ifndef types_h
 #define types_h
 
 #define BUFFER_SIZE 0x10000
 #define OPTION_SIZE 0x100
+#define IOV_SIZE 0x10
 
 typedef uint32_t    socklen_t;
 
@@ -24,18 +28,30 @@ struct timeval;
 
 typedef enum {
     ACCEPT,
+    ACCEPT4,
     BIND,
     CLOSE,
+    EPOLL_CREATE1,
+    EPOLL_CTL,
+    EPOLL_WAIT,
     FCNTL,
+    HANDOFF,
     LISTEN,
+    POLL,
     RECV,
     SELECT,
     SEND,
+    SENDFILE,
+    SENDMSG,
     SETSOCKOPT,
-    SOCKET
+    SHUTDOWN,
+    SOCKET,
+    WATCH,
+    WRITEV
 #ifdef DEBUG
     , TEST
 #endif
+    , OPCODE_COUNT
 } opcode;
 
 typedef struct {
@@ -44,6 +60,13 @@ typedef struct {
     socklen_t address_len;
 } accept_args_t;
 
+typedef struct {
+    int socket;
+    struct sockaddr address;
+    socklen_t address_len;
+    int flags;
+} accept4_args_t;
+
 typedef struct {
     int socket;
     struct sockaddr address;
@@ -54,22 +77,69 @@ typedef struct {
     int fildes;
 } close_args_t;
 
+typedef struct {
+    int flags;
+} epoll_create1_args_t;
+
+/**
+ * `events` and `data` mirror struct epoll_event, which is packed on some
+ * architectures and therefore not embedded as is.
+ */
+typedef struct {
+    int epfd;
+    int op;
+    int fd;
+    uint32_t events;
+    uint64_t data;
+} epoll_ctl_args_t;
+
+/**
+ * Ready events are written to the payload arena at `offset` as an array of
+ * struct epoll_event.
+ */
+typedef struct {
+    int epfd;
+    int maxevents;
+    int timeout;
+    size_t offset;
+} epoll_wait_args_t;
+
 typedef struct {
     int fildes;
     int cmd;
     int arg;
 } fcntl_args_t;
 
+/**
+ * Ask ipcd to accept connections on the listening `socket` from now on
+ * and pass each of them to the server's datagram socket at `address`.
+ */
+typedef struct {
+    int socket;
+    struct sockaddr_un address;
+    socklen_t address_len;
+} handoff_args_t;
+
 typedef struct {
     int socket;
     int backlog;
 } listen_args_t;
 
+/**
+ * The descriptors lie in the payload arena at `offset` as an array of
+ * `nfds` struct pollfd, in which ipcd fills in `revents`.
+ */
+typedef struct {
+    unsigned int nfds;
+    int timeout;
+    size_t offset;
+} poll_args_t;
+
 typedef struct {
     int socket;
     size_t length;
     int flags;
-    char buffer[BUFFER_SIZE];
+    size_t offset;
 } recv_args_t;
 
 typedef struct {
@@ -84,9 +154,34 @@ typedef struct {
     int socket;
     size_t length;
     int flags;
-    unsigned char buffer[BUFFER_SIZE];
+    size_t offset;
 } send_args_t;
 
+/**
+ * ipcd cannot see the server's descriptors, so `in_fd` is reopened through
+ * /proc from the server's side.  `offset` is always explicit.
+ */
+typedef struct {
+    int out_fd;
+    int in_fd;
+    int64_t offset;
+    size_t count;
+} sendfile_args_t;
+
+/**
+ * The gathered bytes of all `iovlen` vectors lie back to back in the
+ * payload arena at `offset`.  Ancillary data is not supported.
+ */
+typedef struct {
+    int socket;
+    int flags;
+    struct sockaddr_storage name;
+    socklen_t namelen;
+    int iovlen;
+    size_t iov_len[IOV_SIZE];
+    size_t offset;
+} sendmsg_args_t;
+
 typedef struct {
     int socket;
     int level;
@@ -95,12 +190,50 @@ typedef struct {
     unsigned char option_value[OPTION_SIZE];
 } setsockopt_args_t;
 
+typedef struct {
+    int socket;
+    int how;
+} shutdown_args_t;
+
 typedef struct {
     int domain;
     int type;
     int protocol;
 } socket_args_t;
 
+typedef enum {
+    WATCH_ADD,
+    WATCH_MODIFY,
+    WATCH_REMOVE
+} watch_op;
+
+#define WATCH_IN  0x1
+#define WATCH_OUT 0x2
+#define WATCH_ERR 0x4
+#define WATCH_HUP 0x8
+
+/**
+ * Add, re-arm or remove `fd` in the interest set of the channel's
+ * readiness engine.  A registration is one-shot: it reports at most one
+ * event, carrying `data`, and stays silent until WATCH_MODIFY re-arms it.
+ */
+typedef struct {
+    int op;
+    int fd;
+    uint32_t events;
+    uint64_t data;
+} watch_args_t;
+
+/**
+ * Same payload layout as sendmsg_args_t.
+ */
+typedef struct {
+    int fildes;
+    int iovcnt;
+    size_t iov_len[IOV_SIZE];
+    size_t offset;
+} writev_args_t;
+
 #ifdef DEBUG
 typedef struct {
     int a;
@@ -109,30 +242,52 @@ typedef struct {
 #endif
 
 typedef int accept_ret_t;
+typedef int accept4_ret_t;
 typedef int bind_ret_t;
 typedef int close_ret_t;
+typedef int epoll_create1_ret_t;
+typedef int epoll_ctl_ret_t;
+typedef int epoll_wait_ret_t;
 typedef int fcntl_ret_t;
+typedef int handoff_ret_t;
 typedef int listen_ret_t;
+typedef int poll_ret_t;
 typedef ssize_t recv_ret_t;
 typedef int select_ret_t;
 typedef ssize_t send_ret_t;
+typedef ssize_t sendfile_ret_t;
+typedef ssize_t sendmsg_ret_t;
 typedef int setsockopt_ret_t;
+typedef int shutdown_ret_t;
 typedef int socket_ret_t;
+typedef int watch_ret_t;
+typedef ssize_t writev_ret_t;
 #ifdef DEBUG
 typedef int test_ret_t;
 #endif
 
 typedef union {
     accept_args_t       accept_args;
+    accept4_args_t      accept4_args;
     bind_args_t         bind_args;
     close_args_t        close_args;
+    epoll_create1_args_t epoll_create1_args;
+    epoll_ctl_args_t    epoll_ctl_args;
+    epoll_wait_args_t   epoll_wait_args;
     fcntl_args_t        fcntl_args;
+    handoff_args_t      handoff_args;
     listen_args_t       listen_args;
+    poll_args_t         poll_args;
     recv_args_t         recv_args;
     select_args_t       select_args;
     send_args_t         send_args;
+    sendfile_args_t     sendfile_args;
+    sendmsg_args_t      sendmsg_args;
     setsockopt_args_t   setsockopt_args;
+    shutdown_args_t     shutdown_args;
     socket_args_t       socket_args;
+    watch_args_t        watch_args;
+    writev_args_t       writev_args;
 #ifdef DEBUG
     test_args_t         test_args;
 #endif
@@ -140,26 +295,239 @@ typedef union {
 
 typedef union {
     accept_ret_t        accept_ret;
+    accept4_ret_t       accept4_ret;
     bind_ret_t          bind_ret;
     close_ret_t         close_ret;
+    epoll_create1_ret_t epoll_create1_ret;
+    epoll_ctl_ret_t     epoll_ctl_ret;
+    epoll_wait_ret_t    epoll_wait_ret;
     fcntl_ret_t         fcntl_ret;
+    handoff_ret_t       handoff_ret;
     listen_ret_t        listen_ret;
+    poll_ret_t          poll_ret;
     recv_ret_t          recv_ret;
     select_ret_t        select_ret;
     send_ret_t          send_ret;
+    sendfile_ret_t      sendfile_ret;
+    sendmsg_ret_t       sendmsg_ret;
     setsockopt_ret_t    setsockopt_ret;
+    shutdown_ret_t      shutdown_ret;
     socket_ret_t        socket_ret;
+    watch_ret_t         watch_ret;
+    writev_ret_t        writev_ret;
 #ifdef DEBUG
     test_ret_t          test_ret;
 #endif
 } ret_t;
 
+/**
+ * One slot of the request ring.  The server fills in `op` and `args`,
+ * stamps the slot with its sequence number and publishes it by advancing
+ * the ring head; ipcd executes it, fills in `ret` and the `err` the call
+ * left in errno, and acknowledges it by copying `seq` into `done`.
+ * `submitted` is the CLOCK_MONOTONIC time in nanoseconds at which the
+ * server published the slot.
+ */
 typedef struct {
+    uint64_t seq;
+    uint64_t done;
+    uint64_t submitted;
     opcode op;
+    int    err;
     ret_t  ret;
     args_t args;
 } msg_t;
 
 #define MSG_SIZE sizeof(msg_t)
 
+/**
+ * Number of slots in the request ring, must be a power of two.
+ */
+#define RING_SLOTS 8
+
+/**
+ * Readiness reported by ipcd: the WATCH_* bits that fired and the `data`
+ * of the registration.
+ */
+typedef struct {
+    uint32_t events;
+    uint64_t data;
+} watch_event_t;
+
+/**
+ * Number of slots in the event ring, must be a power of two.
+ */
+#define EVENT_SLOTS 0x400
+
+/**
+ * Bounded single-producer/single-consumer ring of message slots living in
+ * shared memory.  Sequence numbers start at 1; `head` is the last sequence
+ * number published by the server, `tail` the last one completed by ipcd.
+ * The server rings `request` after publishing and ipcd rings `response`
+ * after each completion.  `spin` is the spin budget chosen by ipcd for
+ * both sides, spent in full on every wait when `busy` is set.  Each server
+ * thread owns one ring, created on its first call and announced to ipcd
+ * through the control segment.
+ *
+ * Bulk data does not travel inside `args`: each slot owns a BUFFER_SIZE
+ * window of `arena`, and payload-carrying calls name the bytes they use
+ * by offset into the arena and length.
+ *
+ * Readiness flows the other way through `events`: ipcd appends events
+ * for the descriptors registered with WATCH, advances `event_head` and
+ * rings `ready`; the server consumes them, advances `event_tail` and
+ * rings `consumed`.  ipcd stops collecting events while the ring is full.
+ */
+typedef struct {
+    uint64_t head;
+    uint64_t tail;
+    doorbell_t request;
+    doorbell_t response;
+    uint32_t spin;
+    uint32_t busy;
+    msg_t slots[RING_SLOTS];
+    uint64_t event_head;
+    uint64_t event_tail;
+    doorbell_t ready;
+    doorbell_t consumed;
+    watch_event_t events[EVENT_SLOTS];
+    unsigned char arena[RING_SLOTS * BUFFER_SIZE];
+} ring_t;
+
+#define RING_SIZE sizeof(ring_t)
+
+#define ring_slot(ring, seq) (&(ring)->slots[((seq) - 1) & (RING_SLOTS - 1)])
+
+#define ring_window(ring, msg) (((msg) - (ring)->slots) * (size_t)BUFFER_SIZE)
+
+/**
+ * Payload offsets with REGION_OFFSET set name bytes of the server's shared
+ * region instead of the ring's arena, see channel_entry_t.  Such payloads
+ * are not limited to one window.
+ */
+#define REGION_OFFSET ((size_t)1 << (sizeof(size_t) * 8 - 1))
+#define REGION_SIZE ((size_t)0x10000000)
+
+#define ring_payload(ring, offset, length) \
+    ((offset) <= sizeof((ring)->arena) && \
+     (length) <= sizeof((ring)->arena) - (offset) ? \
+     &(ring)->arena[(offset)] : NULL)
+
+/**
+ * Datagram carrying a connection handed off by ipcd.  The accepted
+ * descriptor travels alongside as SCM_RIGHTS ancillary data.
+ */
+typedef struct {
+    socklen_t address_len;
+    struct sockaddr_storage address;
+} handoff_t;
+
+/**
+ * Maximum number of channels ipcd serves at once.
+ */
+#define MAX_CHANNELS 64
+#define CHANNEL_NAME_SIZE 32
+
+/**
+ * Life cycle of a registry entry.  A server thread claims a FREE entry,
+ * creates its own ring segment, names it in the entry and marks it READY.
+ * ipcd picks it up and marks it SERVING.  The server marks it CLOSING when
+ * it is done; ipcd then removes the segment and frees the entry.
+ */
+typedef enum {
+    CHANNEL_FREE,
+    CHANNEL_CLAIMED,
+    CHANNEL_READY,
+    CHANNEL_SERVING,
+    CHANNEL_CLOSING
+} channel_state;
+
+/**
+ * `region` names a REGION_SIZE segment the server process shares with
+ * ipcd, valid once the server has set `region_size`.  The server carves
+ * connection memory pools out of it so that ipcd can receive into and send
+ * from them in place.
+ */
+typedef struct {
+    uint32_t state;
+    pid_t pid;
+    char name[CHANNEL_NAME_SIZE];
+    char region[CHANNEL_NAME_SIZE];
+    uint64_t region_size;
+} channel_entry_t;
+
+/**
+ * Latency histograms are log-bucketed: bucket i counts latencies of
+ * [2^i, 2^(i+1)) nanoseconds, bucket 0 also counts zero.
+ */
+#define STATS_BUCKETS 64
+
+typedef enum {
+    STATS_QUEUE,
+    STATS_EXECUTE,
+    STATS_ROUND_TRIP,
+    STATS_PHASES
+} stats_phase;
+
+/**
+ * Counters of one opcode.  ipcd accounts for the time a call waited in
+ * the ring and the time it spent executing; the server accounts for the
+ * round trip from publication until it saw the completion.  All fields
+ * are updated with relaxed atomic adds.
+ */
+typedef struct {
+    uint64_t calls;
+    uint64_t errors;
+    uint64_t total[STATS_PHASES];
+    uint64_t max[STATS_PHASES];
+    uint64_t buckets[STATS_PHASES][STATS_BUCKETS];
+} opstats_t;
+
+/**
+ * Rows of the stats table.  A fixed count with room to spare rather than
+ * OPCODE_COUNT, which grows with -DDEBUG, so that builds with and without
+ * DEBUG agree on the control segment layout.
+ */
+#define STATS_OPCODES 0x20
+/**
+ * Row past every opcode for the connections ipcd hands over, kept apart
+ * from the HANDOFF calls that set up the handoff.
+ */
+#define STATS_HANDED_OFF (STATS_OPCODES - 1)
+
+typedef struct {
+    opstats_t ops[STATS_OPCODES];
+} stats_t;
+
+#define CONTROL_MAGIC 0x49504344
+#define CONTROL_VERSION 9
+
+/**
+ * Well-known segment created by ipcd.  ipcd fills in `magic`, `version`
+ * and its `daemon_pid`, then sets `ready` once it is serving; a server
+ * attaches only to a ready segment of its own version whose daemon is
+ * alive.  Servers announce their channels in `channels` and ring
+ * `registry` whenever an entry becomes READY or CLOSING.  Both sides
+ * account for every call in `stats`.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    pid_t daemon_pid;
+    uint32_t ready;
+    doorbell_t registry;
+    uint32_t spin;
+    uint32_t busy;
+    channel_entry_t channels[MAX_CHANNELS];
+    stats_t stats;
+} control_t;
+
+#define CONTROL_SIZE sizeof(control_t)
+
+#define load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define compare_swap(p, old, new) \
+    __atomic_compare_exchange_n((p), (old), (new), 0, \
+                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+
 #endif /* types_h */
@@ -0,0 +1,72 @@
+//
+//  uring.h
+//  myhttpd
+//
+//  Created by Yishuai Li on 02/09/2017.
+//  Copyright © 2017 DeepSpec. All rights reserved.
+//
+
+#include <stddef.h>
+#include <stdint.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#endif
+
+#ifndef uring_h
+#define uring_h
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/**
+ * Just enough of io_uring for an event loop, on top of the raw system
+ * calls.  The submission queue is filled in place and handed to the
+ * kernel by the next uring_wait(); completions are read in place.  A ring
+ * is used by one thread only.
+ */
+typedef struct uring {
+    int fd;
+    void *mem;
+    size_t mem_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_pending;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+} uring_t;
+
+/**
+ * Set up a ring of `entries` submissions.  Fails with ENOSYS unless the
+ * kernel supports everything the daemon needs: accepts, poll requests and
+ * waits with a timeout.  0 on success, -1 with errno set otherwise.
+ */
+int uring_open(uring_t *ring, unsigned entries);
+void uring_close(uring_t *ring);
+/**
+ * A cleared submission queue entry to fill in, submitting what is pending
+ * first if the queue is full; NULL if that fails.
+ */
+struct io_uring_sqe *uring_sqe(uring_t *ring);
+/**
+ * Submit the pending entries and, if `wait` is set, wait up to `timeout`
+ * milliseconds for a completion.  Returns the number of entries
+ * submitted, or -1 with errno set.
+ */
+int uring_wait(uring_t *ring, int wait, int timeout);
+/**
+ * The oldest unseen completion, NULL if there is none.
+ */
+struct io_uring_cqe *uring_cqe(uring_t *ring);
+/**
+ * Hand the completion uring_cqe() returned back to the kernel.
+ */
+void uring_cqe_seen(uring_t *ring);
+
+#endif /* uring_h */
@@ -0,0 +1,48 @@
+//
+//  vnet.h
+//  ipcd
+//
+//  Created by Yishuai Li on 02/09/2017.
+//  Copyright © 2017 DeepSpec. All rights reserved.
+//
+
+#include "types.h"
+
+#ifndef vnet_h
+#define vnet_h
+
+/**
+ * Virtual descriptors, numbered like the kernel's from 3 upwards.
+ */
+#define VNET_SOCKETS 0x1000
+/**
+ * Bytes buffered in each direction of a virtual connection.
+ */
+#define VNET_BUFFER 0x10000
+/**
+ * Connections a virtual listening socket queues at most.
+ */
+#define VNET_BACKLOG 0x100
+
+/**
+ * Simulate the network in memory from now on.  `clients` scripted clients
+ * connect to the first listening socket and send the request read from
+ * `request_path` (a GET of /index.html when NULL) back to back over
+ * keep-alive connections, `requests` times in total.  Once every response
+ * has arrived ipcd reports the rate and shuts itself down.
+ */
+int vnet_open(unsigned long requests, unsigned clients,
+              const char *request_path);
+/**
+ * Execute `msg` on virtual sockets instead of the kernel's, then let the
+ * clients run as far as they can.  Nothing ever blocks: calls that would
+ * fail with EAGAIN and select() timeouts elapse at once.
+ */
+void vnet_execute(ring_t *ring, msg_t *msg, pid_t pid);
+/**
+ * Stop reporting readiness to `ring`, which is about to be unmapped.
+ */
+void vnet_detach(ring_t *ring);
+void vnet_close();
+
+#endif /* vnet_h */
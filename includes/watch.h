@@ -0,0 +1,40 @@
+//
+//  watch.h
+//  ipcd
+//
+//  Created by Yishuai Li on 02/09/2017.
+//  Copyright © 2017 DeepSpec. All rights reserved.
+//
+
+#include "types.h"
+#include <pthread.h>
+#include <stdbool.h>
+
+#ifndef watch_h
+#define watch_h
+
+/**
+ * Readiness engine of one channel: an epoll instance mirroring the
+ * server's interest set and a thread moving its events to the channel's
+ * event ring.  Started by the first WATCH on the channel.
+ */
+typedef struct {
+    ring_t *ring;
+    int epfd;
+    int wake;
+    pthread_t thread;
+    bool started;
+    bool running;
+} watch_t;
+
+/**
+ * Execute a WATCH call from `ring`, see watch_args_t.  Only the channel's
+ * worker thread calls this.
+ */
+int watch_ctl(watch_t *watch, ring_t *ring, const watch_args_t *args);
+/**
+ * Stop the engine once the channel's worker thread has stopped.
+ */
+void watch_close(watch_t *watch);
+
+#endif /* watch_h */
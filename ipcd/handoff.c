@@ -0,0 +1,225 @@
+//
+//  handoff.c
+//  ipcd
+//
+//  Created by Yishuai Li on 02/09/2017.
+//  Copyright © 2017 DeepSpec. All rights reserved.
+//
+
+#define _GNU_SOURCE
+
+#include "handoff.h"
+#include "log.h"
+#include "stats.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/**
+ * One listening socket whose connections ipcd passes on.  Whoever clears
+ * `running` first, the thread when the server has gone or handoff_stop(),
+ * decides what happens to `socket`.  `exited` is set once the thread is
+ * done and only needs joining.
+ */
+typedef struct {
+    pthread_t thread;
+    int socket;
+    struct sockaddr_un address;
+    socklen_t address_len;
+    stats_t *stats;
+    bool used;
+    bool running;
+    bool exited;
+} handoff_slot_t;
+
+handoff_slot_t handoff_slots[MAX_HANDOFFS];
+pthread_mutex_t handoff_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Send `fd` and its peer address through `sender` to the server.  Returns
+ * -1 once the server's socket is gone.
+ */
+static int pass(handoff_slot_t *slot, int sender, int fd,
+                const handoff_t *handoff)
+{
+    union {
+        struct cmsghdr header;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov = { (void *)handoff, sizeof(*handoff) };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_name = &slot->address;
+    msg.msg_namelen = slot->address_len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    while (sendmsg(sender, &msg, 0) == -1)
+    {
+        if (errno == EINTR)
+            continue;
+        log_warn("handoff on %d: %s", slot->socket, strerror(errno));
+        return errno == ECONNREFUSED || errno == ENOENT ? -1 : 0;
+    }
+    return 0;
+}
+
+static void *acceptor(void *cls)
+{
+    handoff_slot_t *slot = cls;
+    handoff_t handoff;
+    uint64_t start;
+    int fd, sender, r = 0;
+    bool expected;
+
+    sender = socket(AF_UNIX, SOCK_DGRAM, 0);
+    while (sender != -1 && r == 0 && load_acquire(&slot->running))
+    {
+        memset(&handoff, 0, sizeof(handoff));
+        handoff.address_len = sizeof(handoff.address);
+#ifdef __linux__
+        /* the server gets the same open file description, ready to use */
+        fd = accept4(slot->socket, (struct sockaddr *)&handoff.address,
+                     &handoff.address_len, SOCK_NONBLOCK);
+#else
+        fd = accept(slot->socket, (struct sockaddr *)&handoff.address,
+                    &handoff.address_len);
+#endif
+        if (fd == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (load_acquire(&slot->running))
+                log_error("handoff on %d: %s", slot->socket,
+                          strerror(errno));
+            break;
+        }
+        start = stats_clock();
+        r = pass(slot, sender, fd, &handoff);
+        close(fd);
+        __atomic_add_fetch(&slot->stats->ops[STATS_HANDED_OFF].calls, 1,
+                           __ATOMIC_RELAXED);
+        stats_add(slot->stats, STATS_HANDED_OFF, STATS_EXECUTE,
+                  stats_clock() - start);
+        log_debug("handed off connection %d from %d", fd, slot->socket);
+    }
+    if (sender != -1)
+        close(sender);
+
+    expected = true;
+    if (compare_swap(&slot->running, &expected, false))
+        /* the server is gone and will not close its listening socket */
+        close(slot->socket);
+    store_release(&slot->exited, true);
+    return NULL;
+}
+
+/**
+ * Join the thread of a slot that has exited or been told to.  Called with
+ * handoff_lock held, which the threads never take.
+ */
+static void reap(handoff_slot_t *slot)
+{
+    pthread_join(slot->thread, NULL);
+    slot->used = false;
+}
+
+int handoff_start(int socket, const struct sockaddr_un *address,
+                  socklen_t address_len, stats_t *stats)
+{
+    handoff_slot_t *slot = NULL;
+    int i;
+
+    if (address_len > sizeof(*address))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&handoff_lock);
+    for (i = 0; i < MAX_HANDOFFS; i++)
+    {
+        if (handoff_slots[i].used && load_acquire(&handoff_slots[i].exited))
+            reap(&handoff_slots[i]);
+        if (handoff_slots[i].used &&
+            load_acquire(&handoff_slots[i].running) &&
+            handoff_slots[i].socket == socket)
+        {
+            pthread_mutex_unlock(&handoff_lock);
+            errno = EBUSY;
+            return -1;
+        }
+        if (!handoff_slots[i].used && slot == NULL)
+            slot = &handoff_slots[i];
+    }
+    if (slot == NULL)
+    {
+        pthread_mutex_unlock(&handoff_lock);
+        errno = EAGAIN;
+        return -1;
+    }
+    slot->socket = socket;
+    memcpy(&slot->address, address, address_len);
+    slot->address_len = address_len;
+    slot->stats = stats;
+    slot->used = true;
+    slot->running = true;
+    slot->exited = false;
+    errno = pthread_create(&slot->thread, NULL, acceptor, slot);
+    if (errno != 0)
+    {
+        slot->used = false;
+        pthread_mutex_unlock(&handoff_lock);
+        return -1;
+    }
+    pthread_mutex_unlock(&handoff_lock);
+    log_info("handing off connections on %d", socket);
+    return 0;
+}
+
+static void stop(handoff_slot_t *slot)
+{
+    bool expected = true;
+
+    if (compare_swap(&slot->running, &expected, false))
+        /* wakes the thread up from accept() */
+        shutdown(slot->socket, SHUT_RDWR);
+    reap(slot);
+}
+
+void handoff_stop(int socket)
+{
+    int i;
+
+    pthread_mutex_lock(&handoff_lock);
+    for (i = 0; i < MAX_HANDOFFS; i++)
+        if (handoff_slots[i].used &&
+            load_acquire(&handoff_slots[i].running) &&
+            handoff_slots[i].socket == socket)
+            stop(&handoff_slots[i]);
+    pthread_mutex_unlock(&handoff_lock);
+}
+
+void handoff_stop_all()
+{
+    int i;
+
+    pthread_mutex_lock(&handoff_lock);
+    for (i = 0; i < MAX_HANDOFFS; i++)
+        if (handoff_slots[i].used)
+            stop(&handoff_slots[i]);
+    pthread_mutex_unlock(&handoff_lock);
+}
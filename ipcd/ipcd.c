@@ -6,218 +6,881 @@
 //  Copyright © 2017 DeepSpec. All rights reserved.
 //
 
+#define _GNU_SOURCE
+
 #include "ipcd.h"
+#include "handoff.h"
+#include "log.h"
+#include "stats.h"
+#include "trace.h"
+#include "vnet.h"
+#include "watch.h"
 #include <errno.h>
 #include <fcntl.h>
-#include <semaphore.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdbool.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#endif
+
+/**
+ * ipcd end of one server thread's channel.
+ */
+typedef struct {
+    pthread_t thread;
+    int fd;
+    ring_t *mem;
+    unsigned char *region;
+    watch_t watch;
+    bool running;
+} worker_t;
 
-int  ipcd_fd;
-msg_t *ipcd_mem;
-sem_t *ipcd_sem;
-pid_t client_pid;
+int  ipcd_fd = -1;
+control_t *ipcd_control;
+worker_t ipcd_workers[MAX_CHANNELS];
+pthread_t ipcd_thread;
+bool ipcd_serving;
+unsigned ipcd_spin;
+int ipcd_busy;
+int ipcd_cpus[AFFINITY_MAX];
+int ipcd_cpu_count;
+const char *ipcd_record;
+const char *ipcd_replay;
+unsigned long ipcd_vnet;
+unsigned ipcd_vnet_clients;
+const char *ipcd_vnet_request;
 
-void respond()
+static int scatter(ring_t *ring,
+                   size_t offset,
+                   const size_t *iov_len,
+                   int iovcnt,
+                   struct iovec *iov)
 {
-    switch (ipcd_mem->op) {
+    size_t total = 0;
+    int i;
+
+    if (iovcnt < 0 || iovcnt > IOV_SIZE)
+        return -1;
+    for (i = 0; i < iovcnt; i++)
+    {
+        iov[i].iov_base = ipcd_payload(ring, offset + total, iov_len[i]);
+        iov[i].iov_len = iov_len[i];
+        if (iov[i].iov_base == NULL)
+            return -1;
+        total += iov_len[i];
+    }
+    return 0;
+}
+
+static void execute(worker_t *worker, msg_t *msg, pid_t pid)
+{
+    ring_t *ring = worker->mem;
+    void *payload;
+    struct iovec iov[IOV_SIZE];
+
+    errno = 0;
+    switch (msg->op) {
         case ACCEPT:
-#ifdef DEBUG
-            fprintf(stderr, "ACCEPT %d %d\n",
-                   ipcd_mem->args.accept_args.socket,
-                   ipcd_mem->args.accept_args.address_len);
-#endif
-            ipcd_mem->ret.accept_ret =
-            accept(ipcd_mem->args.accept_args.socket,
-                   &ipcd_mem->args.accept_args.address,
-                   &ipcd_mem->args.accept_args.address_len);
+            log_debug("ACCEPT %d %d",
+                     msg->args.accept_args.socket,
+                     msg->args.accept_args.address_len);
+            if (msg->args.accept_args.address_len >
+                sizeof(msg->args.accept_args.address))
+                msg->args.accept_args.address_len =
+                sizeof(msg->args.accept_args.address);
+            msg->ret.accept_ret =
+            accept(msg->args.accept_args.socket,
+                   &msg->args.accept_args.address,
+                   &msg->args.accept_args.address_len);
+            break;
+#ifdef __linux__
+        case ACCEPT4:
+            if (msg->args.accept4_args.address_len >
+                sizeof(msg->args.accept4_args.address))
+                msg->args.accept4_args.address_len =
+                sizeof(msg->args.accept4_args.address);
+            msg->ret.accept4_ret =
+            accept4(msg->args.accept4_args.socket,
+                    &msg->args.accept4_args.address,
+                    &msg->args.accept4_args.address_len,
+                    msg->args.accept4_args.flags);
             break;
-        case BIND:
-#ifdef DEBUG
-            fprintf(stderr, "BIND %d %d\n",
-                   ipcd_mem->args.bind_args.socket,
-                   ipcd_mem->args.bind_args.address_len);
 #endif
-            ipcd_mem->ret.bind_ret =
-            bind(ipcd_mem->args.bind_args.socket,
-                 &ipcd_mem->args.bind_args.address,
-                 ipcd_mem->args.bind_args.address_len);
+        case BIND:
+            log_debug("BIND %d %d",
+                     msg->args.bind_args.socket,
+                     msg->args.bind_args.address_len);
+            if (msg->args.bind_args.address_len >
+                sizeof(msg->args.bind_args.address))
+            {
+                msg->ret.bind_ret = -1;
+                errno = EINVAL;
+                break;
+            }
+            msg->ret.bind_ret =
+            bind(msg->args.bind_args.socket,
+                 &msg->args.bind_args.address,
+                 msg->args.bind_args.address_len);
             break;
         case CLOSE:
-#ifdef DEBUG
-            fprintf(stderr, "CLOSE %d\n",
-                   ipcd_mem->args.close_args.fildes);
-#endif
-            ipcd_mem->ret.close_ret =
-            close(ipcd_mem->args.close_args.fildes);
+            log_debug("CLOSE %d",
+                     msg->args.close_args.fildes);
+            handoff_stop(msg->args.close_args.fildes);
+            msg->ret.close_ret =
+            close(msg->args.close_args.fildes);
+            break;
+#ifdef __linux__
+        case EPOLL_CREATE1:
+            msg->ret.epoll_create1_ret =
+            epoll_create1(msg->args.epoll_create1_args.flags);
+            break;
+        case EPOLL_CTL:
+        {
+            struct epoll_event event;
+            event.events = msg->args.epoll_ctl_args.events;
+            event.data.u64 = msg->args.epoll_ctl_args.data;
+            msg->ret.epoll_ctl_ret =
+            epoll_ctl(msg->args.epoll_ctl_args.epfd,
+                      msg->args.epoll_ctl_args.op,
+                      msg->args.epoll_ctl_args.fd,
+                      &event);
+            break;
+        }
+        case EPOLL_WAIT:
+            payload = ring_payload(ring,
+                                   msg->args.epoll_wait_args.offset,
+                                   msg->args.epoll_wait_args.maxevents *
+                                   sizeof(struct epoll_event));
+            if (payload == NULL || msg->args.epoll_wait_args.maxevents < 0)
+            {
+                msg->ret.epoll_wait_ret = -1;
+                errno = EFAULT;
+                break;
+            }
+            msg->ret.epoll_wait_ret =
+            epoll_wait(msg->args.epoll_wait_args.epfd,
+                       payload,
+                       msg->args.epoll_wait_args.maxevents,
+                       msg->args.epoll_wait_args.timeout);
             break;
-        case FCNTL:
-#ifdef DEBUG
-            fprintf(stderr, "FCNTL %d %d %d\n",
-                   ipcd_mem->args.fcntl_args.fildes,
-                   ipcd_mem->args.fcntl_args.cmd,
-                   ipcd_mem->args.fcntl_args.arg);
 #endif
-            ipcd_mem->ret.fcntl_ret =
-            fcntl(ipcd_mem->args.fcntl_args.fildes,
-                  ipcd_mem->args.fcntl_args.cmd,
-                  ipcd_mem->args.fcntl_args.arg);
+        case FCNTL:
+            log_debug("FCNTL %d %d %d",
+                     msg->args.fcntl_args.fildes,
+                     msg->args.fcntl_args.cmd,
+                     msg->args.fcntl_args.arg);
+            msg->ret.fcntl_ret =
+            fcntl(msg->args.fcntl_args.fildes,
+                  msg->args.fcntl_args.cmd,
+                  msg->args.fcntl_args.arg);
+            break;
+        case HANDOFF:
+            log_debug("HANDOFF %d",
+                     msg->args.handoff_args.socket);
+            msg->ret.handoff_ret =
+            handoff_start(msg->args.handoff_args.socket,
+                          &msg->args.handoff_args.address,
+                          msg->args.handoff_args.address_len,
+                          &ipcd_control->stats);
             break;
         case LISTEN:
-#ifdef DEBUG
-            fprintf(stderr, "LISTEN %d %d\n",
-                   ipcd_mem->args.listen_args.socket,
-                   ipcd_mem->args.listen_args.backlog);
-#endif
-            ipcd_mem->ret.listen_ret =
-            listen(ipcd_mem->args.listen_args.socket,
-                   ipcd_mem->args.listen_args.backlog);
+            log_debug("LISTEN %d %d",
+                     msg->args.listen_args.socket,
+                     msg->args.listen_args.backlog);
+            msg->ret.listen_ret =
+            listen(msg->args.listen_args.socket,
+                   msg->args.listen_args.backlog);
+            break;
+        case POLL:
+            log_debug("POLL %u %d",
+                     msg->args.poll_args.nfds,
+                     msg->args.poll_args.timeout);
+            payload = ring_payload(ring,
+                                   msg->args.poll_args.offset,
+                                   msg->args.poll_args.nfds *
+                                   sizeof(struct pollfd));
+            if (payload == NULL)
+            {
+                msg->ret.poll_ret = -1;
+                errno = EFAULT;
+                break;
+            }
+            msg->ret.poll_ret =
+            poll(payload,
+                 msg->args.poll_args.nfds,
+                 msg->args.poll_args.timeout);
             break;
         case RECV:
-#ifdef DEBUG
-            fprintf(stderr, "RECV %d %lu %d\n",
-                   ipcd_mem->args.recv_args.socket,
-                   ipcd_mem->args.recv_args.length,
-                   ipcd_mem->args.recv_args.flags);
-#endif
-            ipcd_mem->ret.recv_ret =
-            recv(ipcd_mem->args.recv_args.socket,
-                 ipcd_mem->args.recv_args.buffer,
-                 ipcd_mem->args.recv_args.length,
-                 ipcd_mem->args.recv_args.flags);
-#ifdef DEBUG
-            fputs(ipcd_mem->args.recv_args.buffer, stderr);
-#endif
+            log_debug("RECV %d %lu %d",
+                     msg->args.recv_args.socket,
+                     msg->args.recv_args.length,
+                     msg->args.recv_args.flags);
+            payload = ipcd_payload(ring,
+                                   msg->args.recv_args.offset,
+                                   msg->args.recv_args.length);
+            if (payload == NULL)
+            {
+                msg->ret.recv_ret = -1;
+                errno = EFAULT;
+                break;
+            }
+            msg->ret.recv_ret =
+            recv(msg->args.recv_args.socket,
+                 payload,
+                 msg->args.recv_args.length,
+                 msg->args.recv_args.flags);
+            if (msg->ret.recv_ret > 0)
+                log_debug("%.*s", (int)msg->ret.recv_ret,
+                          (const char *)payload);
             break;
         case SELECT:
-#ifdef DEBUG
-            fprintf(stderr, "SELECT %d %ld %d\n",
-                   ipcd_mem->args.select_args.nfds,
-                   ipcd_mem->args.select_args.timeout.tv_sec,
-                   ipcd_mem->args.select_args.timeout.tv_usec);
-#endif
-            ipcd_mem->ret.select_ret =
-            select(ipcd_mem->args.select_args.nfds,
-                   &ipcd_mem->args.select_args.readfds,
-                   &ipcd_mem->args.select_args.writefds,
-                   &ipcd_mem->args.select_args.errorfds,
-                   &ipcd_mem->args.select_args.timeout);
+            log_debug("SELECT %d %ld %ld",
+                     msg->args.select_args.nfds,
+                     (long)msg->args.select_args.timeout.tv_sec,
+                     (long)msg->args.select_args.timeout.tv_usec);
+            msg->ret.select_ret =
+            select(msg->args.select_args.nfds,
+                   &msg->args.select_args.readfds,
+                   &msg->args.select_args.writefds,
+                   &msg->args.select_args.errorfds,
+                   &msg->args.select_args.timeout);
             break;
         case SEND:
-#ifdef DEBUG
-            fprintf(stderr, "SEND %d %s %lu %d\n",
-                   ipcd_mem->args.send_args.socket,
-                   ipcd_mem->args.send_args.buffer,
-                   ipcd_mem->args.send_args.length,
-                   ipcd_mem->args.send_args.flags);
+            payload = ipcd_payload(ring,
+                                   msg->args.send_args.offset,
+                                   msg->args.send_args.length);
+            if (payload == NULL)
+            {
+                msg->ret.send_ret = -1;
+                errno = EFAULT;
+                break;
+            }
+            log_debug("SEND %d %.*s %lu %d",
+                     msg->args.send_args.socket,
+                     (int)msg->args.send_args.length,
+                     (const char *)payload,
+                     msg->args.send_args.length,
+                     msg->args.send_args.flags);
+            msg->ret.send_ret =
+            send(msg->args.send_args.socket,
+                 payload,
+                 msg->args.send_args.length,
+                 msg->args.send_args.flags);
+            break;
+#ifdef __linux__
+        case SENDFILE:
+        {
+            char path[64];
+            off_t offset = msg->args.sendfile_args.offset;
+            int in_fd;
+            snprintf(path, sizeof(path), "/proc/%d/fd/%d",
+                     pid, msg->args.sendfile_args.in_fd);
+            in_fd = open(path, O_RDONLY | O_CLOEXEC);
+            if (in_fd == -1)
+            {
+                msg->ret.sendfile_ret = -1;
+                break;
+            }
+            msg->ret.sendfile_ret =
+            sendfile(msg->args.sendfile_args.out_fd,
+                     in_fd,
+                     &offset,
+                     msg->args.sendfile_args.count);
+            if (msg->ret.sendfile_ret < 0)
+            {
+                int err = errno;
+                close(in_fd);
+                errno = err;
+            }
+            else
+                close(in_fd);
+            break;
+        }
 #endif
-            ipcd_mem->ret.send_ret =
-            send(ipcd_mem->args.send_args.socket,
-                 ipcd_mem->args.send_args.buffer,
-                 ipcd_mem->args.send_args.length,
-                 ipcd_mem->args.send_args.flags);
+        case SENDMSG:
+        {
+            struct msghdr message;
+            if (msg->args.sendmsg_args.namelen >
+                sizeof(msg->args.sendmsg_args.name))
+            {
+                msg->ret.sendmsg_ret = -1;
+                errno = EINVAL;
+                break;
+            }
+            if (scatter(ring,
+                        msg->args.sendmsg_args.offset,
+                        msg->args.sendmsg_args.iov_len,
+                        msg->args.sendmsg_args.iovlen,
+                        iov) != 0)
+            {
+                msg->ret.sendmsg_ret = -1;
+                errno = EFAULT;
+                break;
+            }
+            memset(&message, 0, sizeof(message));
+            if (msg->args.sendmsg_args.namelen != 0)
+            {
+                message.msg_name = &msg->args.sendmsg_args.name;
+                message.msg_namelen = msg->args.sendmsg_args.namelen;
+            }
+            message.msg_iov = iov;
+            message.msg_iovlen = msg->args.sendmsg_args.iovlen;
+            msg->ret.sendmsg_ret =
+            sendmsg(msg->args.sendmsg_args.socket,
+                    &message,
+                    msg->args.sendmsg_args.flags);
             break;
+        }
         case SETSOCKOPT:
-#ifdef DEBUG
-            fprintf(stderr, "SETSOCKOPT %d %d %d %d %u\n",
-                   ipcd_mem->args.setsockopt_args.socket,
-                   ipcd_mem->args.setsockopt_args.level,
-                   ipcd_mem->args.setsockopt_args.option_name,
-                   *(int *)ipcd_mem->args.setsockopt_args.option_value,
-                   ipcd_mem->args.setsockopt_args.option_len);
-#endif
-            ipcd_mem->ret.setsockopt_ret =
-            setsockopt(ipcd_mem->args.setsockopt_args.socket,
-                       ipcd_mem->args.setsockopt_args.level,
-                       ipcd_mem->args.setsockopt_args.option_name,
-                       ipcd_mem->args.setsockopt_args.option_value,
-                       ipcd_mem->args.setsockopt_args.option_len);
+            log_debug("SETSOCKOPT %d %d %d %d %u",
+                     msg->args.setsockopt_args.socket,
+                     msg->args.setsockopt_args.level,
+                     msg->args.setsockopt_args.option_name,
+                     *(int *)msg->args.setsockopt_args.option_value,
+                     msg->args.setsockopt_args.option_len);
+            if (msg->args.setsockopt_args.option_len > OPTION_SIZE)
+            {
+                msg->ret.setsockopt_ret = -1;
+                errno = EINVAL;
+                break;
+            }
+            msg->ret.setsockopt_ret =
+            setsockopt(msg->args.setsockopt_args.socket,
+                       msg->args.setsockopt_args.level,
+                       msg->args.setsockopt_args.option_name,
+                       msg->args.setsockopt_args.option_value,
+                       msg->args.setsockopt_args.option_len);
+            break;
+        case SHUTDOWN:
+            msg->ret.shutdown_ret =
+            shutdown(msg->args.shutdown_args.socket,
+                     msg->args.shutdown_args.how);
             break;
         case SOCKET:
-#ifdef DEBUG
-            fprintf(stderr, "SOCKET %d %d %d\n",
-                   ipcd_mem->args.socket_args.domain,
-                   ipcd_mem->args.socket_args.type,
-                   ipcd_mem->args.socket_args.protocol);
-#endif
-            ipcd_mem->ret.socket_ret =
-            socket(ipcd_mem->args.socket_args.domain,
-                   ipcd_mem->args.socket_args.type,
-                   ipcd_mem->args.socket_args.protocol);
+            log_debug("SOCKET %d %d %d",
+                     msg->args.socket_args.domain,
+                     msg->args.socket_args.type,
+                     msg->args.socket_args.protocol);
+            msg->ret.socket_ret =
+            socket(msg->args.socket_args.domain,
+                   msg->args.socket_args.type,
+                   msg->args.socket_args.protocol);
+            break;
+        case WATCH:
+            log_debug("WATCH %d %d %u",
+                     msg->args.watch_args.op,
+                     msg->args.watch_args.fd,
+                     msg->args.watch_args.events);
+            msg->ret.watch_ret =
+            watch_ctl(&worker->watch, ring, &msg->args.watch_args);
+            break;
+        case WRITEV:
+            if (scatter(ring,
+                        msg->args.writev_args.offset,
+                        msg->args.writev_args.iov_len,
+                        msg->args.writev_args.iovcnt,
+                        iov) != 0)
+            {
+                msg->ret.writev_ret = -1;
+                errno = EFAULT;
+                break;
+            }
+            msg->ret.writev_ret =
+            writev(msg->args.writev_args.fildes,
+                   iov,
+                   msg->args.writev_args.iovcnt);
             break;
 #ifdef DEBUG
         case TEST:
-            fprintf(stderr, "TEST: %d + %d\n",
-                   ipcd_mem->args.test_args.a,
-                   ipcd_mem->args.test_args.b);
-            ipcd_mem->ret.test_ret =
-            ipcd_mem->args.test_args.a + ipcd_mem->args.test_args.b;
+            log_debug("TEST: %d + %d",
+                      msg->args.test_args.a,
+                      msg->args.test_args.b);
+            msg->ret.test_ret =
+            msg->args.test_args.a + msg->args.test_args.b;
             break;
 #endif
         default:
+            msg->ret.recv_ret = -1;
+            msg->err = ENOSYS;
             return;
     }
+    msg->err = errno;
+    log_debug("return %d", msg->ret.accept_ret);
+}
+
+void *ipcd_payload(ring_t *ring, size_t offset, size_t length)
+{
+    channel_entry_t *entry;
+    worker_t *worker;
+    struct stat st;
+    int fd, i;
+
+    if ((offset & REGION_OFFSET) == 0)
+        return ring_payload(ring, offset, length);
+    offset &= ~REGION_OFFSET;
+    for (i = 0; i < MAX_CHANNELS && ipcd_workers[i].mem != ring; i++)
+        ;
+    if (i == MAX_CHANNELS)
+        return NULL;
+    worker = &ipcd_workers[i];
+    if (worker->region == NULL)
+    {
+        entry = &ipcd_control->channels[i];
+        if (load_acquire(&entry->region_size) != REGION_SIZE)
+            return NULL;
+        entry->region[CHANNEL_NAME_SIZE - 1] = 0;
+        fd = shm_open(entry->region, O_RDWR, S_IRWXU);
+        if (fd == -1)
+            goto error;
+        if (fstat(fd, &st) == 0 && st.st_size >= (off_t)REGION_SIZE)
+            worker->region = mmap(0, REGION_SIZE, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED, fd, 0);
+        else
+            errno = EINVAL;
+        close(fd);
+        if (worker->region == NULL || worker->region == MAP_FAILED)
+        {
+            worker->region = NULL;
+            goto error;
+        }
+    }
+    if (offset > REGION_SIZE || length > REGION_SIZE - offset)
+        return NULL;
+    return &worker->region[offset];
+
+error:
+    log_error("%s: %s", entry->region, strerror(errno));
+    return NULL;
+}
+
+/**
+ * Complete everything published on `ring`.  Returns false when a replay
+ * has no answer left for the next request.
+ */
+static bool respond(ring_t *ring, channel_entry_t *entry)
+{
+    int channel = (int)(entry - ipcd_control->channels);
+    worker_t *worker = &ipcd_workers[channel];
+    uint64_t head = load_acquire(&ring->head);
+    uint64_t start, end;
+    while (ring->tail != head)
+    {
+        msg_t *msg = ring_slot(ring, ring->tail + 1);
+        start = stats_clock();
+        if (ipcd_replay != NULL)
+        {
+            if (trace_replay(channel, ring, msg) != 0)
+                return false;
+        }
+        else if (ipcd_vnet != 0)
+            vnet_execute(ring, msg, entry->pid);
+        else
+            execute(worker, msg, entry->pid);
+        end = stats_clock();
+        stats_complete(&ipcd_control->stats, msg, start, end);
+        if (ipcd_record != NULL)
+            trace_record(channel, ring, msg, start, end);
+        store_release(&msg->done, msg->seq);
+        store_release(&ring->tail, ring->tail + 1);
+        doorbell_ring(&ring->response);
+        if (ring->tail == head)
+            head = load_acquire(&ring->head);
+    }
+    return true;
+}
+
+static void block_signals()
+{
+    sigset_t mask;
+
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+}
+
+static void *serve(void *cls)
+{
+    channel_entry_t *entry = cls;
+    worker_t *worker = &ipcd_workers[entry - ipcd_control->channels];
+    ring_t *ring = worker->mem;
+    spinner_t spin;
+    uint32_t bell;
+
+    block_signals();
+    spinner_init(&spin, ring->spin, ring->busy);
+    /* the channel may still read READY until attach() has published it */
+    while (load_acquire(&ipcd_serving) &&
+           load_acquire(&entry->state) != CHANNEL_CLOSING)
+    {
+        bell = doorbell_peek(&ring->request);
+        if (!respond(ring, entry) ||
+            load_acquire(&ring->head) == ring->tail)
+            doorbell_wait(&ring->request, bell, &spin);
+    }
+    return NULL;
+}
+
+static void attach(channel_entry_t *entry)
+{
+    worker_t *worker = &ipcd_workers[entry - ipcd_control->channels];
+    uint32_t state = CHANNEL_READY;
+    int cpu;
+
+    worker->mem = MAP_FAILED;
+    worker->fd = shm_open(entry->name, O_RDWR, S_IRWXU);
+    if (worker->fd == -1)
+        goto error;
+    worker->mem = mmap(0, RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       worker->fd, 0);
+    if (worker->mem == MAP_FAILED)
+        goto error;
+    errno = pthread_create(&worker->thread, NULL, serve, entry);
+    if (errno != 0)
+        goto error;
+    worker->running = true;
+    /* a client that closed meanwhile is left CLOSING for the next sweep */
+    compare_swap(&entry->state, &state, CHANNEL_SERVING);
+    if (ipcd_cpu_count > 0)
+    {
+        cpu = ipcd_cpus[(entry - ipcd_control->channels) % ipcd_cpu_count];
+        errno = affinity_pin(worker->thread, cpu);
+        if (errno != 0)
+            log_warn("cannot pin channel %s to CPU %d: %s",
+                     entry->name, cpu, strerror(errno));
+    }
+    log_debug("channel %s attached", entry->name);
+    return;
+
+error:
+    log_error("cannot attach channel %s: %s", entry->name, strerror(errno));
+    if (worker->mem != MAP_FAILED)
+        munmap(worker->mem, RING_SIZE);
+    if (worker->fd != -1)
+        close(worker->fd);
+    worker->mem = MAP_FAILED;
+    worker->fd = -1;
+    shm_unlink(entry->name);
+    entry->pid = 0;
+    entry->region_size = 0;
+    store_release(&entry->state, CHANNEL_FREE);
+}
+
+static bool alive(pid_t pid)
+{
+    return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+static void detach(channel_entry_t *entry)
+{
+    worker_t *worker = &ipcd_workers[entry - ipcd_control->channels];
+
+    if (worker->running)
+    {
+        doorbell_ring(&worker->mem->request);
+        pthread_join(worker->thread, NULL);
+        worker->running = false;
+        watch_close(&worker->watch);
+        if (ipcd_vnet != 0)
+            vnet_detach(worker->mem);
+        munmap(worker->mem, RING_SIZE);
+        close(worker->fd);
+        if (worker->region != NULL)
+            munmap(worker->region, REGION_SIZE);
+        worker->region = NULL;
+    }
+    shm_unlink(entry->name);
+    /* other channels of a live server may still announce its region */
+    if (entry->region_size != 0 &&
+        (!alive(entry->pid) || !load_acquire(&ipcd_serving)))
+        shm_unlink(entry->region);
+    entry->region_size = 0;
+    log_debug("channel %s detached", entry->name);
+    entry->pid = 0;
+    store_release(&entry->state, CHANNEL_FREE);
+}
+
+static void *watch(void *cls)
+{
+    const struct timespec sweep = { 1, 0 };
+    channel_entry_t *entry;
+    spinner_t spin;
+    uint32_t bell;
+    int i;
+
+    (void)cls;
+    block_signals();
+    spinner_init(&spin, 0, 0);
+    while (load_acquire(&ipcd_serving))
+    {
+        bell = doorbell_peek(&ipcd_control->registry);
+        for (i = 0; i < MAX_CHANNELS; i++)
+        {
+            entry = &ipcd_control->channels[i];
+            switch (load_acquire(&entry->state)) {
+                case CHANNEL_READY:
+                    if (alive(entry->pid))
+                        attach(entry);
+                    else
+                        detach(entry);
+                    break;
+                case CHANNEL_CLAIMED:
+                case CHANNEL_SERVING:
+                    /* the owner died without closing its channel */
+                    if (entry->pid != 0 && !alive(entry->pid))
+                    {
+                        store_release(&entry->state, CHANNEL_CLOSING);
+                        detach(entry);
+                    }
+                    break;
+                case CHANNEL_CLOSING:
+                    detach(entry);
+                    break;
+                default:
+                    break;
+            }
+        }
+        doorbell_wait_timed(&ipcd_control->registry, bell, &spin, &sweep);
+    }
+    return NULL;
+}
+
+static const char *opcode_names[STATS_OPCODES] = {
+    [ACCEPT] = "ACCEPT",
+    [ACCEPT4] = "ACCEPT4",
+    [BIND] = "BIND",
+    [CLOSE] = "CLOSE",
+    [EPOLL_CREATE1] = "EPOLL_CREATE1",
+    [EPOLL_CTL] = "EPOLL_CTL",
+    [EPOLL_WAIT] = "EPOLL_WAIT",
+    [FCNTL] = "FCNTL",
+    [HANDOFF] = "HANDOFF",
+    [LISTEN] = "LISTEN",
+    [POLL] = "POLL",
+    [RECV] = "RECV",
+    [SELECT] = "SELECT",
+    [SEND] = "SEND",
+    [SENDFILE] = "SENDFILE",
+    [SENDMSG] = "SENDMSG",
+    [SETSOCKOPT] = "SETSOCKOPT",
+    [SHUTDOWN] = "SHUTDOWN",
+    [SOCKET] = "SOCKET",
+    [WATCH] = "WATCH",
+    [WRITEV] = "WRITEV",
 #ifdef DEBUG
-    fprintf(stderr, "return %d\n", ipcd_mem->ret.accept_ret);
+    [TEST] = "TEST",
 #endif
-    sem_post(ipcd_sem);
+    [STATS_HANDED_OFF] = "handed off",
+};
+
+static const char *phase_names[STATS_PHASES] = {
+    [STATS_QUEUE] = "queue",
+    [STATS_EXECUTE] = "execute",
+    [STATS_ROUND_TRIP] = "round trip",
+};
+
+static char *duration(char *buf, size_t size, double ns)
+{
+    if (ns < 1e3)
+        snprintf(buf, size, "%.0fns", ns);
+    else if (ns < 1e6)
+        snprintf(buf, size, "%.1fus", ns / 1e3);
+    else if (ns < 1e9)
+        snprintf(buf, size, "%.1fms", ns / 1e6);
+    else
+        snprintf(buf, size, "%.1fs", ns / 1e9);
+    return buf;
 }
 
-void ipcd_close(const char *mem_name, const char *sem_name)
+/**
+ * Upper bound of the bucket holding the `permille`th latency of `count`.
+ */
+static double percentile(const uint64_t *buckets, uint64_t count,
+                         unsigned permille)
 {
-    munmap(ipcd_mem, MSG_SIZE);
-    close(ipcd_fd);
-    shm_unlink(mem_name);
-    sem_close(ipcd_sem);
-    sem_unlink(sem_name);
+    uint64_t seen = 0, rank = (count * permille + 999) / 1000;
+    int i;
+
+    for (i = 0; i < STATS_BUCKETS - 1; i++)
+    {
+        seen += buckets[i];
+        if (seen >= rank)
+            break;
+    }
+    return (double)((uint64_t)2 << i);
 }
 
-int ipcd_init(const char *mem_name, const char *sem_name)
+void ipcd_stats()
+{
+    const opstats_t *ops;
+    uint64_t count;
+    char mean[16], p50[16], p99[16], max[16];
+    int op, phase, i, printed;
+
+    if (ipcd_control == NULL)
+        return;
+    fprintf(stderr, "%-14s %10s %8s %-10s %9s %9s %9s %9s\n",
+            "opcode", "calls", "errors", "phase",
+            "mean", "p50<", "p99<", "max");
+    for (op = 0; op < STATS_OPCODES; op++)
+    {
+        ops = &ipcd_control->stats.ops[op];
+        if (load_acquire(&ops->calls) == 0)
+            continue;
+        printed = 0;
+        for (phase = 0; phase < STATS_PHASES; phase++)
+        {
+            count = 0;
+            for (i = 0; i < STATS_BUCKETS; i++)
+                count += load_acquire(&ops->buckets[phase][i]);
+            if (count == 0)
+                continue;
+            if (printed++ == 0)
+                fprintf(stderr, "%-14s %10llu %8llu ",
+                        opcode_names[op] != NULL ? opcode_names[op] : "?",
+                        (unsigned long long)ops->calls,
+                        (unsigned long long)ops->errors);
+            else
+                fprintf(stderr, "%-14s %10s %8s ", "", "", "");
+            fprintf(stderr, "%-10s %9s %9s %9s %9s\n",
+                    phase_names[phase],
+                    duration(mean, sizeof(mean),
+                             (double)ops->total[phase] / count),
+                    duration(p50, sizeof(p50),
+                             percentile(ops->buckets[phase], count, 500)),
+                    duration(p99, sizeof(p99),
+                             percentile(ops->buckets[phase], count, 990)),
+                    duration(max, sizeof(max), (double)ops->max[phase]));
+        }
+    }
+}
+
+void ipcd_close(const char *mem_name)
+{
+    int i;
+
+    if (load_acquire(&ipcd_serving))
+    {
+        store_release(&ipcd_control->ready, 0);
+        store_release(&ipcd_serving, false);
+        doorbell_ring(&ipcd_control->registry);
+        pthread_join(ipcd_thread, NULL);
+        for (i = 0; i < MAX_CHANNELS; i++)
+            if (ipcd_workers[i].running)
+                detach(&ipcd_control->channels[i]);
+        handoff_stop_all();
+    }
+    if (ipcd_vnet != 0)
+        vnet_close();
+    trace_close();
+    if (ipcd_control != MAP_FAILED && ipcd_control != NULL)
+        munmap(ipcd_control, CONTROL_SIZE);
+    ipcd_control = NULL;
+    if (ipcd_fd != -1)
+    {
+        close(ipcd_fd);
+        shm_unlink(mem_name);
+    }
+    ipcd_fd = -1;
+}
+
+/**
+ * Remove a control segment left behind by an ipcd that is no longer
+ * running.  Fails if its owner is still alive.
+ */
+static int reclaim(const char *mem_name)
+{
+    control_t *old;
+    struct stat st;
+    int fd, ret = 0;
+
+    fd = shm_open(mem_name, O_RDWR, S_IRWXU);
+    if (fd == -1)
+        return errno == ENOENT ? 0 : -1;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)CONTROL_SIZE)
+    {
+        old = mmap(0, CONTROL_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+        if (old != MAP_FAILED)
+        {
+            if (old->magic == CONTROL_MAGIC && old->daemon_pid != getpid() &&
+                alive(old->daemon_pid))
+            {
+                log_error("ipcd %d is already serving %s.",
+                          old->daemon_pid, mem_name);
+                ret = -1;
+            }
+            munmap(old, CONTROL_SIZE);
+        }
+    }
+    close(fd);
+    if (ret == 0)
+        shm_unlink(mem_name);
+    return ret;
+}
+
+int ipcd_init(const char *mem_name)
 {
     ipcd_fd = shm_open(mem_name, O_RDWR | O_CREAT | O_EXCL, S_IRWXU);
+    if (ipcd_fd == -1 && errno == EEXIST)
+    {
+        if (reclaim(mem_name) != 0)
+            return -1;
+        ipcd_fd = shm_open(mem_name, O_RDWR | O_CREAT | O_EXCL, S_IRWXU);
+    }
     if (ipcd_fd == -1)
     {
-        fputs(strerror(errno), stderr);
+        log_error("%s: %s", mem_name, strerror(errno));
         goto error;
     }
-    if (ftruncate(ipcd_fd, MSG_SIZE))
+    if (ftruncate(ipcd_fd, CONTROL_SIZE))
     {
-        fputs(strerror(errno), stderr);
+        log_error("%s: %s", mem_name, strerror(errno));
         goto error;
     }
-    ipcd_mem = mmap(0, MSG_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, ipcd_fd, 0);
-    if (ipcd_mem == MAP_FAILED)
+    ipcd_control = mmap(0, CONTROL_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        ipcd_fd, 0);
+    if (ipcd_control == MAP_FAILED)
     {
-        fputs(strerror(errno), stderr);
+        log_error("%s: %s", mem_name, strerror(errno));
         goto error;
     }
 
-    ipcd_sem = sem_open(sem_name, O_CREAT | O_EXCL, S_IRWXU, 0);
-    if (ipcd_sem == SEM_FAILED)
+    ipcd_control->magic = CONTROL_MAGIC;
+    ipcd_control->version = CONTROL_VERSION;
+    ipcd_control->daemon_pid = getpid();
+    ipcd_control->spin = ipcd_spin;
+    ipcd_control->busy = ipcd_busy;
+
+    if (ipcd_replay != NULL && trace_replay_open(ipcd_replay) != 0)
+        goto error;
+    if (ipcd_record != NULL && trace_record_open(ipcd_record) != 0)
+        goto error;
+    if (ipcd_vnet != 0 &&
+        vnet_open(ipcd_vnet, ipcd_vnet_clients, ipcd_vnet_request) != 0)
+        goto error;
+
+    ipcd_serving = true;
+    errno = pthread_create(&ipcd_thread, NULL, watch, NULL);
+    if (errno != 0)
     {
-        fputs(strerror(errno), stderr);
+        ipcd_serving = false;
+        log_error("%s: %s", mem_name, strerror(errno));
         goto error;
     }
-
-    sigset_t mask;
-    sigemptyset(&mask);
-    sigaddset(&mask, SIGUSR1);
-    struct sigaction action;
-    action.sa_handler = respond;
-    action.sa_mask = mask;
-    action.sa_flags = 0;
-    sigaction(SIGUSR1, &action, NULL);
-
-    fprintf(stderr, "server pid: ");
-    scanf("%d", &client_pid);
-    fprintf(stderr, "%d\ndaemon pid: %d\n", client_pid, getpid());
+    store_release(&ipcd_control->ready, 1);
+    doorbell_ring(&ipcd_control->registry);
+    log_debug("daemon pid: %d", getpid());
     return 0;
 
 error:
-    ipcd_close(mem_name, sem_name);
+    ipcd_close(mem_name);
     return -1;
 }
@@ -7,6 +7,7 @@
 //
 
 #include "ipcd.h"
+#include "log.h"
 #include <ctype.h>
 #include <stdio.h>
 #include <limits.h>
@@ -23,10 +24,58 @@ void terminate()
     terminated = true;
 }
 
-int main(int argc, const char * argv[]) {
+bool dumping;
+
+void dump()
+{
+    dumping = true;
+}
+
+int main(int argc, char * const argv[]) {
     const char *mem_name = "ipcm";
-    const char *sem_name = "ipcs";
-    ipcd_init(mem_name, sem_name);
+    int opt;
+
+    log_init();
+    while ((opt = getopt(argc, argv, "s:Ba:r:p:v:c:q:")) != -1)
+        switch (opt) {
+            case 's':
+                ipcd_spin = (unsigned)strtoul(optarg, NULL, 0);
+                break;
+            case 'B':
+                ipcd_busy = 1;
+                break;
+            case 'a':
+                ipcd_cpu_count = affinity_parse(optarg, ipcd_cpus,
+                                                AFFINITY_MAX);
+                if (ipcd_cpu_count < 0)
+                    goto usage;
+                break;
+            case 'r':
+                ipcd_record = optarg;
+                break;
+            case 'p':
+                ipcd_replay = optarg;
+                break;
+            case 'v':
+                ipcd_vnet = strtoul(optarg, NULL, 0);
+                break;
+            case 'c':
+                ipcd_vnet_clients = (unsigned)strtoul(optarg, NULL, 0);
+                break;
+            case 'q':
+                ipcd_vnet_request = optarg;
+                break;
+            default:
+                goto usage;
+        }
+    if (ipcd_record != NULL && ipcd_replay != NULL)
+        goto usage;
+    if (ipcd_vnet != 0 && ipcd_replay != NULL)
+        goto usage;
+    if (ipcd_busy && ipcd_spin == 0)
+        ipcd_spin = DOORBELL_POLL_MAX;
+    if (ipcd_init(mem_name) != 0)
+        return 1;
 
     terminated = false;
     sigset_t mask;
@@ -37,10 +86,26 @@ int main(int argc, const char * argv[]) {
     action.sa_mask = mask;
     action.sa_flags = 0;
     sigaction(SIGINT, &action, NULL);
+    action.sa_handler = dump;
+    sigaction(SIGUSR1, &action, NULL);
     while (!terminated)
+    {
         pause();
+        if (dumping)
+        {
+            dumping = false;
+            ipcd_stats();
+        }
+    }
 
-    ipcd_close(mem_name, sem_name);
+    ipcd_stats();
+    ipcd_close(mem_name);
     
     return 0;
+
+usage:
+    fprintf(stderr, "usage: %s [-s spins] [-B] [-a cpus] "
+            "[-r trace | -p trace] [-v requests [-c clients] [-q request]]\n",
+            argv[0]);
+    return 1;
 }
@@ -0,0 +1,387 @@
+//
+//  trace.c
+//  ipcd
+//
+//  Created by Yishuai Li on 02/09/2017.
+//  Copyright © 2017 DeepSpec. All rights reserved.
+//
+
+#define _GNU_SOURCE
+
+#include "ipcd.h"
+#include "log.h"
+#include "stats.h"
+#include "trace.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+/**
+ * Replay progress of one channel.
+ */
+typedef struct {
+    size_t cursor;
+    uint64_t records;
+    uint64_t calls;
+    uint64_t recorded;
+    uint64_t first;
+    bool done;
+} replay_t;
+
+FILE *trace_file;
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+unsigned char *trace_base = MAP_FAILED;
+size_t trace_length;
+size_t trace_end;
+replay_t trace_channels[MAX_CHANNELS];
+unsigned trace_pending;
+
+static size_t args_size(opcode op)
+{
+    switch (op) {
+        case ACCEPT:        return sizeof(accept_args_t);
+        case ACCEPT4:       return sizeof(accept4_args_t);
+        case BIND:          return sizeof(bind_args_t);
+        case CLOSE:         return sizeof(close_args_t);
+        case EPOLL_CREATE1: return sizeof(epoll_create1_args_t);
+        case EPOLL_CTL:     return sizeof(epoll_ctl_args_t);
+        case EPOLL_WAIT:    return sizeof(epoll_wait_args_t);
+        case FCNTL:         return sizeof(fcntl_args_t);
+        case HANDOFF:       return sizeof(handoff_args_t);
+        case LISTEN:        return sizeof(listen_args_t);
+        case POLL:          return sizeof(poll_args_t);
+        case RECV:          return sizeof(recv_args_t);
+        case SELECT:        return sizeof(select_args_t);
+        case SEND:          return sizeof(send_args_t);
+        case SENDFILE:      return sizeof(sendfile_args_t);
+        case SENDMSG:       return sizeof(sendmsg_args_t);
+        case SETSOCKOPT:    return sizeof(setsockopt_args_t);
+        case SHUTDOWN:      return sizeof(shutdown_args_t);
+        case SOCKET:        return sizeof(socket_args_t);
+        case WATCH:         return sizeof(watch_args_t);
+        case WRITEV:        return sizeof(writev_args_t);
+        default:            return sizeof(args_t);
+    }
+}
+
+static size_t iov_total(const size_t *iov_len, int iovcnt)
+{
+    size_t total = 0;
+    int i;
+
+    for (i = 0; i < iovcnt && i < IOV_SIZE; i++)
+        total += iov_len[i];
+    return total;
+}
+
+/**
+ * Bytes the server handed over with `msg`.
+ */
+static const void *payload_in(ring_t *ring, const msg_t *msg, size_t *size)
+{
+    size_t offset;
+
+    switch (msg->op) {
+        case SEND:
+            offset = msg->args.send_args.offset;
+            *size = msg->args.send_args.length;
+            break;
+        case SENDMSG:
+            offset = msg->args.sendmsg_args.offset;
+            *size = iov_total(msg->args.sendmsg_args.iov_len,
+                              msg->args.sendmsg_args.iovlen);
+            break;
+        case WRITEV:
+            offset = msg->args.writev_args.offset;
+            *size = iov_total(msg->args.writev_args.iov_len,
+                              msg->args.writev_args.iovcnt);
+            break;
+        default:
+            *size = 0;
+            return NULL;
+    }
+    return ipcd_payload(ring, offset, *size);
+}
+
+/**
+ * Window ipcd fills in for `msg`, `size` bytes of it are in use.
+ */
+static void *payload_out(ring_t *ring, const msg_t *msg, size_t size)
+{
+    switch (msg->op) {
+        case RECV:
+            if (size > msg->args.recv_args.length)
+                return NULL;
+            return ipcd_payload(ring, msg->args.recv_args.offset, size);
+        case POLL:
+            if (size > msg->args.poll_args.nfds * sizeof(struct pollfd))
+                return NULL;
+            return ring_payload(ring, msg->args.poll_args.offset, size);
+#ifdef __linux__
+        case EPOLL_WAIT:
+            if (msg->args.epoll_wait_args.maxevents < 0 ||
+                size > msg->args.epoll_wait_args.maxevents *
+                       sizeof(struct epoll_event))
+                return NULL;
+            return ring_payload(ring, msg->args.epoll_wait_args.offset, size);
+#endif
+        default:
+            return NULL;
+    }
+}
+
+static size_t out_size(const msg_t *msg)
+{
+    if (msg->err != 0)
+        return 0;
+    switch (msg->op) {
+        case RECV:
+            return msg->ret.recv_ret > 0 ? msg->ret.recv_ret : 0;
+        case POLL:
+            return msg->ret.poll_ret >= 0 ?
+                   msg->args.poll_args.nfds * sizeof(struct pollfd) : 0;
+#ifdef __linux__
+        case EPOLL_WAIT:
+            return msg->ret.epoll_wait_ret > 0 ?
+                   msg->ret.epoll_wait_ret * sizeof(struct epoll_event) : 0;
+#endif
+        default:
+            return 0;
+    }
+}
+
+int trace_record_open(const char *path)
+{
+    trace_header_t header = { TRACE_MAGIC, TRACE_VERSION };
+
+    trace_file = fopen(path, "wb");
+    if (trace_file == NULL)
+        goto error;
+    setvbuf(trace_file, NULL, _IOFBF, BUFFER_SIZE);
+    if (fwrite(&header, sizeof(header), 1, trace_file) != 1)
+        goto error;
+    return 0;
+
+error:
+    log_error("%s: %s", path, strerror(errno));
+    if (trace_file != NULL)
+        fclose(trace_file);
+    trace_file = NULL;
+    return -1;
+}
+
+void trace_record(int channel, ring_t *ring, const msg_t *msg,
+                  uint64_t start, uint64_t end)
+{
+    trace_record_t record;
+    const void *in;
+    void *out;
+    size_t in_len, out_len;
+
+    in = payload_in(ring, msg, &in_len);
+    if (in == NULL)
+        in_len = 0;
+    out_len = out_size(msg);
+    out = payload_out(ring, msg, out_len);
+    if (out == NULL)
+        out_len = 0;
+
+    memset(&record, 0, sizeof(record));
+    record.timestamp = start;
+    record.duration = end - start > UINT32_MAX ? UINT32_MAX :
+                      (uint32_t)(end - start);
+    record.channel = channel;
+    record.op = msg->op;
+    record.err = msg->err;
+    record.args_size = args_size(msg->op);
+    record.in_size = in_len;
+    record.out_size = out_len;
+    record.ret = msg->ret;
+
+    pthread_mutex_lock(&trace_lock);
+    fwrite(&record, sizeof(record), 1, trace_file);
+    fwrite(&msg->args, record.args_size, 1, trace_file);
+    if (in_len != 0)
+        fwrite(in, in_len, 1, trace_file);
+    if (out_len != 0)
+        fwrite(out, out_len, 1, trace_file);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static size_t record_size(const trace_record_t *record)
+{
+    return sizeof(*record) + record->args_size +
+           record->in_size + record->out_size;
+}
+
+int trace_replay_open(const char *path)
+{
+    trace_header_t header;
+    trace_record_t record;
+    struct stat st;
+    size_t cursor;
+    int fd, i;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1)
+        goto error;
+    trace_length = st.st_size;
+    if (trace_length < sizeof(header))
+    {
+        errno = EINVAL;
+        goto error;
+    }
+    trace_base = mmap(0, trace_length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (trace_base == MAP_FAILED)
+        goto error;
+    close(fd);
+    fd = -1;
+
+    memcpy(&header, trace_base, sizeof(header));
+    if (header.magic != TRACE_MAGIC || header.version != TRACE_VERSION)
+    {
+        log_error("%s: not a version %d trace.", path, TRACE_VERSION);
+        goto fail;
+    }
+    for (cursor = sizeof(header); cursor < trace_length;
+         cursor += record_size(&record))
+    {
+        if (trace_length - cursor < sizeof(record))
+            break;
+        memcpy(&record, trace_base + cursor, sizeof(record));
+        if (record.channel >= MAX_CHANNELS ||
+            trace_length - cursor < record_size(&record))
+            break;
+        trace_channels[record.channel].records++;
+    }
+    if (cursor != trace_length)
+        log_warn("%s: ignoring %zu truncated bytes.", path,
+                 trace_length - cursor);
+    trace_end = cursor;
+
+    for (i = 0; i < MAX_CHANNELS; i++)
+    {
+        trace_channels[i].cursor = sizeof(header);
+        trace_channels[i].done = trace_channels[i].records == 0;
+        if (!trace_channels[i].done)
+            trace_pending++;
+    }
+    if (trace_pending == 0)
+    {
+        log_error("%s: empty trace.", path);
+        goto fail;
+    }
+    return 0;
+
+error:
+    log_error("%s: %s", path, strerror(errno));
+    if (fd != -1)
+        close(fd);
+fail:
+    trace_close();
+    return -1;
+}
+
+/**
+ * Report a channel whose records are used up.  Once every channel is,
+ * the replay is over and ipcd shuts itself down.
+ */
+static void finish(int channel)
+{
+    replay_t *replay = &trace_channels[channel];
+    double elapsed;
+
+    replay->done = true;
+    elapsed = replay->calls != 0 ? (stats_clock() - replay->first) / 1e9 : 0;
+    fprintf(stderr,
+            "channel %d: replayed %llu of %llu calls in %.6f s "
+            "(%.0f calls/s), %.6f s when recorded\n",
+            channel,
+            (unsigned long long)replay->calls,
+            (unsigned long long)replay->records,
+            elapsed,
+            elapsed > 0 ? replay->calls / elapsed : 0.0,
+            replay->recorded / 1e9);
+    if (__atomic_sub_fetch(&trace_pending, 1, __ATOMIC_ACQ_REL) == 0)
+        kill(getpid(), SIGINT);
+}
+
+int trace_replay(int channel, ring_t *ring, msg_t *msg)
+{
+    replay_t *replay = &trace_channels[channel];
+    trace_record_t record;
+    const unsigned char *body;
+    void *out;
+
+    if (replay->done)
+        return -1;
+    do {
+        if (replay->cursor >= trace_end)
+        {
+            finish(channel);
+            return -1;
+        }
+        memcpy(&record, trace_base + replay->cursor, sizeof(record));
+        body = trace_base + replay->cursor + sizeof(record);
+        replay->cursor += record_size(&record);
+    } while (record.channel != channel);
+
+    if (record.op != msg->op)
+    {
+        log_warn("channel %d: server diverged from the trace, "
+                 "opcode %d instead of %d.", channel, msg->op, record.op);
+        finish(channel);
+        return -1;
+    }
+    if (replay->calls++ == 0)
+        replay->first = stats_clock();
+    replay->recorded += record.duration;
+
+    switch (msg->op) {
+        case ACCEPT:
+        case ACCEPT4:
+        case SELECT:
+            if (record.args_size == args_size(msg->op))
+                memcpy(&msg->args, body, record.args_size);
+            break;
+        default:
+            break;
+    }
+    msg->ret = record.ret;
+    msg->err = record.err;
+    if (record.out_size != 0)
+    {
+        out = payload_out(ring, msg, record.out_size);
+        if (out == NULL)
+        {
+            msg->ret.recv_ret = -1;
+            msg->err = EFAULT;
+        }
+        else
+            memcpy(out, body + record.args_size + record.in_size,
+                   record.out_size);
+    }
+    return 0;
+}
+
+void trace_close()
+{
+    if (trace_file != NULL)
+        fclose(trace_file);
+    trace_file = NULL;
+    if (trace_base != MAP_FAILED)
+        munmap(trace_base, trace_length);
+    trace_base = MAP_FAILED;
+}
@@ -0,0 +1,967 @@
+//
+//  vnet.c
+//  ipcd
+//
+//  Created by Yishuai Li on 02/09/2017.
+//  Copyright © 2017 DeepSpec. All rights reserved.
+//
+
+#define _GNU_SOURCE
+
+#include "vnet.h"
+#include "ipcd.h"
+#include "log.h"
+#include "stats.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <sys/uio.h>
+
+#define VNET_HEADER 0x2000
+
+static const char vnet_default_request[] =
+    "GET /index.html HTTP/1.1\r\nHost: vnet\r\n\r\n";
+
+/**
+ * One direction of a connection.  `head` and `tail` count the bytes ever
+ * written and read; `shut` is set once the writer will write no more.
+ */
+typedef struct {
+    uint64_t head;
+    uint64_t tail;
+    bool shut;
+    unsigned char data[VNET_BUFFER];
+} vbuf_t;
+
+/**
+ * A connection between a client and the server, freed once both ends have
+ * let go of it.
+ */
+typedef struct {
+    vbuf_t up;
+    vbuf_t down;
+    int refs;
+    uint16_t port;
+} vconn_t;
+
+typedef enum {
+    VSOCK_FREE,
+    VSOCK_CREATED,
+    VSOCK_BOUND,
+    VSOCK_LISTENING,
+    VSOCK_CONNECTED
+} vsock_state;
+
+/**
+ * A descriptor of the server.  `watch_events` is the one-shot interest
+ * registered with WATCH, armed while `armed` is set; events go to `ring`.
+ */
+typedef struct {
+    vsock_state state;
+    int status_flags;
+    int fd_flags;
+    vconn_t *conn;
+    vconn_t **pending;
+    uint32_t pending_head;
+    uint32_t pending_tail;
+    bool watched;
+    bool armed;
+    uint32_t watch_events;
+    uint64_t watch_data;
+    ring_t *ring;
+} vsock_t;
+
+/**
+ * A scripted client.  While `active` it has a request in flight: `sent`
+ * bytes of it are written, the response header gathers in `header` and
+ * `body_left` bytes of the body are still to come once it is complete.
+ */
+typedef struct {
+    vconn_t *conn;
+    bool active;
+    bool in_body;
+    bool closing;
+    size_t sent;
+    size_t header_length;
+    uint64_t body_left;
+    char header[VNET_HEADER];
+} vclient_t;
+
+pthread_mutex_t vnet_lock = PTHREAD_MUTEX_INITIALIZER;
+vsock_t vnet_sockets[VNET_SOCKETS];
+int vnet_top = 3;
+vclient_t *vnet_clients;
+unsigned vnet_client_count;
+char *vnet_request;
+size_t vnet_request_length;
+bool vnet_request_close;
+unsigned long vnet_requests;
+unsigned long vnet_issued;
+unsigned long vnet_completed;
+unsigned long vnet_failed;
+unsigned long vnet_connections;
+uint64_t vnet_first;
+unsigned char *vnet_scratch;
+
+static uint64_t used(const vbuf_t *buf)
+{
+    return buf->head - buf->tail;
+}
+
+static size_t buf_write(vbuf_t *buf, const void *src, size_t length)
+{
+    size_t room = VNET_BUFFER - used(buf), at, first;
+
+    if (length > room)
+        length = room;
+    at = buf->head % VNET_BUFFER;
+    first = length < VNET_BUFFER - at ? length : VNET_BUFFER - at;
+    memcpy(&buf->data[at], src, first);
+    memcpy(buf->data, (const unsigned char *)src + first, length - first);
+    buf->head += length;
+    return length;
+}
+
+/**
+ * Take up to `length` bytes, dropping them when `dst` is NULL.
+ */
+static size_t buf_read(vbuf_t *buf, void *dst, size_t length)
+{
+    size_t at, first;
+
+    if (length > used(buf))
+        length = used(buf);
+    if (dst != NULL)
+    {
+        at = buf->tail % VNET_BUFFER;
+        first = length < VNET_BUFFER - at ? length : VNET_BUFFER - at;
+        memcpy(dst, &buf->data[at], first);
+        memcpy((unsigned char *)dst + first, buf->data, length - first);
+    }
+    buf->tail += length;
+    return length;
+}
+
+static void release(vconn_t *conn)
+{
+    if (--conn->refs == 0)
+        free(conn);
+}
+
+static vsock_t *lookup(int fd)
+{
+    if (fd < 3 || fd >= vnet_top || vnet_sockets[fd].state == VSOCK_FREE)
+    {
+        errno = EBADF;
+        return NULL;
+    }
+    return &vnet_sockets[fd];
+}
+
+static int allocate()
+{
+    int fd;
+
+    for (fd = 3; fd < VNET_SOCKETS; fd++)
+        if (vnet_sockets[fd].state == VSOCK_FREE)
+        {
+            memset(&vnet_sockets[fd], 0, sizeof(vsock_t));
+            vnet_sockets[fd].state = VSOCK_CREATED;
+            if (fd >= vnet_top)
+                vnet_top = fd + 1;
+            return fd;
+        }
+    errno = EMFILE;
+    return -1;
+}
+
+static vsock_t *listener()
+{
+    int fd;
+
+    for (fd = 3; fd < vnet_top; fd++)
+        if (vnet_sockets[fd].state == VSOCK_LISTENING)
+            return &vnet_sockets[fd];
+    return NULL;
+}
+
+static uint32_t readiness(const vsock_t *sock)
+{
+    uint32_t events = 0;
+
+    switch (sock->state) {
+        case VSOCK_LISTENING:
+            if (sock->pending_head != sock->pending_tail)
+                events |= WATCH_IN;
+            break;
+        case VSOCK_CONNECTED:
+            if (used(&sock->conn->up) != 0 || sock->conn->up.shut)
+                events |= WATCH_IN;
+            if (used(&sock->conn->down) < VNET_BUFFER ||
+                sock->conn->down.shut)
+                events |= WATCH_OUT;
+            if (sock->conn->up.shut && sock->conn->down.shut)
+                events |= WATCH_HUP;
+            break;
+        default:
+            break;
+    }
+    return events;
+}
+
+static void finish()
+{
+    double elapsed = (stats_clock() - vnet_first) / 1e9;
+
+    fprintf(stderr,
+            "vnet: %lu requests over %lu connections in %.6f s "
+            "(%.0f requests/s), %lu failed\n",
+            vnet_completed, vnet_connections, elapsed,
+            elapsed > 0 ? vnet_completed / elapsed : 0.0, vnet_failed);
+    kill(getpid(), SIGINT);
+}
+
+static void complete(vclient_t *client, bool ok)
+{
+    client->active = false;
+    if (!ok)
+        vnet_failed++;
+    if (++vnet_completed == vnet_requests)
+        finish();
+}
+
+static void disconnect(vclient_t *client)
+{
+    client->conn->up.shut = true;
+    release(client->conn);
+    client->conn = NULL;
+    client->closing = false;
+}
+
+/**
+ * Look at the response header gathered so far; false until it is
+ * complete.
+ */
+static bool parse_header(vclient_t *client)
+{
+    char *end, *length;
+    size_t extra;
+
+    client->header[client->header_length] = 0;
+    end = strstr(client->header, "\r\n\r\n");
+    if (end == NULL)
+        return false;
+    end += 4;
+    length = strcasestr(client->header, "\r\nContent-Length:");
+    client->body_left = length != NULL && length < end ?
+                        strtoull(length + 17, NULL, 10) : UINT64_MAX;
+    client->closing = vnet_request_close ||
+                      strcasestr(client->header, "\r\nConnection: close") !=
+                      NULL;
+    extra = client->header_length - (end - client->header);
+    client->body_left -= extra < client->body_left ? extra :
+                         client->body_left;
+    client->in_body = true;
+    return true;
+}
+
+/**
+ * Let `client` do whatever it can without the server.  Returns whether it
+ * did anything.
+ */
+static bool step(vclient_t *client)
+{
+    vsock_t *sock;
+    vconn_t *conn;
+    bool progress = false;
+    size_t n;
+
+    if (!client->active)
+    {
+        if (vnet_issued == vnet_requests)
+            return false;
+        if (vnet_issued++ == 0)
+            vnet_first = stats_clock();
+        client->active = true;
+        client->in_body = false;
+        client->sent = 0;
+        client->header_length = 0;
+        progress = true;
+    }
+    if (client->conn == NULL)
+    {
+        sock = listener();
+        if (sock == NULL ||
+            sock->pending_head - sock->pending_tail == VNET_BACKLOG)
+            return progress;
+        conn = calloc(1, sizeof(vconn_t));
+        if (conn == NULL)
+            return progress;
+        conn->refs = 2;
+        conn->port = (uint16_t)(1024 + vnet_connections++ % 64512);
+        sock->pending[sock->pending_head++ % VNET_BACKLOG] = conn;
+        client->conn = conn;
+        progress = true;
+    }
+    conn = client->conn;
+    if (client->sent < vnet_request_length && !conn->down.shut)
+    {
+        n = buf_write(&conn->up, vnet_request + client->sent,
+                      vnet_request_length - client->sent);
+        client->sent += n;
+        progress |= n != 0;
+    }
+    while (used(&conn->down) != 0 && client->active)
+    {
+        if (!client->in_body)
+        {
+            n = buf_read(&conn->down, client->header + client->header_length,
+                         VNET_HEADER - 1 - client->header_length);
+            client->header_length += n;
+            if (!parse_header(client) &&
+                client->header_length == VNET_HEADER - 1)
+            {
+                log_warn("vnet: response header too long");
+                complete(client, false);
+                disconnect(client);
+                return true;
+            }
+        }
+        else
+            client->body_left -= buf_read(&conn->down, NULL,
+                                          client->body_left < SIZE_MAX ?
+                                          (size_t)client->body_left :
+                                          SIZE_MAX);
+        if (client->in_body && client->body_left == 0)
+            complete(client, true);
+        progress = true;
+    }
+    if (conn->down.shut && used(&conn->down) == 0)
+    {
+        /* the server hung up; a response without length ends here */
+        if (client->active)
+            complete(client, client->in_body &&
+                     client->body_left == UINT64_MAX);
+        disconnect(client);
+        return true;
+    }
+    if (!client->active && client->closing)
+    {
+        disconnect(client);
+        progress = true;
+    }
+    return progress;
+}
+
+/**
+ * Report the readiness of armed registrations to their channels.
+ */
+static void notify()
+{
+    vsock_t *sock;
+    watch_event_t *event;
+    uint32_t events;
+    int fd;
+
+    for (fd = 3; fd < vnet_top; fd++)
+    {
+        sock = &vnet_sockets[fd];
+        if (sock->state == VSOCK_FREE || !sock->armed)
+            continue;
+        events = readiness(sock) &
+                 (sock->watch_events | WATCH_ERR | WATCH_HUP);
+        if (events == 0)
+            continue;
+        if (sock->ring->event_head - load_acquire(&sock->ring->event_tail) ==
+            EVENT_SLOTS)
+            continue;
+        event = &sock->ring->events[sock->ring->event_head &
+                                    (EVENT_SLOTS - 1)];
+        event->events = events;
+        event->data = sock->watch_data;
+        store_release(&sock->ring->event_head, sock->ring->event_head + 1);
+        doorbell_ring(&sock->ring->ready);
+        sock->armed = false;
+    }
+}
+
+static void pump()
+{
+    bool progress;
+    unsigned i;
+
+    do {
+        progress = false;
+        for (i = 0; i < vnet_client_count; i++)
+            progress |= step(&vnet_clients[i]);
+    } while (progress);
+    notify();
+}
+
+static ssize_t vnet_send(int fd, const void *buffer, size_t length)
+{
+    vsock_t *sock = lookup(fd);
+    size_t n;
+
+    if (sock == NULL)
+        return -1;
+    if (sock->state != VSOCK_CONNECTED)
+    {
+        errno = ENOTCONN;
+        return -1;
+    }
+    if (sock->conn->down.shut || sock->conn->refs == 1)
+    {
+        errno = EPIPE;
+        return -1;
+    }
+    n = buf_write(&sock->conn->down, buffer, length);
+    if (n == 0 && length != 0)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    return n;
+}
+
+static ssize_t vnet_sendv(int fd, ring_t *ring, size_t offset,
+                          const size_t *iov_len, int iovcnt)
+{
+    const void *payload;
+    ssize_t total = 0, n;
+    int i;
+
+    if (iovcnt < 0 || iovcnt > IOV_SIZE)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    for (i = 0; i < iovcnt; i++)
+    {
+        payload = ipcd_payload(ring, offset, iov_len[i]);
+        if (payload == NULL)
+        {
+            errno = EFAULT;
+            return -1;
+        }
+        n = vnet_send(fd, payload, iov_len[i]);
+        if (n < 0)
+            return total > 0 ? total : n;
+        total += n;
+        if ((size_t)n < iov_len[i])
+            break;
+        offset += iov_len[i];
+    }
+    return total;
+}
+
+static ssize_t vnet_sendfile(int out_fd, int in_fd, int64_t offset,
+                             size_t count, pid_t pid)
+{
+    char path[64];
+    vsock_t *sock = lookup(out_fd);
+    ssize_t n;
+    int fd;
+
+    if (sock == NULL)
+        return -1;
+    if (sock->state != VSOCK_CONNECTED)
+    {
+        errno = ENOTCONN;
+        return -1;
+    }
+    if (count > VNET_BUFFER - used(&sock->conn->down))
+        count = VNET_BUFFER - used(&sock->conn->down);
+    if (count == 0)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    snprintf(path, sizeof(path), "/proc/%d/fd/%d", pid, in_fd);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    n = pread(fd, vnet_scratch, count, offset);
+    close(fd);
+    if (n <= 0)
+        return n;
+    return vnet_send(out_fd, vnet_scratch, n);
+}
+
+static int vnet_close_fd(int fd)
+{
+    vsock_t *sock = lookup(fd);
+
+    if (sock == NULL)
+        return -1;
+    if (sock->conn != NULL)
+    {
+        sock->conn->down.shut = true;
+        buf_read(&sock->conn->up, NULL, used(&sock->conn->up));
+        release(sock->conn);
+    }
+    if (sock->pending != NULL)
+    {
+        for (; sock->pending_tail != sock->pending_head; sock->pending_tail++)
+        {
+            vconn_t *conn = sock->pending[sock->pending_tail % VNET_BACKLOG];
+            conn->down.shut = true;
+            release(conn);
+        }
+        free(sock->pending);
+    }
+    sock->state = VSOCK_FREE;
+    while (vnet_top > 3 && vnet_sockets[vnet_top - 1].state == VSOCK_FREE)
+        vnet_top--;
+    return 0;
+}
+
+static int vnet_accept(int fd, struct sockaddr *address,
+                       socklen_t *address_len, int flags)
+{
+    vsock_t *sock = lookup(fd), *accepted;
+    struct sockaddr_in peer;
+    vconn_t *conn;
+    int s;
+
+    if (sock == NULL)
+        return -1;
+    if (sock->state != VSOCK_LISTENING)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (sock->pending_head == sock->pending_tail)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    s = allocate();
+    if (s == -1)
+        return -1;
+    conn = sock->pending[sock->pending_tail++ % VNET_BACKLOG];
+    accepted = &vnet_sockets[s];
+    accepted->state = VSOCK_CONNECTED;
+    accepted->conn = conn;
+#ifdef __linux__
+    if (flags & SOCK_NONBLOCK)
+        accepted->status_flags |= O_NONBLOCK;
+    if (flags & SOCK_CLOEXEC)
+        accepted->fd_flags |= FD_CLOEXEC;
+#endif
+    memset(&peer, 0, sizeof(peer));
+    peer.sin_family = AF_INET;
+    peer.sin_port = htons(conn->port);
+    peer.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (*address_len > sizeof(peer))
+        *address_len = sizeof(peer);
+    memcpy(address, &peer, *address_len);
+    return s;
+}
+
+static int vnet_fcntl(int fd, int cmd, int arg)
+{
+    vsock_t *sock = lookup(fd);
+
+    if (sock == NULL)
+        return -1;
+    switch (cmd) {
+        case F_GETFL:
+            return sock->status_flags | O_RDWR;
+        case F_SETFL:
+            sock->status_flags = arg & O_NONBLOCK;
+            return 0;
+        case F_GETFD:
+            return sock->fd_flags;
+        case F_SETFD:
+            sock->fd_flags = arg & FD_CLOEXEC;
+            return 0;
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+}
+
+static int vnet_select(select_args_t *args)
+{
+    fd_set readfds, writefds;
+    uint32_t events;
+    int fd, ready = 0;
+
+    FD_ZERO(&readfds);
+    FD_ZERO(&writefds);
+    for (fd = 0; fd < args->nfds && fd < FD_SETSIZE; fd++)
+    {
+        if (!FD_ISSET(fd, &args->readfds) && !FD_ISSET(fd, &args->writefds))
+            continue;
+        if (lookup(fd) == NULL)
+            return -1;
+        events = readiness(&vnet_sockets[fd]);
+        if (FD_ISSET(fd, &args->readfds) && (events & WATCH_IN))
+        {
+            FD_SET(fd, &readfds);
+            ready++;
+        }
+        if (FD_ISSET(fd, &args->writefds) && (events & WATCH_OUT))
+        {
+            FD_SET(fd, &writefds);
+            ready++;
+        }
+    }
+    args->readfds = readfds;
+    args->writefds = writefds;
+    FD_ZERO(&args->errorfds);
+    args->timeout.tv_sec = 0;
+    args->timeout.tv_usec = 0;
+    return ready;
+}
+
+static int vnet_poll(ring_t *ring, const poll_args_t *args)
+{
+    struct pollfd *fds = (struct pollfd *)
+        ring_payload(ring, args->offset, args->nfds * sizeof(struct pollfd));
+    vsock_t *sock;
+    uint32_t events;
+    unsigned int i;
+    int ready = 0, err = errno;
+
+    if (fds == NULL)
+    {
+        errno = EFAULT;
+        return -1;
+    }
+    for (i = 0; i < args->nfds; i++)
+    {
+        fds[i].revents = 0;
+        if (fds[i].fd < 0)
+            continue;
+        sock = lookup(fds[i].fd);
+        if (sock == NULL)
+            fds[i].revents = POLLNVAL;
+        else
+        {
+            events = readiness(sock);
+            if (events & WATCH_IN)
+                fds[i].revents |= fds[i].events & POLLIN;
+            if (events & WATCH_OUT)
+                fds[i].revents |= fds[i].events & POLLOUT;
+            if (events & WATCH_HUP)
+                fds[i].revents |= POLLHUP;
+        }
+        if (fds[i].revents != 0)
+            ready++;
+    }
+    /* unknown descriptors are reported, not failed */
+    errno = err;
+    return ready;
+}
+
+static int vnet_watch(ring_t *ring, const watch_args_t *args)
+{
+    vsock_t *sock = lookup(args->fd);
+
+    if (sock == NULL)
+        return -1;
+    switch (args->op) {
+        case WATCH_ADD:
+            if (sock->watched)
+            {
+                errno = EEXIST;
+                return -1;
+            }
+            break;
+        case WATCH_MODIFY:
+        case WATCH_REMOVE:
+            if (!sock->watched)
+            {
+                errno = ENOENT;
+                return -1;
+            }
+            break;
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+    sock->watched = args->op != WATCH_REMOVE;
+    sock->armed = sock->watched;
+    sock->watch_events = args->events;
+    sock->watch_data = args->data;
+    sock->ring = ring;
+    return 0;
+}
+
+void vnet_execute(ring_t *ring, msg_t *msg, pid_t pid)
+{
+    vsock_t *sock;
+    void *payload;
+    ssize_t n;
+
+    pthread_mutex_lock(&vnet_lock);
+    errno = 0;
+    switch (msg->op) {
+        case ACCEPT:
+            if (msg->args.accept_args.address_len >
+                sizeof(msg->args.accept_args.address))
+                msg->args.accept_args.address_len =
+                sizeof(msg->args.accept_args.address);
+            msg->ret.accept_ret =
+            vnet_accept(msg->args.accept_args.socket,
+                        &msg->args.accept_args.address,
+                        &msg->args.accept_args.address_len, 0);
+            break;
+        case ACCEPT4:
+            if (msg->args.accept4_args.address_len >
+                sizeof(msg->args.accept4_args.address))
+                msg->args.accept4_args.address_len =
+                sizeof(msg->args.accept4_args.address);
+            msg->ret.accept4_ret =
+            vnet_accept(msg->args.accept4_args.socket,
+                        &msg->args.accept4_args.address,
+                        &msg->args.accept4_args.address_len,
+                        msg->args.accept4_args.flags);
+            break;
+        case BIND:
+            if (msg->args.bind_args.address_len >
+                sizeof(msg->args.bind_args.address))
+            {
+                msg->ret.bind_ret = -1;
+                errno = EINVAL;
+                break;
+            }
+            sock = lookup(msg->args.bind_args.socket);
+            msg->ret.bind_ret = sock == NULL ? -1 : 0;
+            if (sock != NULL)
+                sock->state = VSOCK_BOUND;
+            break;
+        case CLOSE:
+            msg->ret.close_ret = vnet_close_fd(msg->args.close_args.fildes);
+            break;
+        case FCNTL:
+            msg->ret.fcntl_ret = vnet_fcntl(msg->args.fcntl_args.fildes,
+                                            msg->args.fcntl_args.cmd,
+                                            msg->args.fcntl_args.arg);
+            break;
+        case LISTEN:
+            sock = lookup(msg->args.listen_args.socket);
+            msg->ret.listen_ret = -1;
+            if (sock == NULL)
+                break;
+            if (sock->pending == NULL)
+                sock->pending = calloc(VNET_BACKLOG, sizeof(vconn_t *));
+            if (sock->pending == NULL)
+            {
+                errno = ENOMEM;
+                break;
+            }
+            sock->state = VSOCK_LISTENING;
+            msg->ret.listen_ret = 0;
+            break;
+        case POLL:
+            msg->ret.poll_ret = vnet_poll(ring, &msg->args.poll_args);
+            break;
+        case RECV:
+            msg->ret.recv_ret = -1;
+            sock = lookup(msg->args.recv_args.socket);
+            payload = ipcd_payload(ring,
+                                   msg->args.recv_args.offset,
+                                   msg->args.recv_args.length);
+            if (sock == NULL)
+                break;
+            if (payload == NULL)
+                errno = EFAULT;
+            else if (sock->state != VSOCK_CONNECTED)
+                errno = ENOTCONN;
+            else if (used(&sock->conn->up) == 0 && !sock->conn->up.shut)
+                errno = EAGAIN;
+            else
+                msg->ret.recv_ret = buf_read(&sock->conn->up, payload,
+                                             msg->args.recv_args.length);
+            break;
+        case SELECT:
+            msg->ret.select_ret = vnet_select(&msg->args.select_args);
+            break;
+        case SEND:
+            payload = ipcd_payload(ring,
+                                   msg->args.send_args.offset,
+                                   msg->args.send_args.length);
+            if (payload == NULL)
+            {
+                msg->ret.send_ret = -1;
+                errno = EFAULT;
+                break;
+            }
+            msg->ret.send_ret = vnet_send(msg->args.send_args.socket,
+                                          payload,
+                                          msg->args.send_args.length);
+            break;
+        case SENDFILE:
+            msg->ret.sendfile_ret =
+            vnet_sendfile(msg->args.sendfile_args.out_fd,
+                          msg->args.sendfile_args.in_fd,
+                          msg->args.sendfile_args.offset,
+                          msg->args.sendfile_args.count,
+                          pid);
+            break;
+        case SENDMSG:
+            msg->ret.sendmsg_ret =
+            vnet_sendv(msg->args.sendmsg_args.socket, ring,
+                       msg->args.sendmsg_args.offset,
+                       msg->args.sendmsg_args.iov_len,
+                       msg->args.sendmsg_args.iovlen);
+            break;
+        case SETSOCKOPT:
+            if (msg->args.setsockopt_args.option_len > OPTION_SIZE)
+            {
+                msg->ret.setsockopt_ret = -1;
+                errno = EINVAL;
+                break;
+            }
+            msg->ret.setsockopt_ret =
+            lookup(msg->args.setsockopt_args.socket) == NULL ? -1 : 0;
+            break;
+        case SHUTDOWN:
+            sock = lookup(msg->args.shutdown_args.socket);
+            msg->ret.shutdown_ret = -1;
+            if (sock == NULL)
+                break;
+            if (sock->state != VSOCK_CONNECTED)
+            {
+                errno = ENOTCONN;
+                break;
+            }
+            if (msg->args.shutdown_args.how != SHUT_RD)
+                sock->conn->down.shut = true;
+            msg->ret.shutdown_ret = 0;
+            break;
+        case SOCKET:
+            msg->ret.socket_ret = -1;
+            if ((msg->args.socket_args.domain != AF_INET &&
+                 msg->args.socket_args.domain != AF_INET6) ||
+                (msg->args.socket_args.type & 0xf) != SOCK_STREAM)
+            {
+                errno = EAFNOSUPPORT;
+                break;
+            }
+            msg->ret.socket_ret = allocate();
+            if (msg->ret.socket_ret == -1)
+                break;
+            sock = &vnet_sockets[msg->ret.socket_ret];
+#ifdef __linux__
+            if (msg->args.socket_args.type & SOCK_NONBLOCK)
+                sock->status_flags |= O_NONBLOCK;
+            if (msg->args.socket_args.type & SOCK_CLOEXEC)
+                sock->fd_flags |= FD_CLOEXEC;
+#endif
+            break;
+        case WATCH:
+            msg->ret.watch_ret = vnet_watch(ring, &msg->args.watch_args);
+            break;
+        case WRITEV:
+            msg->ret.writev_ret =
+            vnet_sendv(msg->args.writev_args.fildes, ring,
+                       msg->args.writev_args.offset,
+                       msg->args.writev_args.iov_len,
+                       msg->args.writev_args.iovcnt);
+            break;
+        default:
+            msg->ret.recv_ret = -1;
+            errno = ENOSYS;
+            break;
+    }
+    msg->err = errno;
+    pump();
+    n = msg->err;
+    pthread_mutex_unlock(&vnet_lock);
+    errno = (int)n;
+}
+
+void vnet_detach(ring_t *ring)
+{
+    int fd;
+
+    pthread_mutex_lock(&vnet_lock);
+    for (fd = 3; fd < vnet_top; fd++)
+        if (vnet_sockets[fd].ring == ring)
+        {
+            vnet_sockets[fd].watched = false;
+            vnet_sockets[fd].armed = false;
+            vnet_sockets[fd].ring = NULL;
+        }
+    pthread_mutex_unlock(&vnet_lock);
+}
+
+int vnet_open(unsigned long requests, unsigned clients,
+              const char *request_path)
+{
+    FILE *file;
+    long length;
+
+    vnet_requests = requests;
+    vnet_client_count = clients != 0 ? clients : 1;
+    vnet_clients = calloc(vnet_client_count, sizeof(vclient_t));
+    vnet_scratch = malloc(VNET_BUFFER);
+    if (vnet_clients == NULL || vnet_scratch == NULL)
+        goto error;
+    if (request_path == NULL)
+    {
+        vnet_request = strdup(vnet_default_request);
+        if (vnet_request == NULL)
+            goto error;
+        vnet_request_length = strlen(vnet_request);
+        return 0;
+    }
+    file = fopen(request_path, "rb");
+    if (file == NULL)
+        goto error;
+    if (fseek(file, 0, SEEK_END) != 0 || (length = ftell(file)) <= 0 ||
+        fseek(file, 0, SEEK_SET) != 0 ||
+        (vnet_request = calloc(length + 1, 1)) == NULL ||
+        fread(vnet_request, 1, length, file) != (size_t)length)
+    {
+        fclose(file);
+        errno = errno != 0 ? errno : EINVAL;
+        goto error;
+    }
+    fclose(file);
+    vnet_request_length = length;
+    /* the server will not read past a request that asks it to close */
+    vnet_request_close = strcasestr(vnet_request, "\r\nConnection: close") !=
+                         NULL;
+    return 0;
+
+error:
+    log_error("vnet: %s", strerror(errno));
+    vnet_close();
+    return -1;
+}
+
+void vnet_close()
+{
+    unsigned i;
+    int fd;
+
+    pthread_mutex_lock(&vnet_lock);
+    for (i = 0; vnet_clients != NULL && i < vnet_client_count; i++)
+        if (vnet_clients[i].conn != NULL)
+            disconnect(&vnet_clients[i]);
+    for (fd = vnet_top - 1; fd >= 3; fd--)
+        if (vnet_sockets[fd].state != VSOCK_FREE)
+            vnet_close_fd(fd);
+    free(vnet_clients);
+    vnet_clients = NULL;
+    vnet_client_count = 0;
+    free(vnet_request);
+    vnet_request = NULL;
+    free(vnet_scratch);
+    vnet_scratch = NULL;
+    pthread_mutex_unlock(&vnet_lock);
+}
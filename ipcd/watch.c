@@ -0,0 +1,178 @@
+//
+//  watch.c
+//  ipcd
+//
+//  Created by Yishuai Li on 02/09/2017.
+//  Copyright © 2017 DeepSpec. All rights reserved.
+//
+
+#define _GNU_SOURCE
+
+#include "watch.h"
+#include "log.h"
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+#ifdef __linux__
+
+/**
+ * Events taken from epoll at once.
+ */
+#define WATCH_BATCH 64
+
+static uint32_t to_epoll(uint32_t events)
+{
+    return (events & WATCH_IN ? EPOLLIN : 0) |
+           (events & WATCH_OUT ? EPOLLOUT : 0) |
+           (events & WATCH_ERR ? EPOLLERR : 0) |
+           (events & WATCH_HUP ? EPOLLHUP : 0);
+}
+
+static uint32_t from_epoll(uint32_t events)
+{
+    return (events & EPOLLIN ? WATCH_IN : 0) |
+           (events & EPOLLOUT ? WATCH_OUT : 0) |
+           (events & EPOLLERR ? WATCH_ERR : 0) |
+           (events & EPOLLHUP ? WATCH_HUP : 0);
+}
+
+static void *collect(void *cls)
+{
+    watch_t *watch = cls;
+    ring_t *ring = watch->ring;
+    struct epoll_event events[WATCH_BATCH];
+    watch_event_t *event;
+    spinner_t spin;
+    uint64_t head, room;
+    uint32_t bell;
+    int i, n;
+
+    spinner_init(&spin, 0, 0);
+    while (load_acquire(&watch->running))
+    {
+        head = ring->event_head;
+        room = EVENT_SLOTS - (head - load_acquire(&ring->event_tail));
+        if (room == 0)
+        {
+            /* leave the events in epoll until the server catches up */
+            bell = doorbell_peek(&ring->consumed);
+            if (head - load_acquire(&ring->event_tail) == EVENT_SLOTS &&
+                load_acquire(&watch->running))
+                doorbell_wait(&ring->consumed, bell, &spin);
+            continue;
+        }
+        n = epoll_wait(watch->epfd, events,
+                       room < WATCH_BATCH ? (int)room : WATCH_BATCH, -1);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            log_error("epoll_wait: %s", strerror(errno));
+            break;
+        }
+        if (!load_acquire(&watch->running))
+            break;
+        for (i = 0; i < n; i++)
+        {
+            event = &ring->events[head++ & (EVENT_SLOTS - 1)];
+            event->events = from_epoll(events[i].events);
+            event->data = events[i].data.u64;
+        }
+        if (n > 0)
+        {
+            store_release(&ring->event_head, head);
+            doorbell_ring(&ring->ready);
+        }
+    }
+    return NULL;
+}
+
+static int start(watch_t *watch, ring_t *ring)
+{
+    struct epoll_event event;
+
+    watch->ring = ring;
+    watch->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (watch->epfd == -1)
+        return -1;
+    watch->wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (watch->wake == -1)
+        goto error;
+    /* only ever signalled to stop collect() */
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    if (epoll_ctl(watch->epfd, EPOLL_CTL_ADD, watch->wake, &event) == -1)
+        goto error;
+    watch->running = true;
+    errno = pthread_create(&watch->thread, NULL, collect, watch);
+    if (errno != 0)
+        goto error;
+    watch->started = true;
+    return 0;
+
+error:
+    log_error("cannot start readiness engine: %s", strerror(errno));
+    watch->running = false;
+    if (watch->wake != -1)
+        close(watch->wake);
+    close(watch->epfd);
+    return -1;
+}
+
+int watch_ctl(watch_t *watch, ring_t *ring, const watch_args_t *args)
+{
+    static const int ops[] = {
+        [WATCH_ADD] = EPOLL_CTL_ADD,
+        [WATCH_MODIFY] = EPOLL_CTL_MOD,
+        [WATCH_REMOVE] = EPOLL_CTL_DEL,
+    };
+    struct epoll_event event;
+
+    if (args->op < WATCH_ADD || args->op > WATCH_REMOVE)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!watch->started && start(watch, ring) != 0)
+        return -1;
+    memset(&event, 0, sizeof(event));
+    event.events = to_epoll(args->events) | EPOLLONESHOT;
+    event.data.u64 = args->data;
+    return epoll_ctl(watch->epfd, ops[args->op], args->fd, &event);
+}
+
+void watch_close(watch_t *watch)
+{
+    uint64_t one = 1;
+
+    if (!watch->started)
+        return;
+    store_release(&watch->running, false);
+    if (write(watch->wake, &one, sizeof(one)) == -1)
+        log_warn("cannot wake readiness engine: %s", strerror(errno));
+    doorbell_ring(&watch->ring->consumed);
+    pthread_join(watch->thread, NULL);
+    close(watch->wake);
+    close(watch->epfd);
+    watch->started = false;
+}
+
+#else
+
+int watch_ctl(watch_t *watch, ring_t *ring, const watch_args_t *args)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+void watch_close(watch_t *watch)
+{
+}
+
+#endif
@@ -0,0 +1,409 @@
+//
+//  backend.c
+//  myhttpd
+//
+//  Created by lastland on 03/01/2017.
+//  Copyright © 2017 DeepSpec. All rights reserved.
+//
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+#include "backend.h"
+#include "ipc.h"
+
+const char *mem_name = "ipcm";
+
+static int direct_init(void) {
+    return 0;
+}
+
+static void direct_fini(void) {
+}
+
+static int direct_fcntl(int fildes, int cmd, int arg) {
+    return fcntl(fildes, cmd, arg);
+}
+
+static int direct_make_nonblocking_noninheritable(int socket) {
+    int flags;
+
+    flags = fcntl(socket, F_GETFL);
+    if (-1 == flags)
+        return -1;
+    if (flags != (flags | O_NONBLOCK) &&
+        0 != fcntl(socket, F_SETFL, flags | O_NONBLOCK))
+        return -1;
+    flags = fcntl(socket, F_GETFD);
+    if (-1 == flags)
+        return -1;
+    if (flags != (flags | FD_CLOEXEC) &&
+        0 != fcntl(socket, F_SETFD, flags | FD_CLOEXEC))
+        return -1;
+    return 0;
+}
+
+const struct httpd_backend httpd_direct_backend = {
+    .name = "direct",
+    .init = direct_init,
+    .fini = direct_fini,
+    .socket = socket,
+    .bind = bind,
+    .listen = listen,
+    .accept = accept,
+#ifdef __linux__
+    .accept4 = accept4,
+#endif
+    .recv = recv,
+    .send = send,
+    .select = select,
+    .poll = poll,
+#ifdef __linux__
+    .epoll_create1 = epoll_create1,
+    .epoll_ctl = epoll_ctl,
+    .epoll_wait = epoll_wait,
+#endif
+    .fcntl = direct_fcntl,
+    .setsockopt = setsockopt,
+    .close = close,
+    .post_setsockopt = setsockopt,
+    .make_nonblocking_noninheritable = direct_make_nonblocking_noninheritable
+};
+
+static int ipc_backend_init(void) {
+    return ipc_init(mem_name);
+}
+
+static int ipc_make_nonblocking_noninheritable(int socket) {
+    /* A freshly accepted socket has no other status or descriptor flags
+     to preserve, so both can be set blindly in one batch. */
+    msg_t *setfl = ipc_prep_fcntl(socket, F_SETFL, O_NONBLOCK);
+    ssize_t r = ipc_result(ipc_prep_fcntl(socket, F_SETFD, FD_CLOEXEC));
+
+    /* waiting for the second call has completed the first */
+    if (-1 == ipc_result(setfl))
+        return -1;
+    return (int)r;
+}
+
+static int ipc_post_setsockopt(int socket, int level, int option_name,
+                               const void *option_value,
+                               socklen_t option_len) {
+    /* published along with the next call, ahead of it */
+    return NULL != ipc_prep_setsockopt(socket, level, option_name,
+                                       option_value, option_len) ? 0 : -1;
+}
+
+#ifdef __linux__
+static int ipc_backend_watch(int op, int fd, uint32_t events, uint64_t data) {
+    /* published by the next ipc_ready(); failures only cost a wake-up */
+    return ipc_prep_watch(op, fd, events, data) != NULL ? 0 : -1;
+}
+#endif
+
+const struct httpd_backend httpd_ipc_backend = {
+    .name = "ipc",
+    .init = ipc_backend_init,
+    .fini = ipc_close,
+    .socket = ipc_socket,
+    .bind = ipc_bind,
+    .listen = ipc_listen,
+    .accept = ipc_accept,
+#ifdef __linux__
+    .accept4 = ipc_accept4,
+#endif
+    .recv = ipc_recv,
+    .send = ipc_send,
+    .select = ipc_select,
+    .poll = ipc_poll,
+#ifdef __linux__
+    .epoll_create1 = ipc_epoll_create1,
+    .epoll_ctl = ipc_epoll_ctl,
+    .epoll_wait = ipc_epoll_wait,
+#endif
+    .fcntl = ipc_fcntl,
+    .setsockopt = ipc_setsockopt,
+    .close = ipc_closefd,
+    .post_setsockopt = ipc_post_setsockopt,
+    .make_nonblocking_noninheritable = ipc_make_nonblocking_noninheritable,
+#ifdef __linux__
+    .watch = ipc_backend_watch,
+    .ready = ipc_ready,
+#endif
+    .pool_allocate = ipc_region_allocate,
+    .pool_release = ipc_region_release
+};
+
+/*
+ * Hybrid backend: listening sockets live in ipcd, which accepts on them
+ * and hands every connection over through a local datagram socket
+ * standing in for the listening socket.  Connections are then served
+ * with direct calls.
+ */
+
+#define HYBRID_SOCKETS 16
+
+struct hybrid_socket {
+    int local;
+    int remote;
+    struct sockaddr_un address;
+    socklen_t address_len;
+};
+
+static struct hybrid_socket hybrid_sockets[HYBRID_SOCKETS];
+static int hybrid_count;
+static pthread_mutex_t hybrid_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * The ipcd socket standing behind `local`, or -1 if `local` is not a
+ * hybrid socket.  Entries move when another is closed, so only copies
+ * leave the lock.
+ */
+static int hybrid_find(int local) {
+    int i, remote = -1;
+
+    pthread_mutex_lock(&hybrid_lock);
+    for (i = 0; i < hybrid_count; i++)
+        if (hybrid_sockets[i].local == local) {
+            remote = hybrid_sockets[i].remote;
+            break;
+        }
+    pthread_mutex_unlock(&hybrid_lock);
+    return remote;
+}
+
+/**
+ * Remember the handoff address of `local` so that closing it can remove
+ * the address again.
+ */
+static void hybrid_set_address(int local, const struct sockaddr_un* address,
+                               socklen_t address_len) {
+    int i;
+
+    pthread_mutex_lock(&hybrid_lock);
+    for (i = 0; i < hybrid_count; i++)
+        if (hybrid_sockets[i].local == local) {
+            hybrid_sockets[i].address = *address;
+            hybrid_sockets[i].address_len = address_len;
+            break;
+        }
+    pthread_mutex_unlock(&hybrid_lock);
+}
+
+/**
+ * Unlink the entry for `local`, copying it to `taken`, under a single hold
+ * of the lock so that no concurrent removal can move it in between.
+ * Returns 0 if `local` is not a hybrid socket.
+ */
+static int hybrid_take(int local, struct hybrid_socket* taken) {
+    int i, found = 0;
+
+    pthread_mutex_lock(&hybrid_lock);
+    for (i = 0; i < hybrid_count; i++)
+        if (hybrid_sockets[i].local == local) {
+            *taken = hybrid_sockets[i];
+            hybrid_sockets[i] = hybrid_sockets[--hybrid_count];
+            found = 1;
+            break;
+        }
+    pthread_mutex_unlock(&hybrid_lock);
+    return found;
+}
+
+static int hybrid_socket(int domain, int type, int protocol) {
+    struct hybrid_socket* hs;
+    int local, remote, flags = 0;
+
+#if defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+    flags = type & (SOCK_NONBLOCK | SOCK_CLOEXEC);
+#endif
+    if ((AF_INET != domain && AF_INET6 != domain) ||
+        SOCK_STREAM != (type & ~flags))
+        return socket(domain, type, protocol);
+    /* the flags are the local socket's: ipcd accepts on the remote one
+     in a thread of its own, blocking */
+    local = socket(AF_UNIX, SOCK_DGRAM | flags, 0);
+    if (-1 == local)
+        return -1;
+    remote = ipc_socket(domain, type & ~flags, protocol);
+    if (-1 == remote) {
+        close(local);
+        return -1;
+    }
+    pthread_mutex_lock(&hybrid_lock);
+    if (HYBRID_SOCKETS == hybrid_count) {
+        pthread_mutex_unlock(&hybrid_lock);
+        ipc_closefd(remote);
+        close(local);
+        errno = EMFILE;
+        return -1;
+    }
+    hs = &hybrid_sockets[hybrid_count++];
+    memset(hs, 0, sizeof(*hs));
+    hs->local = local;
+    hs->remote = remote;
+    pthread_mutex_unlock(&hybrid_lock);
+    return local;
+}
+
+static int hybrid_bind(int socket, const struct sockaddr *address,
+                       socklen_t address_len) {
+    int remote = hybrid_find(socket);
+
+    if (-1 == remote)
+        return bind(socket, address, address_len);
+    return ipc_bind(remote, address, address_len);
+}
+
+static int hybrid_listen(int socket, int backlog) {
+    int remote = hybrid_find(socket);
+    struct sockaddr_un address;
+    socklen_t address_len;
+
+    if (-1 == remote)
+        return listen(socket, backlog);
+    if (0 != ipc_listen(remote, backlog))
+        return -1;
+    /* Receive handoffs on a private address: an abstract one picked by
+     the kernel on Linux, a file next to the shared memory elsewhere. */
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+#ifdef __linux__
+    address_len = sizeof(sa_family_t);
+#else
+    snprintf(address.sun_path, sizeof(address.sun_path),
+             "/tmp/%s.%d.%d", mem_name, getpid(), socket);
+    unlink(address.sun_path);
+    address_len = sizeof(address);
+#endif
+    if (0 != bind(socket, (struct sockaddr*)&address, address_len))
+        return -1;
+    address_len = sizeof(address);
+    if (0 != getsockname(socket, (struct sockaddr*)&address, &address_len))
+        return -1;
+    hybrid_set_address(socket, &address, address_len);
+    return ipc_handoff(remote, &address, address_len);
+}
+
+/**
+ * Receive the next connection handed over to the local `socket`, passing
+ * `flags` to recvmsg().
+ */
+static int hybrid_receive(int socket, struct sockaddr *address,
+                          socklen_t *address_len, int flags) {
+    union {
+        struct cmsghdr header;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    handoff_t handoff;
+    struct iovec iov = { &handoff, sizeof(handoff) };
+    struct msghdr msg;
+    struct cmsghdr* cmsg;
+    ssize_t r;
+    int fd;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    r = recvmsg(socket, &msg, flags);
+    if (-1 == r)
+        return -1;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if ((ssize_t)sizeof(handoff) != r || NULL == cmsg ||
+        SOL_SOCKET != cmsg->cmsg_level || SCM_RIGHTS != cmsg->cmsg_type) {
+        errno = ECONNABORTED;
+        return -1;
+    }
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    if (NULL != address && NULL != address_len) {
+        if (*address_len > handoff.address_len)
+            *address_len = handoff.address_len;
+        memcpy(address, &handoff.address, *address_len);
+    }
+    return fd;
+}
+
+static int hybrid_accept(int socket, struct sockaddr *address,
+                         socklen_t *address_len) {
+    if (-1 == hybrid_find(socket))
+        return accept(socket, address, address_len);
+    return hybrid_receive(socket, address, address_len, 0);
+}
+
+#ifdef __linux__
+static int hybrid_accept4(int socket, struct sockaddr *address,
+                          socklen_t *address_len, int flags) {
+    if (-1 == hybrid_find(socket))
+        return accept4(socket, address, address_len, flags);
+    /* ipcd accepts with SOCK_NONBLOCK, and the file status flags travel
+     with the descriptor; only close-on-exec is ours to set */
+    return hybrid_receive(socket, address, address_len,
+                          flags & SOCK_CLOEXEC ? MSG_CMSG_CLOEXEC : 0);
+}
+#endif
+
+static int hybrid_setsockopt(int socket, int level, int option_name,
+                             const void *option_value,
+                             socklen_t option_len) {
+    int remote = hybrid_find(socket);
+
+    if (-1 == remote)
+        return setsockopt(socket, level, option_name, option_value,
+                          option_len);
+    return ipc_setsockopt(remote, level, option_name, option_value,
+                          option_len);
+}
+
+static int hybrid_close(int fildes) {
+    struct hybrid_socket hs;
+
+    if (hybrid_take(fildes, &hs)) {
+        ipc_closefd(hs.remote);
+#ifndef __linux__
+        unlink(hs.address.sun_path);
+#endif
+    }
+    return close(fildes);
+}
+
+const struct httpd_backend httpd_hybrid_backend = {
+    .name = "hybrid",
+    .init = ipc_backend_init,
+    .fini = ipc_close,
+    .socket = hybrid_socket,
+    .bind = hybrid_bind,
+    .listen = hybrid_listen,
+    .accept = hybrid_accept,
+#ifdef __linux__
+    .accept4 = hybrid_accept4,
+#endif
+    .recv = recv,
+    .send = send,
+    .select = select,
+    .poll = poll,
+#ifdef __linux__
+    .epoll_create1 = epoll_create1,
+    .epoll_ctl = epoll_ctl,
+    .epoll_wait = epoll_wait,
+#endif
+    .fcntl = direct_fcntl,
+    .setsockopt = hybrid_setsockopt,
+    .close = hybrid_close,
+    .post_setsockopt = hybrid_setsockopt,
+    .make_nonblocking_noninheritable = direct_make_nonblocking_noninheritable
+};
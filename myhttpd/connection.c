@@ -102,8 +102,10 @@ static httpd_status socket_start_no_buffering(struct httpd_connection* conn) {
     int ret = 1;
     const int on_val = 1;
     if (NULL == conn) return HTTPD_NO;
-    ret = setsockopt(conn->socket, IPPROTO_TCP, TCP_NODELAY,
-                     (const void*)&on_val, sizeof(on_val));
+    ret = conn->daemon->backend->post_setsockopt(conn->socket,
+                                                 IPPROTO_TCP, TCP_NODELAY,
+                                                 (const void*)&on_val,
+                                                 sizeof(on_val));
     if (0 == ret)
         return HTTPD_YES;
     else
@@ -114,8 +116,10 @@ static httpd_status socket_start_normal_buffering(struct httpd_connection* conn)
     int ret = 1;
     const int off_val = 1;
     if (NULL == conn) return HTTPD_NO;
-    ret = setsockopt(conn->socket, IPPROTO_TCP, TCP_NODELAY,
-                     (const void*)&off_val, sizeof(off_val));
+    ret = conn->daemon->backend->post_setsockopt(conn->socket,
+                                                 IPPROTO_TCP, TCP_NODELAY,
+                                                 (const void*)&off_val,
+                                                 sizeof(off_val));
     if (0 == ret)
         return HTTPD_YES;
     else
@@ -146,8 +150,11 @@ static void close_connection(struct httpd_connection* conn) {
     
     daemon = conn->daemon;
     conn->state = HTTPD_CONNECTION_CLOSED;
+    if (HTTPD_EVENT_LOOP_INFO_CLEANUP == conn->event_loop_info)
+        return;
     conn->event_loop_info = HTTPD_EVENT_LOOP_INFO_CLEANUP;
-    // TODO: notify daemon
+    if (NULL != daemon->interest_changed)
+        daemon->interest_changed(conn);
 }
 
 static httpd_status keepalive_possible (struct httpd_connection *conn)
@@ -858,9 +865,38 @@ static httpd_status build_header_response(struct httpd_connection* conn) {
     return HTTPD_YES;
 }
 
+/**
+ * Move a closed connection from the daemon's list to its reap list.  The
+ * daemon closes the socket and frees the connection at the end of the
+ * iteration, once no handler can reach it any more.
+ */
 static void cleanup_connection(struct httpd_connection* conn) {
-    // TODO: everything!
+    struct httpd_daemon* daemon;
+    
+    daemon = conn->daemon;
+    if (HTTPD_CONNECTION_IN_CLEANUP == conn->state)
+        return;
     close_connection(conn);
+    
+    if (NULL == conn->prev)
+        daemon->connections_head = conn->next;
+    else
+        conn->prev->next = conn->next;
+    if (NULL == conn->next)
+        daemon->connections_tail = conn->prev;
+    else
+        conn->next->prev = conn->prev;
+    daemon->connections--;
+    
+    conn->prev = daemon->cleanup_tail;
+    conn->next = NULL;
+    if (NULL == daemon->cleanup_tail)
+        daemon->cleanup_head = conn;
+    else
+        daemon->cleanup_tail->next = conn;
+    daemon->cleanup_tail = conn;
+    
+    conn->state = HTTPD_CONNECTION_IN_CLEANUP;
     conn->in_idle = 0;
 }
 
@@ -1087,6 +1123,7 @@ httpd_status httpd_connection_handle_read(struct httpd_connection* conn) {
 }
 
 static void HTTPD_connection_update_event_loop_info(struct httpd_connection* conn) {
+    enum httpd_connectionEventLoopInfo old = conn->event_loop_info;
     httpd_status ret;
     
     while (1) {
@@ -1183,12 +1220,19 @@ static void HTTPD_connection_update_event_loop_info(struct httpd_connection* con
                 break;
             case HTTPD_CONNECTION_CLOSED:
                 conn->event_loop_info = HTTPD_EVENT_LOOP_INFO_CLEANUP;
-                return;       /* do nothing, not even reading */
+                break;       /* do nothing, not even reading */
             default:
                 break;
         }
         break;
     }
+    if (old != conn->event_loop_info &&
+        NULL != conn->daemon->interest_changed)
+        conn->daemon->interest_changed(conn);
+}
+
+void httpd_connection_timed_out(struct httpd_connection* conn) {
+    cleanup_connection(conn);
 }
 
 
@@ -1577,8 +1621,6 @@ httpd_status httpd_connection_handle_idle(struct httpd_connection* conn) {
                 {
                     /* have to close for some reason */
                     close_connection(conn);
-                    httpd_pool_destroy (conn->pool);
-                    conn->pool = NULL;
                     conn->read_buffer = NULL;
                     conn->read_buffer_size = 0;
                     conn->read_buffer_offset = 0;
@@ -1586,6 +1628,7 @@ httpd_status httpd_connection_handle_idle(struct httpd_connection* conn) {
                 else
                 {
                     /* can try to keep-alive */
+                    conn->request_start = daemon->now;
                     conn->version = NULL;
                     conn->state = HTTPD_CONNECTION_INIT;
                     /* Reset the read buffer to the starting size,
@@ -6,41 +6,65 @@
 //  Copyright © 2017 DeepSpec. All rights reserved.
 //
 
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <pthread.h>
 #include <errno.h>
 #include <limits.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 #include "httpd.h"
+#include "affinity.h"
 #include "configurations.h"
 #include "internal.h"
+#include "log.h"
 #include "connection.h"
-#include "ipc.h"
 
 #ifndef MSG_NOSIGNAL
 #define MSG_NOSIGNAL 0
 #endif
 
-#ifdef DEBUG
-void httpd_log(const char* c) {
-    fputs(c, stderr);
-}
-#endif
+/**
+ * Events taken from the readiness engine per iteration.
+ */
+#define HTTPD_READY_EVENTS 64
 
-static httpd_status make_noninheritable(httpd_socket socket) {
+/**
+ * Longest wait of a loop in milliseconds, for when no deadline is near:
+ * a loop only notices that its daemon is stopping when it wakes up.
+ */
+#define HTTPD_WAIT_MAX 5000
+
+/**
+ * Submission queue entries of an io_uring loop, and the user_data of its
+ * requests that are not a connection's poll request.  The user_data of a
+ * poll request is the socket in the low half and the tag of the request
+ * in the high half.
+ */
+#define HTTPD_URING_ENTRIES 0x100
+#define HTTPD_URING_ACCEPT UINT64_MAX
+#define HTTPD_URING_NONE (UINT64_MAX - 1)
+
+#if !defined(SOCK_NONBLOCK) || !defined(SOCK_CLOEXEC)
+static httpd_status make_noninheritable(struct httpd_daemon* daemon,
+                                       httpd_socket socket) {
     int flags, r;
-    flags = fcntl2(socket, F_GETFD);
+    flags = daemon->backend->fcntl(socket, F_GETFD, 0);
     if (-1 == flags) {
         return HTTPD_NO;
     }
     
     if (flags != (flags | FD_CLOEXEC)) {
-        r = fcntl3(socket, F_SETFD, flags | FD_CLOEXEC);
+        r = daemon->backend->fcntl(socket, F_SETFD, flags | FD_CLOEXEC);
     }
     if (r != 0) {
         return HTTPD_NO;
@@ -49,15 +73,16 @@ static httpd_status make_noninheritable(httpd_socket socket) {
     return HTTPD_YES;
 }
 
-static httpd_status make_nonblocking(httpd_socket socket) {
+static httpd_status make_nonblocking(struct httpd_daemon* daemon,
+                                     httpd_socket socket) {
     int flags, r;
-    flags = fcntl2(socket, F_GETFL);
+    flags = daemon->backend->fcntl(socket, F_GETFL, 0);
     if (-1 == flags) {
         return HTTPD_NO;
     }
     
     if (flags != (flags | O_NONBLOCK)) {
-        r = fcntl3(socket, F_SETFL, flags | O_NONBLOCK);
+        r = daemon->backend->fcntl(socket, F_SETFL, flags | O_NONBLOCK);
     }
     if (r != 0) {
         return HTTPD_NO;
@@ -65,11 +90,7 @@ static httpd_status make_nonblocking(httpd_socket socket) {
     
     return HTTPD_YES;
 }
-
-static void make_nonblocking_noninheritable(httpd_socket socket) {
-    make_nonblocking(socket);
-    make_noninheritable(socket);
-}
+#endif
 
 static ssize_t recv_param_adapter(struct httpd_connection* conn,
                                   void* other, size_t i) {
@@ -83,7 +104,16 @@ static ssize_t recv_param_adapter(struct httpd_connection* conn,
     if (i > SSIZE_MAX)
         i = SSIZE_MAX;
     
-    ret = recv(conn->socket, other, i, MSG_NOSIGNAL);
+    ret = conn->daemon->backend->recv(conn->socket, other, i, MSG_NOSIGNAL);
+    /* edge-triggered readiness lasts until the socket runs dry */
+    if (ret < 0 ? EAGAIN == errno || EWOULDBLOCK == errno : (size_t)ret < i)
+        conn->watch.ready &= ~WATCH_IN;
+    if (ret > 0) {
+        if (HTTPD_CONNECTION_INIT == conn->state &&
+            0 == conn->read_buffer_offset)
+            conn->request_start = conn->daemon->now;
+        conn->last_activity = conn->daemon->now;
+    }
     
     return ret;
 }
@@ -100,7 +130,11 @@ static ssize_t send_param_adapter(struct httpd_connection* conn,
     if (i > SSIZE_MAX)
         i = SSIZE_MAX;
     
-    ret = send(conn->socket, other, i, MSG_NOSIGNAL);
+    ret = conn->daemon->backend->send(conn->socket, other, i, MSG_NOSIGNAL);
+    if (ret < 0 ? EAGAIN == errno || EWOULDBLOCK == errno : (size_t)ret < i)
+        conn->watch.ready &= ~WATCH_OUT;
+    if (ret > 0)
+        conn->last_activity = conn->daemon->now;
     
     /* Handle broken kernel / libc, returning -1 but not setting errno;
      kill connection as that should be safe; reported on mailinglist here:
@@ -118,79 +152,471 @@ static httpd_status create_thread(httpd_thread_handle* thread,
                                   void* arg) {
     int r;
     r = pthread_create(thread, NULL, start_routine, arg);
+    if (0 == r && daemon->cpu >= 0) {
+        errno = affinity_pin(*thread, daemon->cpu);
+        if (0 != errno)
+            log_warn("Cannot pin to CPU %d: %s", daemon->cpu,
+                     strerror(errno));
+    }
     return r;
 }
 
-static httpd_status add_to_fd_set(httpd_socket fd,
-                                  fd_set* set,
-                                  httpd_socket* max_fd,
-                                  unsigned int fd_setsize) {
-    if (NULL == set)
+/**
+ * The events a connection waits for in its current state.
+ */
+static uint32_t connection_interest(struct httpd_connection* pos) {
+    uint32_t events = 0;
+    
+    switch (pos->event_loop_info) {
+        case HTTPD_EVENT_LOOP_INFO_READ:
+            events = WATCH_IN;
+            break;
+        case HTTPD_EVENT_LOOP_INFO_WRITE:
+            events = WATCH_OUT;
+            if (pos->read_buffer_size > pos->read_buffer_offset)
+                events |= WATCH_IN;
+            break;
+        case HTTPD_EVENT_LOOP_INFO_BLOCK:
+            if (pos->read_buffer_size > pos->read_buffer_offset)
+                events = WATCH_IN;
+            break;
+        case HTTPD_EVENT_LOOP_INFO_CLEANUP:
+            break;
+    }
+    return events;
+}
+
+/**
+ * Bring the engine's registration of `fd` in line with `events`.  The
+ * change is queued and reaches the engine with the next wait.
+ */
+static void update_watch(struct httpd_daemon* daemon,
+                         httpd_socket fd,
+                         struct httpd_watch* watch,
+                         uint32_t events) {
+    if (!watch->added) {
+        daemon->backend->watch(WATCH_ADD, fd, events, (uint64_t)fd);
+        watch->added = 1;
+    } else if (watch->armed != events) {
+        daemon->backend->watch(WATCH_MODIFY, fd, events, (uint64_t)fd);
+    }
+    watch->armed = events;
+}
+
+/**
+ * Set `fd` in the select() sets for `events` and clear it from the others.
+ */
+static void select_set(struct httpd_daemon* daemon,
+                       httpd_socket fd,
+                       uint32_t events) {
+    if (events & WATCH_IN)
+        FD_SET(fd, &daemon->read_set);
+    else
+        FD_CLR(fd, &daemon->read_set);
+    if (events & WATCH_OUT)
+        FD_SET(fd, &daemon->write_set);
+    else
+        FD_CLR(fd, &daemon->write_set);
+    if (0 != events && fd > daemon->max_fd)
+        daemon->max_fd = fd;
+}
+
+/**
+ * Make room for `fd` in the table mapping the sockets the readiness
+ * engine reports on back to their connections.
+ */
+static httpd_status reserve_watched(struct httpd_daemon* daemon,
+                                    httpd_socket fd) {
+    struct httpd_connection** table;
+    size_t size;
+    
+    if ((size_t)fd < daemon->watched_size)
+        return HTTPD_YES;
+    size = 0 != daemon->watched_size ? daemon->watched_size : FD_SETSIZE;
+    while (size <= (size_t)fd)
+        size *= 2;
+    table = realloc(daemon->watched, size * sizeof(*table));
+    if (NULL == table)
         return HTTPD_NO;
-    if (fd >= (httpd_socket)fd_setsize)
+    memset(table + daemon->watched_size, 0,
+           (size - daemon->watched_size) * sizeof(*table));
+    daemon->watched = table;
+    daemon->watched_size = size;
+    return HTTPD_YES;
+}
+
+#ifdef __linux__
+/**
+ * Register `conn` with the daemon's epoll instance for the events its
+ * current state waits for, edge-triggered, or drop it once it is to be
+ * cleaned up.  Called when the connection is added and whenever its
+ * event_loop_info changes, never on the loop's hot path.
+ */
+static httpd_status epoll_update(struct httpd_connection* conn) {
+    struct httpd_daemon* daemon = conn->daemon;
+    struct epoll_event event;
+    uint32_t interest;
+    int op;
+    
+    if (HTTPD_EVENT_LOOP_INFO_CLEANUP == conn->event_loop_info) {
+        if (conn->watch.added)
+            daemon->backend->epoll_ctl(daemon->epfd, EPOLL_CTL_DEL,
+                                       conn->socket, NULL);
+        conn->watch.added = 0;
+        return HTTPD_YES;
+    }
+    interest = connection_interest(conn);
+    if (conn->watch.added && conn->watch.armed == interest)
+        return HTTPD_YES;
+    
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLET;
+    if (interest & WATCH_IN)
+        event.events |= EPOLLIN;
+    if (interest & WATCH_OUT)
+        event.events |= EPOLLOUT;
+    event.data.ptr = conn;
+    op = conn->watch.added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (0 != daemon->backend->epoll_ctl(daemon->epfd, op, conn->socket,
+                                        &event)) {
+        log_warn("Cannot watch socket %d: %s", conn->socket,
+                 strerror(errno));
         return HTTPD_NO;
-    FD_SET(fd, set);
-    if (NULL != max_fd && INVALID_SOCKET != fd) {
-        if (fd > *max_fd || INVALID_SOCKET == *max_fd) {
-            *max_fd = fd;
-        }
     }
+    conn->watch.added = 1;
+    conn->watch.armed = interest;
     return HTTPD_YES;
 }
 
-static httpd_status httpd_get_fdset2(struct httpd_daemon* daemon,
-                                     fd_set* read_fd_set,
-                                     fd_set* write_fd_set,
-                                     fd_set* except_fd_set,
-                                     httpd_socket* max_fd,
-                                     unsigned int fd_setsize) {
-    httpd_status r, result;
-    struct httpd_connection* pos;
-    result = HTTPD_YES;
+static void epoll_interest_changed(struct httpd_connection* conn) {
+    epoll_update(conn);
+}
+
+static uint64_t uring_data(struct httpd_connection* conn) {
+    return (uint64_t)conn->watch.tag << 32 | (uint32_t)conn->socket;
+}
+
+/**
+ * Same as epoll_update(), with a multishot poll request per connection.
+ * A change of interest cancels the request and submits a new one under a
+ * new tag; everything goes out with the next uring_wait().
+ */
+static httpd_status uring_update(struct httpd_connection* conn) {
+    struct httpd_daemon* daemon = conn->daemon;
+    struct io_uring_sqe* sqe;
+    uint32_t interest;
     
-    if (NULL == daemon ||
-        NULL == read_fd_set ||
-        NULL == write_fd_set ||
-        HTTPD_YES == daemon->shutdown) {
-        return HTTPD_NO;
+    if (conn->watch.added &&
+        (HTTPD_EVENT_LOOP_INFO_CLEANUP == conn->event_loop_info ||
+         conn->watch.armed != connection_interest(conn))) {
+        sqe = uring_sqe(&daemon->uring);
+        if (NULL == sqe)
+            goto error;
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = uring_data(conn);
+        sqe->user_data = HTTPD_URING_NONE;
+        conn->watch.added = 0;
     }
+    if (HTTPD_EVENT_LOOP_INFO_CLEANUP == conn->event_loop_info ||
+        conn->watch.added)
+        return HTTPD_YES;
     
-    if (INVALID_SOCKET != daemon->socket) {
-        r = add_to_fd_set(daemon->socket, read_fd_set, max_fd, fd_setsize);
-        if (HTTPD_YES != r)
-            result = HTTPD_NO;
+    interest = connection_interest(conn);
+    sqe = uring_sqe(&daemon->uring);
+    if (NULL == sqe)
+        goto error;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = conn->socket;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = (interest & WATCH_IN ? POLLIN : 0) |
+                         (interest & WATCH_OUT ? POLLOUT : 0);
+    conn->watch.tag = ++daemon->uring_tag;
+    sqe->user_data = uring_data(conn);
+    conn->watch.added = 1;
+    conn->watch.armed = interest;
+    return HTTPD_YES;
+    
+error:
+    log_warn("Cannot watch socket %d: %s", conn->socket, strerror(errno));
+    return HTTPD_NO;
+}
+
+static void uring_interest_changed(struct httpd_connection* conn) {
+    uring_update(conn);
+}
+#endif
+
+/**
+ * Append `fd` to the poll() set on behalf of `conn`.
+ */
+static httpd_status poll_add(struct httpd_daemon* daemon,
+                             httpd_socket fd,
+                             struct httpd_connection* conn) {
+    struct pollfd* pollfds;
+    struct httpd_connection** polled;
+    size_t size;
+    
+    if (daemon->poll_count == daemon->poll_size) {
+        size = 0 != daemon->poll_size ? 2 * daemon->poll_size
+                                      : HTTPD_READY_EVENTS;
+        pollfds = realloc(daemon->pollfds, size * sizeof(*pollfds));
+        if (NULL == pollfds)
+            return HTTPD_NO;
+        daemon->pollfds = pollfds;
+        polled = realloc(daemon->polled, size * sizeof(*polled));
+        if (NULL == polled)
+            return HTTPD_NO;
+        daemon->polled = polled;
+        daemon->poll_size = size;
+    }
+    daemon->pollfds[daemon->poll_count].fd = fd;
+    daemon->pollfds[daemon->poll_count].events = POLLIN;
+    daemon->pollfds[daemon->poll_count].revents = 0;
+    daemon->polled[daemon->poll_count] = conn;
+    if (NULL != conn)
+        conn->poll_index = daemon->poll_count;
+    daemon->poll_count++;
+    return HTTPD_YES;
+}
+
+/**
+ * Drop `conn` from the poll() set, filling its slot with the last entry.
+ */
+static void poll_remove(struct httpd_daemon* daemon,
+                        struct httpd_connection* conn) {
+    size_t i = conn->poll_index;
+    
+    daemon->poll_count--;
+    if (i != daemon->poll_count) {
+        daemon->pollfds[i] = daemon->pollfds[daemon->poll_count];
+        daemon->polled[i] = daemon->polled[daemon->poll_count];
+        daemon->polled[i]->poll_index = i;
     }
+}
+
+/**
+ * Bring the select() sets, the poll() set or the readiness engine in line
+ * with what `conn` waits for.  Called when it is added and after its
+ * handlers run; epoll and io_uring follow interest_changed instead.  A
+ * connection being cleaned up leaves when it is reaped.
+ */
+static void update_interest(struct httpd_connection* conn) {
+    struct httpd_daemon* daemon = conn->daemon;
+    struct pollfd* pollfd;
+    uint32_t interest;
     
-    for (pos = daemon->connections_head; NULL != pos; pos = pos->next) {
-        switch (pos->event_loop_info) {
-            case HTTPD_EVENT_LOOP_INFO_READ:
-                r = add_to_fd_set(pos->socket, read_fd_set, max_fd, fd_setsize);
-                if (HTTPD_YES != r)
-                    result = r;
-                break;
-            case HTTPD_EVENT_LOOP_INFO_WRITE:
-                r = add_to_fd_set(pos->socket, write_fd_set, max_fd, fd_setsize);
-                if (HTTPD_YES != r)
-                    result = r;
-                if (pos->read_buffer_size > pos->read_buffer_offset) {
-                    r = add_to_fd_set(pos->socket, read_fd_set, max_fd, fd_setsize);
-                    if (HTTPD_YES != r)
-                        result = r;
-                }
-                break;
-            case HTTPD_EVENT_LOOP_INFO_BLOCK:
-                if (pos->read_buffer_size > pos->read_buffer_offset) {
-                    r = add_to_fd_set(pos->socket, read_fd_set, max_fd, fd_setsize);
-                    if (HTTPD_YES != r)
-                        result = r;
-                }
-                break;
-            case HTTPD_EVENT_LOOP_INFO_CLEANUP:
-                break;
+    if (HTTPD_EVENT_LOOP_INFO_CLEANUP == conn->event_loop_info)
+        return;
+    interest = connection_interest(conn);
+    switch (daemon->event_loop) {
+        case HTTPD_EVENT_LOOP_SELECT:
+            select_set(daemon, conn->socket, interest);
+            break;
+        case HTTPD_EVENT_LOOP_POLL:
+            pollfd = &daemon->pollfds[conn->poll_index];
+            pollfd->events = 0;
+            if (interest & WATCH_IN)
+                pollfd->events |= POLLIN;
+            if (interest & WATCH_OUT)
+                pollfd->events |= POLLOUT;
+            break;
+        case HTTPD_EVENT_LOOP_BACKEND:
+            update_watch(daemon, conn->socket, &conn->watch, interest);
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Read the clock for the iteration.  A coarse clock is precise enough for
+ * timeouts and is read without a system call.
+ */
+static void update_clock(struct httpd_daemon* daemon) {
+    struct timespec ts;
+    
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    daemon->now = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * When `conn` times out in its current state, 0 if it cannot: a request
+ * must be complete within the timeout of its first byte, a kept-alive
+ * connection must start a request within the timeout of the last
+ * response, and a transfer must not stall for longer.  A connection that
+ * waits on its handler is not timed out.
+ */
+static uint64_t connection_deadline(struct httpd_connection* conn) {
+    uint64_t timeout = conn->daemon->connection_timeout;
+    
+    if (0 == timeout)
+        return 0;
+    switch (conn->event_loop_info) {
+        case HTTPD_EVENT_LOOP_INFO_READ:
+            if (HTTPD_CONNECTION_INIT == conn->state &&
+                0 == conn->read_buffer_offset)
+                return conn->last_activity + timeout;
+            if (conn->state <= HTTPD_CONNECTION_HEADER_PART_RECEIVED)
+                return conn->request_start + timeout;
+            return conn->last_activity + timeout;
+        case HTTPD_EVENT_LOOP_INFO_WRITE:
+            return conn->last_activity + timeout;
+        default:
+            return 0;
+    }
+}
+
+static void timer_cancel(struct httpd_connection* conn) {
+    struct httpd_daemon* daemon = conn->daemon;
+    struct httpd_timer* timer = &conn->timer;
+    
+    if (!timer->armed)
+        return;
+    if (NULL == timer->prev)
+        daemon->wheel[timer->slot] = timer->next;
+    else
+        timer->prev->timer.next = timer->next;
+    if (NULL != timer->next)
+        timer->next->timer.prev = timer->prev;
+    timer->armed = 0;
+    daemon->timers--;
+}
+
+/**
+ * File `conn` in the wheel under its current deadline.  Called when it is
+ * added and after its handlers run, so that an iteration touches the
+ * timers of the connections it served only.  A deadline in a tick whose
+ * deadlines were enforced already goes to the next one.
+ */
+static void timer_update(struct httpd_connection* conn) {
+    struct httpd_daemon* daemon = conn->daemon;
+    struct httpd_timer* timer = &conn->timer;
+    uint64_t expires, tick;
+    
+    expires = connection_deadline(conn);
+    if (timer->armed && timer->expires == expires)
+        return;
+    timer_cancel(conn);
+    if (0 == expires)
+        return;
+    tick = expires / HTTPD_WHEEL_TICK;
+    if (tick <= daemon->wheel_tick)
+        tick = daemon->wheel_tick + 1;
+    timer->slot = tick % HTTPD_WHEEL_SLOTS;
+    timer->expires = expires;
+    timer->prev = NULL;
+    timer->next = daemon->wheel[timer->slot];
+    if (NULL != timer->next)
+        timer->next->timer.prev = conn;
+    daemon->wheel[timer->slot] = conn;
+    timer->armed = 1;
+    daemon->timers++;
+}
+
+/**
+ * Time out the connections whose deadline has passed: the slots of the
+ * ticks that ended since the last call are walked, leaving the deadlines
+ * of later revolutions where they are.  A connection on the run queue is
+ * making progress and is left alone.
+ */
+static void run_timers(struct httpd_daemon* daemon) {
+    struct httpd_connection* pos;
+    struct httpd_connection* next;
+    uint64_t tick, last;
+    
+    last = daemon->now / HTTPD_WHEEL_TICK - 1;
+    if (0 == daemon->timers || last <= daemon->wheel_tick) {
+        daemon->wheel_tick = MAX(daemon->wheel_tick, last);
+        return;
+    }
+    tick = daemon->wheel_tick;
+    if (last - tick > HTTPD_WHEEL_SLOTS)
+        tick = last - HTTPD_WHEEL_SLOTS;
+    while (tick < last) {
+        tick++;
+        for (pos = daemon->wheel[tick % HTTPD_WHEEL_SLOTS]; NULL != pos;
+             pos = next) {
+            next = pos->timer.next;
+            if (pos->timer.expires > daemon->now || pos->watch.queued)
+                continue;
+            timer_cancel(pos);
+            log_debug("socket %d timed out", pos->socket);
+            httpd_connection_timed_out(pos);
         }
     }
+    daemon->wheel_tick = last;
+}
+
+/**
+ * How long the loop may wait for its sockets: until the end of the first
+ * tick with a deadline, at most HTTPD_WAIT_MAX.
+ */
+static int wait_timeout(struct httpd_daemon* daemon, httpd_status mayblock) {
+    uint64_t tick, wake;
+    
+    if (HTTPD_YES != mayblock)
+        return 0;
+    if (0 == daemon->timers)
+        return HTTPD_WAIT_MAX;
+    for (tick = daemon->wheel_tick + 1;
+         tick <= daemon->wheel_tick + HTTPD_WHEEL_SLOTS; tick++) {
+        if (NULL == daemon->wheel[tick % HTTPD_WHEEL_SLOTS])
+            continue;
+        wake = (tick + 1) * HTTPD_WHEEL_TICK;
+        if (wake <= daemon->now)
+            return 0;
+        return (int)MIN(wake - daemon->now, HTTPD_WAIT_MAX);
+    }
+    return HTTPD_WAIT_MAX;
+}
+
+/**
+ * Take a connection record off the loop's free list, carving a new slab
+ * when it is empty.  A recycled record comes with the pool of its last
+ * connection, still mapped and faulted in.
+ */
+static struct httpd_connection* get_connection(struct httpd_daemon* daemon) {
+    struct httpd_connection_slab* slab;
+    struct httpd_connection* conn;
+    struct MemoryPool* pool;
+    size_t i;
     
-    return result;
+    if (NULL == daemon->free_connections) {
+        slab = calloc(1, sizeof(struct httpd_connection_slab));
+        if (NULL == slab)
+            return NULL;
+        slab->next = daemon->slabs;
+        daemon->slabs = slab;
+        for (i = HTTPD_CONNECTION_SLAB_SIZE; i > 0; i--) {
+            slab->connections[i - 1].next = daemon->free_connections;
+            daemon->free_connections = &slab->connections[i - 1];
+        }
+    }
+    conn = daemon->free_connections;
+    daemon->free_connections = conn->next;
+    pool = conn->pool;
+    memset(conn, 0, sizeof(struct httpd_connection));
+    conn->pool = pool;
+    return conn;
+}
+
+/**
+ * Give a connection record back to the loop's free list, emptying its
+ * pool for the next connection.
+ */
+static void put_connection(struct httpd_daemon* daemon,
+                           struct httpd_connection* conn) {
+    HTTPD_destroy_response(conn->response);
+    conn->response = NULL;
+    if (NULL != conn->pool)
+        httpd_pool_recycle(conn->pool);
+    conn->next = daemon->free_connections;
+    daemon->free_connections = conn;
 }
 
 static httpd_status internal_add_connection(struct httpd_daemon* daemon,
@@ -201,11 +627,19 @@ static httpd_status internal_add_connection(struct httpd_daemon* daemon,
     struct httpd_connection* connection;
     static int on = 1;
     
-    if (client_socket >= FD_SETSIZE) {
-        close1(client_socket);
+    if (HTTPD_EVENT_LOOP_SELECT == daemon->event_loop &&
+        client_socket >= FD_SETSIZE) {
+        daemon->backend->close(client_socket);
         errno = EINVAL;
         return HTTPD_NO;
     }
+    if (HTTPD_EVENT_LOOP_EPOLL != daemon->event_loop &&
+        HTTPD_EVENT_LOOP_POLL != daemon->event_loop &&
+        HTTPD_YES != reserve_watched(daemon, client_socket)) {
+        daemon->backend->close(client_socket);
+        errno = ENOMEM;
+        return HTTPD_NO;
+    }
     
     /*
     if (daemon->connections == daemon->connection_limit) {
@@ -216,37 +650,31 @@ static httpd_status internal_add_connection(struct httpd_daemon* daemon,
      */
     
 #ifdef __APPLE__
-    setsockopt(client_socket, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+    daemon->backend->post_setsockopt(client_socket, SOL_SOCKET,
+                                     SO_NOSIGPIPE, &on, sizeof(on));
 #endif
     
-    connection = malloc(sizeof(struct httpd_connection));
+    connection = get_connection(daemon);
     if (NULL == connection) {
-        int eno = errno;
-        close1(client_socket);
-        errno = eno;
+        daemon->backend->close(client_socket);
+        errno = ENOMEM;
         return HTTPD_NO;
     }
-    memset(connection, 0, sizeof(struct httpd_connection));
     
-    connection->pool = httpd_pool_create(daemon->pool_size);
+    if (NULL == connection->pool)
+        connection->pool = httpd_pool_create(daemon->pool_size,
+                                             HTTPD_YES == daemon->shared_pools ?
+                                             daemon->backend : NULL);
     if (NULL == connection->pool) {
-        close1(client_socket);
+        put_connection(daemon, connection);
+        daemon->backend->close(client_socket);
         errno = ENOMEM;
         return HTTPD_NO;
     }
     
-    // TODO: connection timeout
-    
-    connection->addr = malloc(addrlen);
-    if (NULL == connection->addr) {
-        int eno = errno;
-        httpd_pool_destroy(connection->pool);
-        free(connection);
-        errno = eno;
-        return HTTPD_NO;
-    }
-    
-    memcpy(connection->addr, addr, addrlen);
+    if (addrlen > sizeof(connection->addr))
+        addrlen = sizeof(connection->addr);
+    memcpy(&connection->addr, addr, addrlen);
     connection->addr_len = addrlen;
     connection->socket = client_socket;
     connection->daemon = daemon;
@@ -256,7 +684,24 @@ static httpd_status internal_add_connection(struct httpd_daemon* daemon,
     connection->idle_handler = &httpd_connection_handle_idle;
     connection->recv_cls = &recv_param_adapter;
     connection->send_cls = &send_param_adapter;
-
+    
+    if (HTTPD_EVENT_LOOP_POLL == daemon->event_loop &&
+        HTTPD_YES != poll_add(daemon, client_socket, connection)) {
+        daemon->backend->close(client_socket);
+        put_connection(daemon, connection);
+        errno = ENOMEM;
+        return HTTPD_NO;
+    }
+#ifdef __linux__
+    if (HTTPD_EVENT_LOOP_EPOLL == daemon->event_loop &&
+        HTTPD_YES != epoll_update(connection)) {
+        int eno = errno;
+        daemon->backend->close(client_socket);
+        put_connection(daemon, connection);
+        errno = eno;
+        return HTTPD_NO;
+    }
+#endif
     
     connection->next = daemon->connections_head;
     connection->prev = NULL;
@@ -265,9 +710,19 @@ static httpd_status internal_add_connection(struct httpd_daemon* daemon,
     else
         daemon->connections_head->prev = connection;
     daemon->connections_head = connection;
+    if (NULL != daemon->watched)
+        daemon->watched[client_socket] = connection;
+    update_interest(connection);
+#ifdef __linux__
+    if (HTTPD_EVENT_LOOP_URING == daemon->event_loop)
+        uring_update(connection);
+#endif
     
     // TODO: external_add is yes
     
+    connection->last_activity = daemon->now;
+    connection->request_start = daemon->now;
+    timer_update(connection);
     daemon->connections++;
     return HTTPD_YES;
 }
@@ -286,14 +741,20 @@ static httpd_status accept_connection(struct httpd_daemon* daemon) {
     if (INVALID_SOCKET == fd)
         return HTTPD_NO;
 
-    s = accept(fd, addr, &addrlen);
+#ifdef __linux__
+    if (NULL != daemon->backend->accept4)
+        s = daemon->backend->accept4(fd, addr, &addrlen,
+                                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+    else
+#endif
+        s = daemon->backend->accept(fd, addr, &addrlen);
     if (INVALID_SOCKET == s || addrlen <= 0) {
         const int err = errno;
         if (EINVAL == err && INVALID_SOCKET == daemon->socket) {
             return HTTPD_NO;
         }
         if (INVALID_SOCKET != s) {
-            close1(s);
+            daemon->backend->close(s);
         }
         if (EMFILE == err ||
             ENFILE == err ||
@@ -305,16 +766,29 @@ static httpd_status accept_connection(struct httpd_daemon* daemon) {
         }
         return HTTPD_NO;
     }
-#ifdef DEBUG
-    else
-        fprintf(stderr, "s = %d\n", s);
+    log_debug("accepted socket %d", s);
+#ifdef __linux__
+    if (NULL == daemon->backend->accept4)
 #endif
-    make_nonblocking_noninheritable(s);
+        daemon->backend->make_nonblocking_noninheritable(s);
     internal_add_connection(daemon, s, addr, addrlen, HTTPD_NO);
     
     return HTTPD_YES;
 }
 
+/**
+ * Drain the listen backlog, up to the accept budget.  Returns HTTPD_YES
+ * if the budget ran out before the backlog did.
+ */
+static httpd_status accept_connections(struct httpd_daemon* daemon) {
+    unsigned int i;
+    
+    for (i = 0; i < daemon->accept_budget; i++)
+        if (HTTPD_YES != accept_connection(daemon))
+            return HTTPD_NO;
+    return HTTPD_YES;
+}
+
 static httpd_status call_handlers(struct httpd_connection* conn,
                                   int read_ready,
                                   int write_ready,
@@ -329,67 +803,165 @@ static httpd_status call_handlers(struct httpd_connection* conn,
         had_response_before_idle = HTTPD_YES;
     // TODO: force close
     r = conn->idle_handler(conn);
+    update_interest(conn);
+    timer_update(conn);
     return r;
 }
 
+/**
+ * Close and free the connections cleaned up during this iteration.  They
+ * were unlinked as they closed, so the loop walks live connections only;
+ * here they leave the select() sets, the poll() set or the readiness
+ * engine's table before their descriptors can be reused.
+ */
 static httpd_status httpd_cleanup_connections(struct httpd_daemon* daemon) {
+    struct httpd_connection* pos;
+    
+    if (NULL == daemon->cleanup_head)
+        return HTTPD_YES;
+    while (NULL != (pos = daemon->cleanup_head)) {
+        daemon->cleanup_head = pos->next;
+        timer_cancel(pos);
+        if (HTTPD_EVENT_LOOP_SELECT == daemon->event_loop)
+            select_set(daemon, pos->socket, 0);
+        if (HTTPD_EVENT_LOOP_POLL == daemon->event_loop)
+            poll_remove(daemon, pos);
+        if (HTTPD_EVENT_LOOP_BACKEND == daemon->event_loop &&
+            pos->watch.added)
+            daemon->backend->watch(WATCH_REMOVE, pos->socket, 0,
+                                   (uint64_t)pos->socket);
+        if (NULL != daemon->watched)
+            daemon->watched[pos->socket] = NULL;
+        daemon->backend->close(pos->socket);
+        put_connection(daemon, pos);
+    }
+    daemon->cleanup_tail = NULL;
+    /* descriptors were given back: try accepting again */
+    daemon->at_limit = 0;
+    return HTTPD_YES;
+}
+
+/**
+ * Put `conn` at the end of the run queue unless it already is on it.
+ */
+static void enqueue(struct httpd_daemon* daemon,
+                    struct httpd_connection* conn) {
+    if (conn->watch.queued)
+        return;
+    conn->watch.queued = 1;
+    conn->watch.next = NULL;
+    if (NULL == daemon->queue_tail)
+        daemon->queue_head = conn;
+    else
+        daemon->queue_tail->watch.next = conn;
+    daemon->queue_tail = conn;
+}
+
+/**
+ * Whether `conn` can make progress without hearing from the kernel again:
+ * its handler has something to do, such as a body to produce or
+ * pipelined requests to parse, or a socket it waits on has not run dry
+ * yet.
+ */
+static int runnable(struct httpd_connection* conn) {
+    switch (conn->event_loop_info) {
+        case HTTPD_EVENT_LOOP_INFO_BLOCK:
+            return 1;
+        case HTTPD_EVENT_LOOP_INFO_CLEANUP:
+            return 0;
+        default:
+            return 0 != (conn->watch.ready &
+                         (connection_interest(conn) | WATCH_ERR | WATCH_HUP));
+    }
+}
+
+/**
+ * Run the handlers of the connections on the run queue, keeping those
+ * that can go on without hearing from the kernel again.
+ */
+static httpd_status run_queue(struct httpd_daemon* daemon) {
+    struct httpd_connection* conn;
+    struct httpd_connection* next;
+    uint32_t ready;
+    
+    conn = daemon->queue_head;
+    daemon->queue_head = NULL;
+    daemon->queue_tail = NULL;
+    for (; NULL != conn; conn = next) {
+        next = conn->watch.next;
+        conn->watch.queued = 0;
+        ready = conn->watch.ready;
+        call_handlers(conn, ready & (WATCH_IN | WATCH_ERR | WATCH_HUP),
+                      ready & WATCH_OUT, HTTPD_NO);
+        if (runnable(conn))
+            enqueue(daemon, conn);
+    }
+    httpd_cleanup_connections(daemon);
     return HTTPD_YES;
 }
 
+/**
+ * Queue the connections whose sockets select() reported, walking the
+ * sets rather than the connections and stopping once all `num_ready`
+ * are found.
+ */
 static httpd_status run_from_select(struct httpd_daemon* daemon,
                                     const fd_set* rs,
                                     const fd_set* ws,
-                                    const fd_set* es) {
-    httpd_socket ds;
-    struct httpd_connection *pos;
-    struct httpd_connection *next;
+                                    int num_ready) {
+    struct httpd_connection* conn;
+    httpd_socket fd;
+    uint32_t ready;
+    int accept_ready = 0;
     
     // TODO: drain a pipe?
     
-    ds = daemon->socket;
-    if (INVALID_SOCKET != ds && FD_ISSET(ds, rs)) {
-        accept_connection(daemon);
-    }
-    next = daemon->connections_head;
-    pos = next;
-    while (NULL != pos) {
-        next = pos->next;
-        ds = pos->socket;
-        if (INVALID_SOCKET == ds)
+    for (fd = 0; num_ready > 0 && fd <= daemon->max_fd; fd++) {
+        ready = 0;
+        if (FD_ISSET(fd, rs)) {
+            ready |= WATCH_IN;
+            num_ready--;
+        }
+        if (FD_ISSET(fd, ws)) {
+            ready |= WATCH_OUT;
+            num_ready--;
+        }
+        if (0 == ready)
+            continue;
+        if (fd == daemon->socket) {
+            accept_ready = 1;
+            continue;
+        }
+        if ((size_t)fd >= daemon->watched_size ||
+            NULL == (conn = daemon->watched[fd]))
             continue;
-        call_handlers(pos, FD_ISSET(ds, rs), FD_ISSET(ds, ws), HTTPD_NO);
-        pos = next;
+        conn->watch.ready |= ready;
+        enqueue(daemon, conn);
     }
-    httpd_cleanup_connections(daemon);
-    return HTTPD_YES;
+    if (accept_ready)
+        accept_connections(daemon);
+    return run_queue(daemon);
 }
 
+/**
+ * One iteration of the event loop on select().  The sets are kept up to
+ * date by update_interest() and only copied here; with connections on the
+ * run queue the loop polls instead of sleeping.
+ */
 static httpd_status httpd_select(struct httpd_daemon* daemon,
                                  httpd_status mayblock) {
     int num_ready;
     fd_set rs;
     fd_set ws;
-    fd_set es;
-    httpd_socket maxsock;
     struct timeval timeout;
-    struct timeval* tv;
-    int r;
-    httpd_status err_state;
+    int ms;
     
     if (HTTPD_YES == daemon->shutdown) {
         return HTTPD_NO;
     }
     
-    maxsock = INVALID_SOCKET;
-    FD_ZERO(&rs);
-    FD_ZERO(&ws);
-    FD_ZERO(&es);
-    
-    r = httpd_get_fdset2(daemon, &rs, &ws, &es, &maxsock, FD_SETSIZE);
-    if (HTTPD_NO == r) {
-        err_state = HTTPD_YES;
-    }
-    
+    rs = daemon->read_set;
+    ws = daemon->write_set;
     if (INVALID_SOCKET != daemon->socket) {
         if (daemon->connections == daemon->connection_limit &&
             daemon->at_limit) {
@@ -397,43 +969,380 @@ static httpd_status httpd_select(struct httpd_daemon* daemon,
         }
     }
     
-    if (HTTPD_YES == err_state)
+    if (NULL != daemon->queue_head)
         mayblock = HTTPD_NO;
+    ms = wait_timeout(daemon, mayblock);
+    timeout.tv_sec = ms / 1000;
+    timeout.tv_usec = (ms % 1000) * 1000;
+    num_ready = daemon->backend->select(daemon->max_fd + 1, &rs, &ws, NULL,
+                                        &timeout);
+    update_clock(daemon);
+    
+    if (HTTPD_YES == daemon->shutdown)
+        return HTTPD_NO;
+    if (num_ready < 0) {
+        FD_ZERO(&rs);
+        FD_ZERO(&ws);
+        num_ready = 0;
+    }
+    
+    return run_from_select(daemon, &rs, &ws, num_ready);
+}
 
-    if (HTTPD_NO == mayblock) {
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 0;
-    } else {
-        // temporary
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
+static httpd_status run_from_ready(struct httpd_daemon* daemon,
+                                   const watch_event_t* events,
+                                   int num_ready) {
+    struct httpd_connection *conn;
+    httpd_socket fd;
+    int i;
+    
+    for (i = 0; i < num_ready; i++) {
+        fd = (httpd_socket)events[i].data;
+        if (INVALID_SOCKET != daemon->socket && fd == daemon->socket) {
+            daemon->watch.armed = 0;
+            daemon->watch.ready |= events[i].events;
+            continue;
+        }
+        if (fd < 0 || (size_t)fd >= daemon->watched_size ||
+            NULL == (conn = daemon->watched[fd]))
+            continue;
+        /* a registration fires once and is re-armed after the handlers */
+        conn->watch.armed = 0;
+        conn->watch.ready |= events[i].events;
+        enqueue(daemon, conn);
+    }
+    
+    if (INVALID_SOCKET != daemon->socket && 0 != daemon->watch.ready) {
+        daemon->watch.ready = 0;
+        accept_connections(daemon);
+    }
+    return run_queue(daemon);
+}
+
+/**
+ * One iteration of the event loop on a backend with a readiness engine:
+ * handle what the engine reported.  Registrations are pushed as
+ * connections come, change interest and fire, so unlike httpd_select()
+ * nothing is rebuilt or copied per iteration and sockets are not limited
+ * to FD_SETSIZE.
+ */
+static httpd_status httpd_ready(struct httpd_daemon* daemon,
+                                httpd_status mayblock) {
+    watch_event_t events[HTTPD_READY_EVENTS];
+    uint32_t listen_events;
+    int num_ready;
+    
+    if (HTTPD_YES == daemon->shutdown) {
+        return HTTPD_NO;
     }
-    tv = &timeout;
-    num_ready = select(maxsock + 1, &rs, &ws, &es, tv);
+    
+    if (INVALID_SOCKET != daemon->socket) {
+        listen_events = WATCH_IN;
+        if (daemon->connections == daemon->connection_limit &&
+            daemon->at_limit)
+            listen_events = 0;
+        update_watch(daemon, daemon->socket, &daemon->watch, listen_events);
+    }
+    
+    if (NULL != daemon->queue_head)
+        mayblock = HTTPD_NO;
+    num_ready = daemon->backend->ready(events, HTTPD_READY_EVENTS,
+                                       wait_timeout(daemon, mayblock));
+    update_clock(daemon);
     
     if (HTTPD_YES == daemon->shutdown)
         return HTTPD_NO;
-    if (num_ready < 0) {
-        if (HTTPD_YES == err_state)
-            return HTTPD_NO;
-        else
-            return HTTPD_YES;
+    if (num_ready < 0)
+        num_ready = 0;
+    
+    return run_from_ready(daemon, events, num_ready);
+}
+
+/**
+ * One iteration of the event loop on poll().  The set is maintained in
+ * place as connections are added, change interest and go away, so unlike
+ * httpd_select() nothing is rebuilt per iteration and sockets are not
+ * limited to FD_SETSIZE.  The set is only scanned until every reported
+ * entry is found.
+ */
+static httpd_status httpd_poll(struct httpd_daemon* daemon,
+                               httpd_status mayblock) {
+    struct httpd_connection* conn;
+    short revents;
+    size_t i;
+    int num_ready;
+    
+    if (HTTPD_YES == daemon->shutdown) {
+        return HTTPD_NO;
     }
     
-    r = run_from_select(daemon, &rs, &ws, &es);
-    if (HTTPD_YES == r) {
-        if (HTTPD_YES == err_state)
-            return HTTPD_NO;
-        else
-            return HTTPD_YES;
+    daemon->pollfds[0].events = POLLIN;
+    if (daemon->connections == daemon->connection_limit &&
+        daemon->at_limit)
+        daemon->pollfds[0].events = 0;
+    
+    if (NULL != daemon->queue_head)
+        mayblock = HTTPD_NO;
+    num_ready = daemon->backend->poll(daemon->pollfds, daemon->poll_count,
+                                      wait_timeout(daemon, mayblock));
+    update_clock(daemon);
+    
+    if (HTTPD_YES == daemon->shutdown)
+        return HTTPD_NO;
+    if (num_ready < 0)
+        num_ready = 0;
+    
+    if (num_ready > 0 && 0 != daemon->pollfds[0].revents)
+        num_ready--;
+    for (i = 1; num_ready > 0 && i < daemon->poll_count; i++) {
+        revents = daemon->pollfds[i].revents;
+        if (0 == revents)
+            continue;
+        num_ready--;
+        conn = daemon->polled[i];
+        if (revents & POLLIN)
+            conn->watch.ready |= WATCH_IN;
+        if (revents & POLLOUT)
+            conn->watch.ready |= WATCH_OUT;
+        if (revents & (POLLERR | POLLNVAL))
+            conn->watch.ready |= WATCH_ERR;
+        if (revents & POLLHUP)
+            conn->watch.ready |= WATCH_HUP;
+        enqueue(daemon, conn);
     }
-    return HTTPD_NO;
+    if (daemon->pollfds[0].revents & POLLIN)
+        accept_connections(daemon);
+    return run_queue(daemon);
+}
+
+#ifdef __linux__
+/**
+ * One iteration of the event loop on epoll.  Connections are registered
+ * edge-triggered once and modified only when their interest changes;
+ * readiness is remembered in `watch.ready` until a call would block, so
+ * each iteration touches only the connections epoll reported and those
+ * still on the run queue, never the whole list.
+ */
+static httpd_status httpd_epoll(struct httpd_daemon* daemon,
+                                httpd_status mayblock) {
+    struct epoll_event events[HTTPD_READY_EVENTS];
+    struct httpd_connection* conn;
+    uint32_t ready;
+    int num_ready, j;
+    
+    if (HTTPD_YES == daemon->shutdown) {
+        return HTTPD_NO;
+    }
+    
+    if (NULL != daemon->queue_head || 0 != daemon->watch.ready)
+        mayblock = HTTPD_NO;
+    num_ready = daemon->backend->epoll_wait(daemon->epfd, events,
+                                            HTTPD_READY_EVENTS,
+                                            wait_timeout(daemon, mayblock));
+    update_clock(daemon);
+    
+    if (HTTPD_YES == daemon->shutdown)
+        return HTTPD_NO;
+    if (num_ready < 0)
+        return HTTPD_YES;
+    
+    for (j = 0; j < num_ready; j++) {
+        ready = 0;
+        if (events[j].events & EPOLLIN)
+            ready |= WATCH_IN;
+        if (events[j].events & EPOLLOUT)
+            ready |= WATCH_OUT;
+        if (events[j].events & EPOLLERR)
+            ready |= WATCH_ERR;
+        if (events[j].events & EPOLLHUP)
+            ready |= WATCH_HUP;
+        conn = events[j].data.ptr;
+        if (NULL == conn) {
+            daemon->watch.ready |= ready;
+            continue;
+        }
+        conn->watch.ready |= ready;
+        enqueue(daemon, conn);
+    }
+    
+    /* the listening socket is edge-triggered too: it stays ready until
+     its backlog is empty */
+    if (0 != daemon->watch.ready &&
+        HTTPD_YES != accept_connections(daemon))
+        daemon->watch.ready = 0;
+    
+    return run_queue(daemon);
+}
+
+/**
+ * Create the epoll instance and register the listening socket.
+ */
+static httpd_status epoll_open(struct httpd_daemon* daemon) {
+    struct epoll_event event;
+    
+    daemon->epfd = daemon->backend->epoll_create1(EPOLL_CLOEXEC);
+    if (-1 == daemon->epfd)
+        return HTTPD_NO;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = NULL;
+    if (0 != daemon->backend->epoll_ctl(daemon->epfd, EPOLL_CTL_ADD,
+                                        daemon->socket, &event))
+        return HTTPD_NO;
+    daemon->interest_changed = &epoll_interest_changed;
+    return HTTPD_YES;
+}
+
+/**
+ * (Re-)submit the accept request of the listening socket.  Accepted
+ * sockets come out non-blocking and close-on-exec, without the fcntl()
+ * calls of accept_connection().
+ */
+static void uring_accept(struct httpd_daemon* daemon) {
+    struct io_uring_sqe* sqe;
+    
+    if (INVALID_SOCKET == daemon->socket)
+        return;
+    sqe = uring_sqe(&daemon->uring);
+    if (NULL == sqe) {
+        log_warn("Cannot accept: %s", strerror(errno));
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = daemon->socket;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    if (daemon->uring_multishot)
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = HTTPD_URING_ACCEPT;
+}
+
+static void uring_accepted(struct httpd_daemon* daemon, int res, int more) {
+    struct sockaddr_in sock_addr;
+    
+    if (res >= 0) {
+        /* a multishot accept has nowhere to put the peer's address */
+        memset(&sock_addr, 0, sizeof(sock_addr));
+        sock_addr.sin_family = AF_INET;
+        log_debug("accepted socket %d", res);
+        internal_add_connection(daemon, res, (struct sockaddr*)&sock_addr,
+                                sizeof(sock_addr), HTTPD_NO);
+    } else if (-EINVAL == res && daemon->uring_multishot) {
+        log_warn("No multishot accept, accepting one at a time.");
+        daemon->uring_multishot = 0;
+    } else if ((-EMFILE == res || -ENFILE == res ||
+                -ENOMEM == res || -ENOBUFS == res) &&
+               0 != daemon->connections) {
+        daemon->at_limit = 1;
+    }
+    if (!more)
+        uring_accept(daemon);
+}
+
+/**
+ * One iteration of the event loop on io_uring.  Works like httpd_epoll(),
+ * except that the changes of interest since the last iteration and the
+ * wait for completions cost a single system call, and that new
+ * connections arrive as completions rather than as readiness of the
+ * listening socket.
+ */
+static httpd_status httpd_uring(struct httpd_daemon* daemon,
+                                httpd_status mayblock) {
+    struct io_uring_cqe* cqe;
+    struct httpd_connection* conn;
+    httpd_socket fd;
+    uint64_t data;
+    uint32_t ready;
+    int res, more;
+    
+    if (HTTPD_YES == daemon->shutdown) {
+        return HTTPD_NO;
+    }
+    
+    if (NULL != daemon->queue_head)
+        mayblock = HTTPD_NO;
+    if (0 > uring_wait(&daemon->uring, HTTPD_YES == mayblock,
+                       wait_timeout(daemon, mayblock)))
+        log_warn("io_uring_enter: %s", strerror(errno));
+    update_clock(daemon);
+    
+    if (HTTPD_YES == daemon->shutdown)
+        return HTTPD_NO;
+    
+    while (NULL != (cqe = uring_cqe(&daemon->uring))) {
+        data = cqe->user_data;
+        res = cqe->res;
+        more = cqe->flags & IORING_CQE_F_MORE;
+        uring_cqe_seen(&daemon->uring);
+        
+        if (HTTPD_URING_ACCEPT == data) {
+            uring_accepted(daemon, res, more);
+            continue;
+        }
+        fd = (httpd_socket)(uint32_t)data;
+        if (HTTPD_URING_NONE == data || fd < 0 ||
+            (size_t)fd >= daemon->watched_size ||
+            NULL == (conn = daemon->watched[fd]) ||
+            !conn->watch.added || conn->watch.tag != data >> 32)
+            continue;
+        if (res > 0) {
+            ready = 0;
+            if (res & POLLIN)
+                ready |= WATCH_IN;
+            if (res & POLLOUT)
+                ready |= WATCH_OUT;
+            if (res & POLLERR)
+                ready |= WATCH_ERR;
+            if (res & POLLHUP)
+                ready |= WATCH_HUP;
+            conn->watch.ready |= ready;
+            enqueue(daemon, conn);
+        }
+        /* the kernel ended the request: submit another one */
+        if (!more) {
+            conn->watch.added = 0;
+            uring_update(conn);
+        }
+    }
+    
+    return run_queue(daemon);
+}
+
+/**
+ * Set up the io_uring instance and start accepting.
+ */
+static httpd_status uring_start(struct httpd_daemon* daemon) {
+    if (0 != uring_open(&daemon->uring, HTTPD_URING_ENTRIES))
+        return HTTPD_NO;
+    daemon->uring_multishot = 1;
+    daemon->interest_changed = &uring_interest_changed;
+    uring_accept(daemon);
+    return HTTPD_YES;
 }
+#endif
 
 static void* select_thread(void* cls) {
     struct httpd_daemon* daemon = cls;
     while (HTTPD_YES != daemon->shutdown) {
-        httpd_select(daemon, HTTPD_YES);
+        switch (daemon->event_loop) {
+            case HTTPD_EVENT_LOOP_BACKEND:
+                httpd_ready(daemon, HTTPD_YES);
+                break;
+#ifdef __linux__
+            case HTTPD_EVENT_LOOP_EPOLL:
+                httpd_epoll(daemon, HTTPD_YES);
+                break;
+            case HTTPD_EVENT_LOOP_URING:
+                httpd_uring(daemon, HTTPD_YES);
+                break;
+#endif
+            case HTTPD_EVENT_LOOP_POLL:
+                httpd_poll(daemon, HTTPD_YES);
+                break;
+            default:
+                httpd_select(daemon, HTTPD_YES);
+                break;
+        }
+        run_timers(daemon);
         httpd_cleanup_connections(daemon);
     }
     return HTTPD_YES;
@@ -441,55 +1350,168 @@ static void* select_thread(void* cls) {
 
 httpd_socket create_listen_socket(struct httpd_daemon* daemon) {
     httpd_socket fd;
-    fd = socket(AF_INET, SOCK_STREAM, 0);
+#if defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+    /* born non-blocking and close-on-exec, without fcntl() calls */
+    fd = daemon->backend->socket(AF_INET,
+                                 SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                                 0);
+#else
+    fd = daemon->backend->socket(AF_INET, SOCK_STREAM, 0);
 
     if (INVALID_SOCKET == fd) {
         return INVALID_SOCKET;
     }
     
-    make_noninheritable(fd);
+    make_noninheritable(daemon, fd);
+#endif
     
     return fd;
 }
 
-const char *mem_name = "ipcm";
-const char *sem_name = "ipcs";
+static httpd_status parse_options(struct httpd_daemon* daemon,
+                                  va_list ap) {
+    enum HTTPD_OPTION opt;
+    
+    while (HTTPD_OPTION_END != (opt = va_arg(ap, enum HTTPD_OPTION))) {
+        switch (opt) {
+            case HTTPD_OPTION_BACKEND:
+                switch (va_arg(ap, enum HTTPD_Backend)) {
+                    case HTTPD_BACKEND_IPC:
+                        daemon->backend = &httpd_ipc_backend;
+                        break;
+                    case HTTPD_BACKEND_DIRECT:
+                        daemon->backend = &httpd_direct_backend;
+                        break;
+                    case HTTPD_BACKEND_HYBRID:
+                        daemon->backend = &httpd_hybrid_backend;
+                        break;
+                    default:
+                        log_error("Unknown backend.");
+                        return HTTPD_NO;
+                }
+                break;
+            case HTTPD_OPTION_CPU:
+                daemon->cpu = va_arg(ap, int);
+                break;
+            case HTTPD_OPTION_THREAD_POOL_SIZE:
+                daemon->worker_pool_size = va_arg(ap, unsigned int);
+                break;
+            case HTTPD_OPTION_ACCEPT_BUDGET:
+                daemon->accept_budget = va_arg(ap, unsigned int);
+                if (0 == daemon->accept_budget)
+                    daemon->accept_budget = 1;
+                break;
+            case HTTPD_OPTION_CONNECTION_TIMEOUT:
+                daemon->connection_timeout =
+                1000 * (uint64_t)va_arg(ap, unsigned int);
+                break;
+            case HTTPD_OPTION_EVENT_LOOP:
+                daemon->event_loop = va_arg(ap, enum HTTPD_EventLoop);
+                break;
+            case HTTPD_OPTION_SHARED_POOLS:
+                daemon->shared_pools =
+                HTTPD_YES == va_arg(ap, int) ? HTTPD_YES : HTTPD_NO;
+                break;
+            default:
+                log_error("Unknown option %d.", opt);
+                return HTTPD_NO;
+        }
+    }
+    return HTTPD_YES;
+}
 
-struct httpd_daemon* create_daemon(uint16_t port,
-                                   HTTPD_AccessHandlerCallback dh,
-                                   void* dh_cls) {
+/**
+ * Settle HTTPD_EVENT_LOOP_AUTO and check that the loop asked for suits
+ * the backend.
+ */
+static httpd_status resolve_event_loop(struct httpd_daemon* daemon) {
+    if (HTTPD_EVENT_LOOP_AUTO == daemon->event_loop) {
+        if (NULL != daemon->backend->ready)
+            daemon->event_loop = HTTPD_EVENT_LOOP_BACKEND;
+#ifdef __linux__
+        else if (NULL != daemon->backend->epoll_create1)
+            daemon->event_loop = HTTPD_EVENT_LOOP_EPOLL;
+#endif
+        else if (NULL != daemon->backend->poll)
+            daemon->event_loop = HTTPD_EVENT_LOOP_POLL;
+        else
+            daemon->event_loop = HTTPD_EVENT_LOOP_SELECT;
+    }
+    switch (daemon->event_loop) {
+        case HTTPD_EVENT_LOOP_SELECT:
+            return HTTPD_YES;
+        case HTTPD_EVENT_LOOP_POLL:
+            if (NULL != daemon->backend->poll)
+                return HTTPD_YES;
+            log_error("The %s backend cannot poll.", daemon->backend->name);
+            return HTTPD_NO;
+        case HTTPD_EVENT_LOOP_EPOLL:
+#ifdef __linux__
+            if (NULL != daemon->backend->epoll_create1)
+                return HTTPD_YES;
+#endif
+            log_error("The %s backend cannot use epoll.",
+                      daemon->backend->name);
+            return HTTPD_NO;
+        case HTTPD_EVENT_LOOP_URING:
+            /* io_uring must see the sockets themselves */
+#ifdef __linux__
+            if (&httpd_direct_backend == daemon->backend)
+                return HTTPD_YES;
+#endif
+            log_error("The %s backend cannot use io_uring.",
+                      daemon->backend->name);
+            return HTTPD_NO;
+        case HTTPD_EVENT_LOOP_BACKEND:
+            if (NULL != daemon->backend->ready)
+                return HTTPD_YES;
+            log_error("The %s backend has no readiness engine.",
+                      daemon->backend->name);
+            return HTTPD_NO;
+        default:
+            log_error("Unknown event loop.");
+            return HTTPD_NO;
+    }
+}
 
-    struct httpd_daemon* daemon;
+/**
+ * Open the listening socket of `daemon` on `port`, set its loop up and
+ * start its thread.  What is left half done is undone by stop_loop().
+ */
+static httpd_status start_loop(struct httpd_daemon* daemon, uint16_t port) {
     httpd_socket socket_fd;
     httpd_sockaddr socket_addr;
     struct sockaddr* servaddr;
     socklen_t addr_len;
     int r;
+#ifdef SO_REUSEPORT
+    int on = 1;
+#endif
     
-    /* initialize daemon */
-    daemon = malloc(sizeof(struct httpd_daemon));
-    memset(daemon, 0, sizeof(struct httpd_daemon));
-    daemon->socket = INVALID_SOCKET;
-    daemon->shutdown = HTTPD_NO;
-    daemon->pool_size = HTTPD_POOL_SIZE_DEFAULT;
-    daemon->pool_increment = HTTPD_BUF_INC_SIZE;
-    daemon->default_handler = dh;
-    daemon->default_handler_cls = dh_cls;
-
-#ifdef ipc_h
-    /* initialize ipc */
-    if (ipc_init(mem_name, sem_name) == -1)
-    {
-#ifdef DEBUG
-        httpd_log("Failed to initialize IPC.");
-#endif /* DEBUG */
-        goto free_and_fail;
-    }
-#endif /* ipc_h */
-
     /* create a socket */
     socket_fd = create_listen_socket(daemon);
+    if (INVALID_SOCKET == socket_fd) {
+        log_error("Failed to create a socket.");
+        return HTTPD_NO;
+    }
     daemon->socket = socket_fd;
+    update_clock(daemon);
+    daemon->wheel_tick = daemon->now / HTTPD_WHEEL_TICK;
+    
+    /* let the other loops of the pool listen on the same port */
+    if (NULL != daemon->master) {
+#ifdef SO_REUSEPORT
+        r = daemon->backend->setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT,
+                                        &on, sizeof(on));
+#else
+        r = -1;
+        errno = ENOSYS;
+#endif
+        if (0 != r) {
+            log_error("Failed to share the port: %s", strerror(errno));
+            return HTTPD_NO;
+        }
+    }
     
     /* bind the socket to the given port */
     memset(&socket_addr, 0, sizeof(httpd_sockaddr));
@@ -501,50 +1523,193 @@ struct httpd_daemon* create_daemon(uint16_t port,
 #endif
     servaddr = (struct sockaddr*) &socket_addr;
     
-    r = bind(socket_fd, servaddr, addr_len);
+    r = daemon->backend->bind(socket_fd, servaddr, addr_len);
     if (-1 == r) {
-#ifdef DEBUG
-        httpd_log("Failed to bind.");
-#endif
-        goto free_and_fail;
+        log_error("Failed to bind.");
+        return HTTPD_NO;
     }
     
     /* start listening */
-    r = listen(socket_fd, SOMAXCONN);
+    r = daemon->backend->listen(socket_fd, SOMAXCONN);
     if (-1 == r) {
-#ifdef DEBUG
-        httpd_log("Failed to listen.");
+        log_error("Failed to listen.");
+        return HTTPD_NO;
+    }
+#if !defined(SOCK_NONBLOCK) || !defined(SOCK_CLOEXEC)
+    make_nonblocking(daemon, socket_fd);
 #endif
-        goto free_and_fail;
+    
+    if (HTTPD_EVENT_LOOP_SELECT == daemon->event_loop) {
+        if (socket_fd >= FD_SETSIZE) {
+            log_error("The listening socket does not fit in an fd_set.");
+            return HTTPD_NO;
+        }
+        FD_ZERO(&daemon->read_set);
+        FD_ZERO(&daemon->write_set);
+        select_set(daemon, socket_fd, WATCH_IN);
+    }
+    if (HTTPD_EVENT_LOOP_POLL == daemon->event_loop &&
+        HTTPD_YES != poll_add(daemon, socket_fd, NULL)) {
+        log_error("Failed to allocate the poll set.");
+        return HTTPD_NO;
+    }
+#ifdef __linux__
+    if (HTTPD_EVENT_LOOP_URING == daemon->event_loop &&
+        HTTPD_YES != uring_start(daemon)) {
+        log_warn("Cannot use io_uring (%s), falling back to epoll.",
+                 strerror(errno));
+        daemon->event_loop = HTTPD_EVENT_LOOP_EPOLL;
     }
-    make_nonblocking(socket_fd);
+    if (HTTPD_EVENT_LOOP_EPOLL == daemon->event_loop &&
+        HTTPD_YES != epoll_open(daemon)) {
+        log_error("Failed to create the epoll instance.");
+        return HTTPD_NO;
+    }
+#endif
     
     r = create_thread(&daemon->pid, daemon, select_thread, daemon);
+    if (0 != r) {
+        log_error("Failed to start a thread: %s", strerror(r));
+        return HTTPD_NO;
+    }
+    daemon->running = 1;
+    return HTTPD_YES;
+}
+
+/**
+ * Stop the thread of `daemon`, if any, and free what its loop holds.
+ */
+static void stop_loop(struct httpd_daemon* daemon) {
+    struct httpd_connection_slab* slab;
+    struct httpd_connection* pos;
+    httpd_socket fd;
+    size_t i;
+    
+    daemon->shutdown = HTTPD_YES;
+    fd = daemon->socket;
+    daemon->socket = INVALID_SOCKET;
+    if (daemon->running)
+        pthread_join(daemon->pid, NULL);
+    daemon->running = 0;
+    httpd_cleanup_connections(daemon);
+    while (NULL != (pos = daemon->connections_head)) {
+        daemon->connections_head = pos->next;
+        daemon->backend->close(pos->socket);
+        put_connection(daemon, pos);
+    }
+    daemon->connections_tail = NULL;
+    daemon->connections = 0;
+    while (NULL != (slab = daemon->slabs)) {
+        daemon->slabs = slab->next;
+        for (i = 0; i < HTTPD_CONNECTION_SLAB_SIZE; i++)
+            httpd_pool_destroy(slab->connections[i].pool);
+        free(slab);
+    }
+    daemon->free_connections = NULL;
+    if (INVALID_SOCKET != fd)
+        daemon->backend->close(fd);
+    if (-1 != daemon->epfd)
+        daemon->backend->close(daemon->epfd);
+    if (-1 != daemon->uring.fd)
+        uring_close(&daemon->uring);
+    free(daemon->watched);
+    free(daemon->pollfds);
+    free(daemon->polled);
+}
+
+struct httpd_daemon* create_daemon(uint16_t port,
+                                   HTTPD_AccessHandlerCallback dh,
+                                   void* dh_cls,
+                                   ...) {
+
+    struct httpd_daemon* daemon;
+    struct httpd_daemon* worker;
+    unsigned int i, started = 0;
+    va_list ap;
+    int r;
     
+    /* initialize daemon */
+    daemon = malloc(sizeof(struct httpd_daemon));
+    memset(daemon, 0, sizeof(struct httpd_daemon));
+    daemon->socket = INVALID_SOCKET;
+    daemon->shutdown = HTTPD_NO;
+    daemon->pool_size = HTTPD_POOL_SIZE_DEFAULT;
+    daemon->pool_increment = HTTPD_BUF_INC_SIZE;
+    daemon->accept_budget = HTTPD_ACCEPT_BUDGET_DEFAULT;
+    daemon->connection_timeout = 1000 * HTTPD_CONNECTION_TIMEOUT_DEFAULT;
+    daemon->shared_pools = HTTPD_NO;
+    daemon->cpu = -1;
+    daemon->event_loop = HTTPD_EVENT_LOOP_AUTO;
+    daemon->epfd = -1;
+    daemon->uring.fd = -1;
+    daemon->default_handler = dh;
+    daemon->default_handler_cls = dh_cls;
+    daemon->backend = &httpd_ipc_backend;
+    
+    va_start(ap, dh_cls);
+    r = parse_options(daemon, ap);
+    va_end(ap);
+    if (HTTPD_YES != r) {
+        free(daemon);
+        return NULL;
+    }
+    
+    /* initialize the backend */
+    if (0 != daemon->backend->init()) {
+        log_error("Failed to initialize the %s backend.",
+                  daemon->backend->name);
+        free(daemon);
+        return NULL;
+    }
+    if (HTTPD_YES != resolve_event_loop(daemon))
+        goto free_and_fail;
+    
+    if (daemon->worker_pool_size <= 1) {
+        daemon->worker_pool_size = 0;
+        if (HTTPD_YES != start_loop(daemon, port))
+            goto free_and_fail;
+        return daemon;
+    }
+    
+    /* a pool of loops that share nothing but the backend */
+    daemon->worker_pool = calloc(daemon->worker_pool_size,
+                                 sizeof(struct httpd_daemon));
+    if (NULL == daemon->worker_pool)
+        goto free_and_fail;
+    for (i = 0; i < daemon->worker_pool_size; i++) {
+        worker = &daemon->worker_pool[i];
+        *worker = *daemon;
+        worker->worker_pool = NULL;
+        worker->worker_pool_size = 0;
+        worker->master = daemon;
+        if (daemon->cpu >= 0)
+            worker->cpu = daemon->cpu + i;
+        started++;
+        if (HTTPD_YES != start_loop(worker, port))
+            goto free_and_fail;
+    }
     return daemon;
     
 free_and_fail:
+    for (i = 0; NULL != daemon->worker_pool && i < started; i++)
+        stop_loop(&daemon->worker_pool[i]);
+    stop_loop(daemon);
+    daemon->backend->fini();
+    free(daemon->worker_pool);
     free(daemon);
-#ifdef ipc_h
-    ipc_close();
-#endif
     return NULL;
 }
 
 void stop_daemon(struct httpd_daemon* daemon) {
-    //int fd;
+    unsigned int i;
     
     if (NULL == daemon)
         return;
     
-    daemon->shutdown = HTTPD_YES;
-    //fd = daemon->socket;
-    daemon->socket = INVALID_SOCKET;
-    // TODO: worker pool?
-    pthread_join(daemon->pid, NULL);
-    // TODO: close all connections
+    for (i = 0; i < daemon->worker_pool_size; i++)
+        stop_loop(&daemon->worker_pool[i]);
+    stop_loop(daemon);
+    daemon->backend->fini();
+    free(daemon->worker_pool);
     free(daemon);
-#ifdef ipc_h
-    ipc_close();
-#endif
 }
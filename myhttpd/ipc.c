@@ -7,50 +7,318 @@
 //
 
 #include "ipc.h"
+#include "log.h"
+#include "stats.h"
 #include <errno.h>
 #include <fcntl.h>
-#include <semaphore.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#endif
+
+/**
+ * Server end of one thread's channel.
+ */
+typedef struct {
+    int index;
+    int fd;
+    ring_t *mem;
+    uint64_t seq;
+    spinner_t spin;
+    bool shared;
+} channel_t;
+
+/**
+ * Freed block of the shared region, reused for requests of the same size.
+ */
+typedef struct region_block {
+    struct region_block *next;
+    size_t size;
+} region_block_t;
+
+/**
+ * Back-off between attempts to find a ready ipcd, in nanoseconds.
+ */
+#define IPC_RETRY_MIN 1000000L
+#define IPC_RETRY_MAX 64000000L
+#define IPC_RETRY_TOTAL 10000000000L
+
+/**
+ * Granularity of allocations from the shared region.
+ */
+#define REGION_ALIGN 0x1000
 
-int  ipc_fd;
-msg_t *ipc_mem;
-sem_t *ipc_sem;
+int  ipc_fd = -1;
+control_t *ipc_control;
+const char *ipc_name;
 pid_t daemon_pid;
+pthread_key_t ipc_key;
+pthread_once_t ipc_once = PTHREAD_ONCE_INIT;
 struct timespec rqtp;
+int ipc_region_fd = -1;
+unsigned char *ipc_region;
+size_t ipc_region_top;
+char ipc_region_name[CHANNEL_NAME_SIZE];
+region_block_t *ipc_region_free;
+pthread_mutex_t ipc_region_lock = PTHREAD_MUTEX_INITIALIZER;
+/**
+ * Every open channel by registry index, so that ipc_close() can release
+ * the channels of other threads too.
+ */
+channel_t *ipc_channels[MAX_CHANNELS];
+pthread_mutex_t ipc_channel_lock = PTHREAD_MUTEX_INITIALIZER;
 
-void ipc_close()
+/**
+ * Hand `ch` back to ipcd and drop its ring, leaving the structure to its
+ * thread.  Called with ipc_channel_lock held.
+ */
+static void channel_release(channel_t *ch)
 {
-    munmap(ipc_mem, MSG_SIZE);
-    close(ipc_fd);
-    sem_close(ipc_sem);
+    channel_entry_t *entry;
+
+    if (ipc_control != NULL)
+    {
+        entry = &ipc_control->channels[ch->index];
+        store_release(&entry->state, CHANNEL_CLOSING);
+        doorbell_ring(&ch->mem->request);
+        doorbell_ring(&ipc_control->registry);
+    }
+    munmap(ch->mem, RING_SIZE);
+    close(ch->fd);
+    ch->mem = NULL;
+    ipc_channels[ch->index] = NULL;
 }
 
-int ipc_init(const char *mem_name, const char *sem_name)
+static void channel_close(void *cls)
 {
-    fprintf(stderr, "server pid: %d\n", getpid());
-    fprintf(stderr, "daemon pid: ");
-    scanf("%d", &daemon_pid);
-    fprintf(stderr, "%d\n", daemon_pid);
+    channel_t *ch = cls;
 
-    ipc_fd = shm_open(mem_name, O_RDWR, S_IRWXU);
-    if (ipc_fd == -1)
+    if (ch == NULL)
+        return;
+    pthread_mutex_lock(&ipc_channel_lock);
+    /* ipc_close() may have released it already */
+    if (ch->mem != NULL)
+        channel_release(ch);
+    pthread_mutex_unlock(&ipc_channel_lock);
+    free(ch);
+}
+
+static void make_key()
+{
+    pthread_key_create(&ipc_key, channel_close);
+}
+
+static channel_t *channel_open()
+{
+    channel_t *ch;
+    channel_entry_t *entry;
+    uint32_t state;
+    int i, err;
+
+    if (ipc_control == NULL)
     {
-        fputs(strerror(errno), stderr);
-        goto error;
+        errno = ENOTCONN;
+        return NULL;
     }
-    ipc_mem = mmap(0, MSG_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, ipc_fd, 0);
-    if (ipc_mem == MAP_FAILED)
+    ch = calloc(1, sizeof(channel_t));
+    if (ch == NULL)
+        return NULL;
+    for (i = 0; i < MAX_CHANNELS; i++)
     {
-        fputs(strerror(errno), stderr);
+        state = CHANNEL_FREE;
+        if (compare_swap(&ipc_control->channels[i].state, &state,
+                         CHANNEL_CLAIMED))
+            break;
+    }
+    if (i == MAX_CHANNELS)
+    {
+        log_error("No free IPC channel.");
+        free(ch);
+        errno = EAGAIN;
+        return NULL;
+    }
+    ch->index = i;
+    entry = &ipc_control->channels[i];
+    snprintf(entry->name, CHANNEL_NAME_SIZE, "%s.%d.%d",
+             ipc_name, getpid(), i);
+    entry->pid = getpid();
+
+    shm_unlink(entry->name);
+    ch->fd = shm_open(entry->name, O_RDWR | O_CREAT | O_EXCL, S_IRWXU);
+    if (ch->fd == -1)
         goto error;
+    if (ftruncate(ch->fd, RING_SIZE))
+        goto error;
+    ch->mem = mmap(0, RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   ch->fd, 0);
+    if (ch->mem == MAP_FAILED)
+        goto error;
+    ch->mem->spin = ipc_control->spin;
+    ch->mem->busy = ipc_control->busy;
+    spinner_init(&ch->spin, ch->mem->spin, ch->mem->busy);
+
+    pthread_mutex_lock(&ipc_channel_lock);
+    ipc_channels[i] = ch;
+    pthread_mutex_unlock(&ipc_channel_lock);
+    store_release(&entry->state, CHANNEL_READY);
+    doorbell_ring(&ipc_control->registry);
+    pthread_setspecific(ipc_key, ch);
+    return ch;
+
+error:
+    err = errno;
+    log_error("%s: %s", entry->name, strerror(err));
+    if (ch->fd != -1)
+    {
+        close(ch->fd);
+        shm_unlink(entry->name);
+    }
+    entry->pid = 0;
+    store_release(&entry->state, CHANNEL_FREE);
+    free(ch);
+    errno = err;
+    return NULL;
+}
+
+static channel_t *channel()
+{
+    channel_t *ch = pthread_getspecific(ipc_key);
+    if (ch != NULL && ch->mem == NULL)
+    {
+        /* released by ipc_close(); open a new one if ipcd is back */
+        free(ch);
+        pthread_setspecific(ipc_key, NULL);
+        ch = NULL;
     }
-    ipc_sem = sem_open(sem_name, 0);
+    if (ch == NULL)
+        ch = channel_open();
+    return ch;
+}
+
+void ipc_close()
+{
+    int i;
+
+    /* channels first: ipcd may still be reading their rings and the
+     region, and the registry lives in the control segment */
+    pthread_mutex_lock(&ipc_channel_lock);
+    for (i = 0; i < MAX_CHANNELS; i++)
+        if (ipc_channels[i] != NULL)
+            channel_release(ipc_channels[i]);
+    pthread_mutex_unlock(&ipc_channel_lock);
+    free(pthread_getspecific(ipc_key));
+    pthread_setspecific(ipc_key, NULL);
+
+    pthread_mutex_lock(&ipc_region_lock);
+    if (ipc_region != NULL && ipc_region != MAP_FAILED)
+        munmap(ipc_region, REGION_SIZE);
+    ipc_region = NULL;
+    ipc_region_top = 0;
+    ipc_region_free = NULL;
+    if (ipc_region_fd != -1)
+    {
+        close(ipc_region_fd);
+        shm_unlink(ipc_region_name);
+    }
+    ipc_region_fd = -1;
+    pthread_mutex_unlock(&ipc_region_lock);
+
+    if (ipc_control != NULL)
+        munmap(ipc_control, CONTROL_SIZE);
+    ipc_control = NULL;
+    if (ipc_fd != -1)
+        close(ipc_fd);
+    ipc_fd = -1;
+}
+
+/**
+ * Look at the control segment behind `fd`: 1 if ipcd is serving it, 0 if
+ * it is not ready yet, -1 if it belongs to a dead ipcd and -2 if ipcd
+ * speaks another protocol version.
+ */
+static int control_state(int fd)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)CONTROL_SIZE)
+        return 0;
+    if (ipc_control == NULL)
+    {
+        ipc_control = mmap(0, CONTROL_SIZE, PROT_READ | PROT_WRITE,
+                           MAP_SHARED, fd, 0);
+        if (ipc_control == MAP_FAILED)
+        {
+            ipc_control = NULL;
+            return 0;
+        }
+    }
+    if (load_acquire(&ipc_control->ready) == 0)
+        return 0;
+    if (ipc_control->magic != CONTROL_MAGIC ||
+        ipc_control->version != CONTROL_VERSION)
+        return -2;
+    daemon_pid = ipc_control->daemon_pid;
+    if (kill(daemon_pid, 0) == -1 && errno == ESRCH)
+        return -1;
+    return 1;
+}
+
+int ipc_init(const char *mem_name)
+{
+    struct timespec nap = { 0, IPC_RETRY_MIN };
+    long waited = 0;
+    int state = 0;
+
+    pthread_once(&ipc_once, make_key);
+    ipc_name = mem_name;
+    while (1)
+    {
+        if (ipc_fd == -1)
+            ipc_fd = shm_open(mem_name, O_RDWR, S_IRWXU);
+        if (ipc_fd == -1 && errno != ENOENT)
+        {
+            log_error("%s: %s", mem_name, strerror(errno));
+            goto error;
+        }
+        if (ipc_fd != -1)
+            state = control_state(ipc_fd);
+        if (state == 1)
+            break;
+        if (state == -2)
+        {
+            log_error("IPC daemon speaks another protocol version.");
+            goto error;
+        }
+        if (state == -1)
+        {
+            /* left behind by a dead daemon; wait for a new one */
+            munmap(ipc_control, CONTROL_SIZE);
+            ipc_control = NULL;
+            close(ipc_fd);
+            ipc_fd = -1;
+        }
+        if (waited >= IPC_RETRY_TOTAL)
+        {
+            log_error("IPC daemon is not running.");
+            goto error;
+        }
+        nanosleep(&nap, NULL);
+        waited += nap.tv_nsec;
+        if (nap.tv_nsec < IPC_RETRY_MAX)
+            nap.tv_nsec *= 2;
+    }
+    log_debug("server pid: %d, daemon pid: %d", getpid(), daemon_pid);
 
     return 0;
 
@@ -59,159 +327,934 @@ error:
     return -1;
 }
 
-ret_t call(opcode op, args_t *args)
+static void wait_done(channel_t *ch, msg_t *msg, uint64_t seq)
+{
+    uint32_t bell;
+
+    while (load_acquire(&msg->done) != seq)
+    {
+        bell = doorbell_peek(&ch->mem->response);
+        if (load_acquire(&msg->done) == seq)
+            break;
+        doorbell_wait(&ch->mem->response, bell, &ch->spin);
+    }
+}
+
+static void submit(channel_t *ch)
+{
+    uint64_t now, seq;
+
+    if (ch->mem->head == ch->seq)
+        return;
+    now = stats_clock();
+    for (seq = ch->mem->head + 1; seq <= ch->seq; seq++)
+        ring_slot(ch->mem, seq)->submitted = now;
+    store_release(&ch->mem->head, ch->seq);
+    doorbell_ring(&ch->mem->request);
+}
+
+void ipc_wait(msg_t *msg)
 {
-    ipc_mem->op = op;
-    ipc_mem->args = *args;
-    kill(daemon_pid, SIGUSR1);
-    sem_wait(ipc_sem);
-    *args = ipc_mem->args;
-    return ipc_mem->ret;
+    channel_t *ch = channel();
+    if (ch->mem->head < msg->seq)
+        submit(ch);
+    wait_done(ch, msg, msg->seq);
+    if (msg->submitted != 0 && ipc_control != NULL)
+    {
+        stats_add(&ipc_control->stats, msg->op, STATS_ROUND_TRIP,
+                  stats_clock() - msg->submitted);
+        msg->submitted = 0;
+    }
 }
 
-int accept(int socket,
-           struct sockaddr * __restrict address,
-           socklen_t * __restrict address_len)
+void ipc_submit()
 {
-    args_t args;
-    args.accept_args.socket = socket;
-    memcpy(&args.accept_args.address, address, *address_len);
-    args.accept_args.address_len = *address_len;
-    accept_ret_t ret = call(ACCEPT, &args).accept_ret;
-    *address_len = args.accept_args.address_len;
+    channel_t *ch = pthread_getspecific(ipc_key);
+    if (ch != NULL && ch->mem != NULL)
+        submit(ch);
+}
+
+msg_t *ipc_prepare(opcode op)
+{
+    channel_t *ch = channel();
+    msg_t *msg;
+
+    if (ch == NULL)
+        return NULL;
+    msg = ring_slot(ch->mem, ch->seq + 1);
+    if (ch->seq >= RING_SLOTS)
+    {
+        /* the slot is still owned by the call RING_SLOTS before us */
+        if (ch->mem->head < ch->seq + 1 - RING_SLOTS)
+            submit(ch);
+        wait_done(ch, msg, ch->seq + 1 - RING_SLOTS);
+    }
+    msg->seq = ++ch->seq;
+    msg->op = op;
+    return msg;
+}
+
+const stats_t *ipc_stats()
+{
+    return ipc_control != NULL ? &ipc_control->stats : NULL;
+}
+
+int ipc_ready(watch_event_t *events,
+              int maxevents,
+              int timeout)
+{
+    channel_t *ch = channel();
+    struct timespec period;
+    ring_t *ring;
+    uint64_t head, tail;
+    uint32_t bell;
+    int n = 0;
+
+    if (ch == NULL)
+    {
+        errno = ENOTCONN;
+        return -1;
+    }
+    ring = ch->mem;
+    /* the interest set changes queued since the last wait go first */
+    submit(ch);
+    tail = ring->event_tail;
+    head = load_acquire(&ring->event_head);
+    if (head == tail && timeout != 0)
+    {
+        period.tv_sec = timeout / 1000;
+        period.tv_nsec = timeout % 1000 * 1000000L;
+        bell = doorbell_peek(&ring->ready);
+        if (load_acquire(&ring->event_head) == tail)
+            doorbell_wait_timed(&ring->ready, bell, &ch->spin,
+                                timeout > 0 ? &period : NULL);
+        head = load_acquire(&ring->event_head);
+    }
+    for (; tail != head && n < maxevents; tail++, n++)
+        events[n] = ring->events[tail & (EVENT_SLOTS - 1)];
+    if (n > 0)
+    {
+        store_release(&ring->event_tail, tail);
+        doorbell_ring(&ring->consumed);
+    }
+    return n;
+}
+
+static void *payload(msg_t *msg, size_t *offset)
+{
+    ring_t *ring = channel()->mem;
+    *offset = ring_window(ring, msg);
+    return &ring->arena[*offset];
+}
+
+ssize_t ipc_result(msg_t *msg)
+{
+    ssize_t ret;
+
+    if (msg == NULL)
+        return -1;
+    ipc_wait(msg);
+    switch (msg->op) {
+        case RECV:
+            ret = msg->ret.recv_ret;
+            break;
+        case SEND:
+            ret = msg->ret.send_ret;
+            break;
+        case SENDFILE:
+            ret = msg->ret.sendfile_ret;
+            break;
+        case SENDMSG:
+            ret = msg->ret.sendmsg_ret;
+            break;
+        case WRITEV:
+            ret = msg->ret.writev_ret;
+            break;
+        default:
+            ret = msg->ret.accept_ret;
+            break;
+    }
+    if (ret < 0)
+        errno = msg->err;
+    return ret;
+}
+
+/**
+ * Create the shared region.  On failure the region stays MAP_FAILED and
+ * pools fall back to private memory.
+ */
+static void region_open()
+{
+    snprintf(ipc_region_name, CHANNEL_NAME_SIZE, "%s.%d.pool",
+             ipc_name, getpid());
+    shm_unlink(ipc_region_name);
+    ipc_region_fd = shm_open(ipc_region_name, O_RDWR | O_CREAT | O_EXCL,
+                             S_IRWXU);
+    if (ipc_region_fd == -1)
+        goto error;
+    if (ftruncate(ipc_region_fd, REGION_SIZE))
+        goto error;
+    ipc_region = mmap(0, REGION_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      ipc_region_fd, 0);
+    if (ipc_region == MAP_FAILED)
+        goto error;
+    return;
+
+error:
+    log_error("%s: %s", ipc_region_name, strerror(errno));
+    ipc_region = MAP_FAILED;
+    if (ipc_region_fd != -1)
+    {
+        close(ipc_region_fd);
+        shm_unlink(ipc_region_name);
+    }
+    ipc_region_fd = -1;
+}
+
+void *ipc_region_allocate(size_t size)
+{
+    region_block_t **link, *block;
+    void *memory = NULL;
+
+    size = (size + REGION_ALIGN - 1) & ~(size_t)(REGION_ALIGN - 1);
+    if (size == 0)
+        return NULL;
+    pthread_mutex_lock(&ipc_region_lock);
+    if (ipc_region == NULL && ipc_control != NULL)
+        region_open();
+    if (ipc_region == NULL || ipc_region == MAP_FAILED)
+        goto done;
+    for (link = &ipc_region_free; *link != NULL; link = &(*link)->next)
+        if ((*link)->size == size)
+        {
+            block = *link;
+            *link = block->next;
+            memory = block;
+            goto done;
+        }
+    if (size <= REGION_SIZE - ipc_region_top)
+    {
+        memory = &ipc_region[ipc_region_top];
+        ipc_region_top += size;
+    }
+
+done:
+    pthread_mutex_unlock(&ipc_region_lock);
+    return memory;
+}
+
+void ipc_region_release(void *memory, size_t size)
+{
+    region_block_t *block = memory;
+
+    if (block == NULL)
+        return;
+    pthread_mutex_lock(&ipc_region_lock);
+    /* the region may have been dropped by ipc_close() since */
+    if (ipc_region == NULL || ipc_region == MAP_FAILED ||
+        (unsigned char *)block < ipc_region ||
+        (unsigned char *)block >= ipc_region + REGION_SIZE)
+    {
+        pthread_mutex_unlock(&ipc_region_lock);
+        return;
+    }
+    block->size = (size + REGION_ALIGN - 1) & ~(size_t)(REGION_ALIGN - 1);
+    block->next = ipc_region_free;
+    ipc_region_free = block;
+    pthread_mutex_unlock(&ipc_region_lock);
+}
+
+/**
+ * Whether `length` bytes at `buffer` lie in the shared region; if so,
+ * name them by `offset` and make sure ipcd has heard of the region.
+ */
+static bool in_region(const void *buffer, size_t length, size_t *offset)
+{
+    const unsigned char *p = buffer;
+    channel_entry_t *entry;
+    channel_t *ch;
+
+    if (ipc_region == NULL || ipc_region == MAP_FAILED ||
+        p < ipc_region || p >= ipc_region + REGION_SIZE ||
+        length > (size_t)(ipc_region + REGION_SIZE - p))
+        return false;
+    ch = channel();
+    if (ch == NULL)
+        return false;
+    if (!ch->shared)
+    {
+        entry = &ipc_control->channels[ch->index];
+        memcpy(entry->region, ipc_region_name, CHANNEL_NAME_SIZE);
+        store_release(&entry->region_size, REGION_SIZE);
+        ch->shared = true;
+    }
+    *offset = REGION_OFFSET | (size_t)(p - ipc_region);
+    return true;
+}
+
+static msg_t *call(msg_t *msg)
+{
+    ipc_result(msg);
+    return msg;
+}
+
+msg_t *ipc_prep_accept(int socket,
+                       socklen_t address_len)
+{
+    msg_t *msg = ipc_prepare(ACCEPT);
+    if (msg == NULL)
+        return NULL;
+    msg->args.accept_args.socket = socket;
+    msg->args.accept_args.address_len = address_len;
+    return msg;
+}
+
+msg_t *ipc_prep_accept4(int socket,
+                        socklen_t address_len,
+                        int flags)
+{
+    msg_t *msg = ipc_prepare(ACCEPT4);
+    if (msg == NULL)
+        return NULL;
+    msg->args.accept4_args.socket = socket;
+    msg->args.accept4_args.address_len = address_len;
+    msg->args.accept4_args.flags = flags;
+    return msg;
+}
+
+msg_t *ipc_prep_bind(int socket,
+                     const struct sockaddr *address,
+                     socklen_t address_len)
+{
+    msg_t *msg = ipc_prepare(BIND);
+    if (msg == NULL)
+        return NULL;
+    msg->args.bind_args.socket = socket;
+    /* ipcd fails an address that does not fit with EINVAL */
+    if (address_len <= sizeof(msg->args.bind_args.address))
+        memcpy(&msg->args.bind_args.address,
+               address,
+               address_len);
+    msg->args.bind_args.address_len = address_len;
+    return msg;
+}
+
+msg_t *ipc_prep_close(int fildes)
+{
+    msg_t *msg = ipc_prepare(CLOSE);
+    if (msg == NULL)
+        return NULL;
+    msg->args.close_args.fildes = fildes;
+    return msg;
+}
+
+msg_t *ipc_prep_epoll_create1(int flags)
+{
+    msg_t *msg = ipc_prepare(EPOLL_CREATE1);
+    if (msg == NULL)
+        return NULL;
+    msg->args.epoll_create1_args.flags = flags;
+    return msg;
+}
+
+msg_t *ipc_prep_epoll_ctl(int epfd,
+                          int op,
+                          int fd,
+                          uint32_t events,
+                          uint64_t data)
+{
+    msg_t *msg = ipc_prepare(EPOLL_CTL);
+    if (msg == NULL)
+        return NULL;
+    msg->args.epoll_ctl_args.epfd = epfd;
+    msg->args.epoll_ctl_args.op = op;
+    msg->args.epoll_ctl_args.fd = fd;
+    msg->args.epoll_ctl_args.events = events;
+    msg->args.epoll_ctl_args.data = data;
+    return msg;
+}
+
+msg_t *ipc_prep_epoll_wait(int epfd,
+                           int maxevents,
+                           int timeout)
+{
+    msg_t *msg = ipc_prepare(EPOLL_WAIT);
+    if (msg == NULL)
+        return NULL;
+    msg->args.epoll_wait_args.epfd = epfd;
+    msg->args.epoll_wait_args.maxevents = maxevents;
+    msg->args.epoll_wait_args.timeout = timeout;
+    payload(msg, &msg->args.epoll_wait_args.offset);
+    return msg;
+}
+
+msg_t *ipc_prep_fcntl(int fildes,
+                      int cmd,
+                      int arg)
+{
+    msg_t *msg = ipc_prepare(FCNTL);
+    if (msg == NULL)
+        return NULL;
+    msg->args.fcntl_args.fildes = fildes;
+    msg->args.fcntl_args.cmd = cmd;
+    msg->args.fcntl_args.arg = arg;
+    return msg;
+}
+
+msg_t *ipc_prep_handoff(int socket,
+                        const struct sockaddr_un *address,
+                        socklen_t address_len)
+{
+    msg_t *msg = ipc_prepare(HANDOFF);
+    if (msg == NULL)
+        return NULL;
+    if (address_len > sizeof(msg->args.handoff_args.address))
+        address_len = sizeof(msg->args.handoff_args.address);
+    msg->args.handoff_args.socket = socket;
+    memcpy(&msg->args.handoff_args.address, address, address_len);
+    msg->args.handoff_args.address_len = address_len;
+    return msg;
+}
+
+msg_t *ipc_prep_listen(int socket,
+                       int backlog)
+{
+    msg_t *msg = ipc_prepare(LISTEN);
+    if (msg == NULL)
+        return NULL;
+    msg->args.listen_args.socket = socket;
+    msg->args.listen_args.backlog = backlog;
+    return msg;
+}
+
+msg_t *ipc_prep_poll(const struct pollfd *fds,
+                     nfds_t nfds,
+                     int timeout)
+{
+    const nfds_t max = BUFFER_SIZE / sizeof(struct pollfd);
+    msg_t *msg = ipc_prepare(POLL);
+    if (msg == NULL)
+        return NULL;
+    msg->args.poll_args.nfds = nfds < max ? nfds : max;
+    msg->args.poll_args.timeout = timeout;
+    memcpy(payload(msg, &msg->args.poll_args.offset), fds,
+           msg->args.poll_args.nfds * sizeof(struct pollfd));
+    return msg;
+}
+
+msg_t *ipc_prep_recv(int socket,
+                     size_t length,
+                     int flags)
+{
+    msg_t *msg = ipc_prepare(RECV);
+    if (msg == NULL)
+        return NULL;
+    msg->args.recv_args.socket = socket;
+    msg->args.recv_args.length = length < BUFFER_SIZE ? length : BUFFER_SIZE;
+    msg->args.recv_args.flags = flags;
+    payload(msg, &msg->args.recv_args.offset);
+    return msg;
+}
+
+msg_t *ipc_prep_select(int nfds,
+                       const fd_set *readfds,
+                       const fd_set *writefds,
+                       const fd_set *errorfds,
+                       const struct timeval *timeout)
+{
+    msg_t *msg = ipc_prepare(SELECT);
+    if (msg == NULL)
+        return NULL;
+    msg->args.select_args.nfds = nfds;
+    FD_ZERO(&msg->args.select_args.readfds);
+    FD_ZERO(&msg->args.select_args.writefds);
+    FD_ZERO(&msg->args.select_args.errorfds);
+    if (readfds != NULL)
+        msg->args.select_args.readfds = *readfds;
+    if (writefds != NULL)
+        msg->args.select_args.writefds = *writefds;
+    if (errorfds != NULL)
+        msg->args.select_args.errorfds = *errorfds;
+    msg->args.select_args.timeout.tv_sec = timeout->tv_sec;
+    msg->args.select_args.timeout.tv_usec = timeout->tv_usec;
+    return msg;
+}
+
+msg_t *ipc_prep_send(int socket,
+                     const void *buffer,
+                     size_t length,
+                     int flags)
+{
+    msg_t *msg = ipc_prepare(SEND);
+    if (msg == NULL)
+        return NULL;
+    msg->args.send_args.socket = socket;
+    msg->args.send_args.flags = flags;
+    if (in_region(buffer, length, &msg->args.send_args.offset))
+    {
+        msg->args.send_args.length = length;
+        return msg;
+    }
+    msg->args.send_args.length = length < BUFFER_SIZE ? length : BUFFER_SIZE;
+    memcpy(payload(msg, &msg->args.send_args.offset),
+           buffer, msg->args.send_args.length);
+    return msg;
+}
+
+msg_t *ipc_prep_sendfile(int out_fd,
+                         int in_fd,
+                         int64_t offset,
+                         size_t count)
+{
+    msg_t *msg = ipc_prepare(SENDFILE);
+    if (msg == NULL)
+        return NULL;
+    msg->args.sendfile_args.out_fd = out_fd;
+    msg->args.sendfile_args.in_fd = in_fd;
+    msg->args.sendfile_args.offset = offset;
+    msg->args.sendfile_args.count = count;
+    return msg;
+}
+
+static int gather(msg_t *msg,
+                  const struct iovec *iov,
+                  int iovcnt,
+                  size_t *iov_len,
+                  size_t *offset)
+{
+    unsigned char *dst = payload(msg, offset);
+    size_t total = 0;
+    int i;
+
+    for (i = 0; i < iovcnt && i < IOV_SIZE && total < BUFFER_SIZE; i++)
+    {
+        iov_len[i] = iov[i].iov_len < BUFFER_SIZE - total ?
+                     iov[i].iov_len : BUFFER_SIZE - total;
+        memcpy(dst + total, iov[i].iov_base, iov_len[i]);
+        total += iov_len[i];
+    }
+    return i;
+}
+
+msg_t *ipc_prep_sendmsg(int socket,
+                        const struct msghdr *message,
+                        int flags)
+{
+    msg_t *msg = ipc_prepare(SENDMSG);
+    if (msg == NULL)
+        return NULL;
+    msg->args.sendmsg_args.socket = socket;
+    msg->args.sendmsg_args.flags = flags;
+    /* ipcd fails a name that does not fit with EINVAL */
+    msg->args.sendmsg_args.namelen = message->msg_namelen;
+    if (message->msg_name != NULL &&
+        message->msg_namelen <= sizeof(msg->args.sendmsg_args.name))
+        memcpy(&msg->args.sendmsg_args.name, message->msg_name,
+               message->msg_namelen);
+    msg->args.sendmsg_args.iovlen =
+    gather(msg, message->msg_iov, (int)message->msg_iovlen,
+           msg->args.sendmsg_args.iov_len, &msg->args.sendmsg_args.offset);
+    return msg;
+}
+
+msg_t *ipc_prep_setsockopt(int socket,
+                           int level,
+                           int option_name,
+                           const void *option_value,
+                           socklen_t option_len)
+{
+    msg_t *msg = ipc_prepare(SETSOCKOPT);
+    if (msg == NULL)
+        return NULL;
+    msg->args.setsockopt_args.socket = socket;
+    msg->args.setsockopt_args.level = level;
+    msg->args.setsockopt_args.option_name = option_name;
+    msg->args.setsockopt_args.option_len = option_len;
+    /* ipcd fails an option that does not fit with EINVAL */
+    if (option_len <= OPTION_SIZE)
+        memcpy(msg->args.setsockopt_args.option_value, option_value,
+               option_len);
+    return msg;
+}
+
+msg_t *ipc_prep_shutdown(int socket,
+                         int how)
+{
+    msg_t *msg = ipc_prepare(SHUTDOWN);
+    if (msg == NULL)
+        return NULL;
+    msg->args.shutdown_args.socket = socket;
+    msg->args.shutdown_args.how = how;
+    return msg;
+}
+
+msg_t *ipc_prep_socket(int domain,
+                       int type,
+                       int protocol)
+{
+    msg_t *msg = ipc_prepare(SOCKET);
+    if (msg == NULL)
+        return NULL;
+    msg->args.socket_args.domain = domain;
+    msg->args.socket_args.type = type;
+    msg->args.socket_args.protocol = protocol;
+    return msg;
+}
+
+msg_t *ipc_prep_watch(int op,
+                      int fd,
+                      uint32_t events,
+                      uint64_t data)
+{
+    msg_t *msg = ipc_prepare(WATCH);
+    if (msg == NULL)
+        return NULL;
+    msg->args.watch_args.op = op;
+    msg->args.watch_args.fd = fd;
+    msg->args.watch_args.events = events;
+    msg->args.watch_args.data = data;
+    return msg;
+}
+
+msg_t *ipc_prep_writev(int fildes,
+                       const struct iovec *iov,
+                       int iovcnt)
+{
+    msg_t *msg = ipc_prepare(WRITEV);
+    if (msg == NULL)
+        return NULL;
+    msg->args.writev_args.fildes = fildes;
+    msg->args.writev_args.iovcnt =
+    gather(msg, iov, iovcnt,
+           msg->args.writev_args.iov_len, &msg->args.writev_args.offset);
+    return msg;
+}
+
+int ipc_accept(int socket,
+               struct sockaddr * __restrict address,
+               socklen_t * __restrict address_len)
+{
+    msg_t *msg = call(ipc_prep_accept(socket, *address_len));
+    if (msg == NULL)
+        return -1;
+    if (*address_len > msg->args.accept_args.address_len)
+        *address_len = msg->args.accept_args.address_len;
     memcpy(address,
-           &args.accept_args.address,
+           &msg->args.accept_args.address,
            *address_len);
+    return msg->ret.accept_ret;
+}
+
+#ifdef __linux__
+int ipc_accept4(int socket,
+                struct sockaddr * __restrict address,
+                socklen_t * __restrict address_len,
+                int flags)
+{
+    socklen_t len = address_len != NULL ? *address_len : 0;
+    msg_t *msg = call(ipc_prep_accept4(socket, len, flags));
+    if (msg == NULL)
+        return -1;
+    if (address != NULL && address_len != NULL)
+    {
+        if (*address_len > msg->args.accept4_args.address_len)
+            *address_len = msg->args.accept4_args.address_len;
+        memcpy(address,
+               &msg->args.accept4_args.address,
+               *address_len);
+    }
+    return msg->ret.accept4_ret;
+}
+#endif
+
+int ipc_bind(int socket,
+             const struct sockaddr *address,
+             socklen_t address_len)
+{
+    if (address_len > sizeof(struct sockaddr))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    msg_t *msg = call(ipc_prep_bind(socket, address, address_len));
+    return msg != NULL ? msg->ret.bind_ret : -1;
+}
+
+int ipc_closefd(int fildes)
+{
+    msg_t *msg = call(ipc_prep_close(fildes));
+    return msg != NULL ? msg->ret.close_ret : -1;
+}
+
+#ifdef __linux__
+int ipc_epoll_create1(int flags)
+{
+    msg_t *msg = call(ipc_prep_epoll_create1(flags));
+    return msg != NULL ? msg->ret.epoll_create1_ret : -1;
+}
+
+int ipc_epoll_ctl(int epfd,
+                  int op,
+                  int fd,
+                  struct epoll_event *event)
+{
+    struct epoll_event none = { 0 };
+    msg_t *msg;
+    if (event == NULL)
+        event = &none;
+    msg = call(ipc_prep_epoll_ctl(epfd, op, fd, event->events,
+                                  event->data.u64));
+    return msg != NULL ? msg->ret.epoll_ctl_ret : -1;
+}
+
+int ipc_epoll_wait(int epfd,
+                   struct epoll_event *events,
+                   int maxevents,
+                   int timeout)
+{
+    const int max = BUFFER_SIZE / sizeof(struct epoll_event);
+    msg_t *msg = call(ipc_prep_epoll_wait(epfd, maxevents < max ?
+                                          maxevents : max, timeout));
+    if (msg == NULL)
+        return -1;
+    epoll_wait_ret_t ret = msg->ret.epoll_wait_ret;
+    if (ret > 0)
+        memcpy(events, payload(msg, &msg->args.epoll_wait_args.offset),
+               ret * sizeof(struct epoll_event));
     return ret;
 }
+#endif
 
-int bind(int socket,
-         const struct sockaddr *address,
-         socklen_t address_len)
+int ipc_fcntl(int fildes,
+              int cmd,
+              int arg)
 {
-    args_t args;
-    args.bind_args.socket = socket;
-    memcpy(&args.bind_args.address,
-           address,
-           address_len);
-    args.bind_args.address_len = address_len;
-    return call(BIND, &args).bind_ret;
+    msg_t *msg = call(ipc_prep_fcntl(fildes, cmd, arg));
+    return msg != NULL ? msg->ret.fcntl_ret : -1;
 }
 
-int close1(int fildes)
+int ipc_handoff(int socket,
+                const struct sockaddr_un *address,
+                socklen_t address_len)
 {
-    args_t args;
-    args.close_args.fildes = fildes;
-    return call(CLOSE, &args).close_ret;
+    if (address_len > sizeof(struct sockaddr_un))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    msg_t *msg = call(ipc_prep_handoff(socket, address, address_len));
+    return msg != NULL ? msg->ret.handoff_ret : -1;
 }
 
-int fcntl3(int fildes,
-           int cmd,
-           int arg)
+int ipc_listen(int socket,
+               int backlog)
 {
-    args_t args;
-    args.fcntl_args.fildes = fildes;
-    args.fcntl_args.cmd = cmd;
-    args.fcntl_args.arg = arg;
-    return call(FCNTL, &args).fcntl_ret;
+    msg_t *msg = call(ipc_prep_listen(socket, backlog));
+    return msg != NULL ? msg->ret.listen_ret : -1;
 }
 
-int fcntl2(int fildes,
-           int cmd)
+static int poll_window(struct pollfd *fds,
+                       nfds_t nfds,
+                       int timeout)
 {
-    return fcntl3(fildes, cmd, 0);
+    msg_t *msg = call(ipc_prep_poll(fds, nfds, timeout));
+    if (msg == NULL)
+        return -1;
+    poll_ret_t ret = msg->ret.poll_ret;
+    if (ret >= 0)
+        memcpy(fds, payload(msg, &msg->args.poll_args.offset),
+               msg->args.poll_args.nfds * sizeof(struct pollfd));
+    return ret;
 }
 
-int listen(int socket,
-           int backlog)
+int ipc_poll(struct pollfd *fds,
+             nfds_t nfds,
+             int timeout)
 {
-    args_t args;
-    args.listen_args.socket = socket;
-    args.listen_args.backlog = backlog;
-    return call(LISTEN, &args).listen_ret;
+    const nfds_t max = BUFFER_SIZE / sizeof(struct pollfd);
+    nfds_t done;
+    int ret, total = 0;
+
+    for (done = max; done < nfds; done += max)
+    {
+        ret = poll_window(fds + done, nfds - done < max ? nfds - done : max,
+                          0);
+        if (ret < 0)
+            return ret;
+        total += ret;
+    }
+    ret = poll_window(fds, nfds < max ? nfds : max, total > 0 ? 0 : timeout);
+    return ret < 0 ? ret : total + ret;
 }
 
-ssize_t recv(int socket,
-             void *buffer,
-             size_t length,
-             int flags)
+ssize_t ipc_recv(int socket,
+                 void *buffer,
+                 size_t length,
+                 int flags)
 {
-    args_t args;
-    args.recv_args.socket = socket;
-    args.recv_args.length = length;
-    args.recv_args.flags = flags;
-    recv_ret_t ret = call(RECV, &args).recv_ret;
-    memcpy(buffer, args.recv_args.buffer, length);
+    msg_t *msg;
+    size_t offset;
+
+    if (in_region(buffer, length, &offset))
+    {
+        /* ipcd receives straight into the caller's buffer */
+        msg = ipc_prepare(RECV);
+        if (msg == NULL)
+            return -1;
+        msg->args.recv_args.socket = socket;
+        msg->args.recv_args.length = length;
+        msg->args.recv_args.flags = flags;
+        msg->args.recv_args.offset = offset;
+        return ipc_result(msg);
+    }
+    msg = call(ipc_prep_recv(socket, length, flags));
+    if (msg == NULL)
+        return -1;
+    recv_ret_t ret = msg->ret.recv_ret;
+    if (ret > 0)
+        memcpy(buffer, payload(msg, &msg->args.recv_args.offset), ret);
     return ret;
 }
 
-int select(int nfds,
-           fd_set *__restrict readfds,
-           fd_set *__restrict writefds,
-           fd_set *__restrict errorfds,
-           struct timeval *__restrict timeout)
-{
-    args_t args;
-    args.select_args.nfds = nfds;
-    args.select_args.readfds  = *readfds;
-    args.select_args.writefds = *writefds;
-    args.select_args.errorfds = *errorfds;
-    args.select_args.timeout.tv_sec = timeout->tv_sec;
-    args.select_args.timeout.tv_usec = timeout->tv_usec;
-    select_ret_t ret = call(SELECT, &args).select_ret;
-    *readfds  = args.select_args.readfds;
-    *writefds = args.select_args.writefds;
-    *errorfds = args.select_args.errorfds;
-    timeout->tv_sec = args.select_args.timeout.tv_sec;
-    timeout->tv_usec = args.select_args.timeout.tv_usec;
+int ipc_select(int nfds,
+               fd_set *__restrict readfds,
+               fd_set *__restrict writefds,
+               fd_set *__restrict errorfds,
+               struct timeval *__restrict timeout)
+{
+    msg_t *msg = call(ipc_prep_select(nfds, readfds, writefds, errorfds,
+                                      timeout));
+    if (msg == NULL)
+        return -1;
+    if (readfds != NULL)
+        *readfds = msg->args.select_args.readfds;
+    if (writefds != NULL)
+        *writefds = msg->args.select_args.writefds;
+    if (errorfds != NULL)
+        *errorfds = msg->args.select_args.errorfds;
+    if (timeout != NULL)
+    {
+        timeout->tv_sec = msg->args.select_args.timeout.tv_sec;
+        timeout->tv_usec = msg->args.select_args.timeout.tv_usec;
+    }
+    return msg->ret.select_ret;
+}
+
+ssize_t ipc_send(int socket,
+                 const void *buffer,
+                 size_t length,
+                 int flags)
+{
+    size_t sent = 0;
+    do {
+        msg_t *msg = call(ipc_prep_send(socket, (const char *)buffer + sent,
+                                        length - sent, flags));
+        if (msg == NULL)
+            return sent > 0 ? (ssize_t)sent : -1;
+        send_ret_t ret = msg->ret.send_ret;
+        if (ret < 0)
+            return sent > 0 ? (ssize_t)sent : ret;
+        sent += ret;
+        if ((size_t)ret < msg->args.send_args.length)
+            break;
+    } while (sent < length);
+    return sent;
+}
+
+#ifdef __linux__
+ssize_t ipc_sendfile(int out_fd,
+                     int in_fd,
+                     off_t *offset,
+                     size_t count)
+{
+    off_t pos = offset != NULL ? *offset : lseek(in_fd, 0, SEEK_CUR);
+    if (pos == -1)
+        return -1;
+    msg_t *msg = call(ipc_prep_sendfile(out_fd, in_fd, pos, count));
+    if (msg == NULL)
+        return -1;
+    sendfile_ret_t ret = msg->ret.sendfile_ret;
+    if (ret > 0)
+    {
+        if (offset != NULL)
+            *offset = pos + ret;
+        else
+            lseek(in_fd, pos + ret, SEEK_SET);
+    }
     return ret;
 }
+#endif
+
+ssize_t ipc_sendmsg(int socket,
+                    const struct msghdr *message,
+                    int flags)
+{
+    if (message->msg_controllen != 0 ||
+        message->msg_namelen > sizeof(struct sockaddr_storage))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    msg_t *msg = call(ipc_prep_sendmsg(socket, message, flags));
+    return msg != NULL ? msg->ret.sendmsg_ret : -1;
+}
+
+int ipc_setsockopt(int socket,
+                   int level,
+                   int option_name,
+                   const void *option_value,
+                   socklen_t option_len)
+{
+    if (option_len > OPTION_SIZE)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    msg_t *msg = call(ipc_prep_setsockopt(socket, level, option_name,
+                                          option_value, option_len));
+    return msg != NULL ? msg->ret.setsockopt_ret : -1;
+}
+
+int ipc_shutdown(int socket,
+                 int how)
+{
+    msg_t *msg = call(ipc_prep_shutdown(socket, how));
+    return msg != NULL ? msg->ret.shutdown_ret : -1;
+}
 
-ssize_t send(int socket,
-             const void *buffer,
-             size_t length,
-             int flags)
+int ipc_socket(int domain,
+               int type,
+               int protocol)
 {
-    args_t args;
-    args.send_args.socket = socket;
-    args.send_args.length = length;
-    args.send_args.flags = flags;
-    memcpy(args.send_args.buffer, buffer, length);
-    return call(SEND, &args).send_ret;
+    msg_t *msg = call(ipc_prep_socket(domain, type, protocol));
+    return msg != NULL ? msg->ret.socket_ret : -1;
 }
 
-int setsockopt(int socket,
-               int level,
-               int option_name,
-               const void *option_value,
-               socklen_t option_len)
+int ipc_watch(int op,
+              int fd,
+              uint32_t events,
+              uint64_t data)
 {
-    args_t args;
-    args.setsockopt_args.socket = socket;
-    args.setsockopt_args.level = level;
-    args.setsockopt_args.option_name = option_name;
-    args.setsockopt_args.option_len = option_len;
-    memcpy(args.setsockopt_args.option_value, option_value, option_len);
-    return call(SETSOCKOPT, &args).setsockopt_ret;
+    msg_t *msg = call(ipc_prep_watch(op, fd, events, data));
+    return msg != NULL ? msg->ret.watch_ret : -1;
 }
 
-int socket(int domain,
-           int type,
-           int protocol)
+ssize_t ipc_writev(int fildes,
+                   const struct iovec *iov,
+                   int iovcnt)
 {
-    args_t args;
-    args.socket_args.domain = domain;
-    args.socket_args.type = type;
-    args.socket_args.protocol = protocol;
-    return call(SOCKET, &args).socket_ret;
+    msg_t *msg = call(ipc_prep_writev(fildes, iov, iovcnt));
+    return msg != NULL ? msg->ret.writev_ret : -1;
 }
 
 #ifdef DEBUG
 int test(int a, int b)
 {
-    args_t args;
-    args.test_args.a = a;
-    args.test_args.b = b;
-    return call(TEST, &args).test_ret;
+    msg_t *msg = ipc_prepare(TEST);
+    if (msg == NULL)
+        return -1;
+    msg->args.test_args.a = a;
+    msg->args.test_args.b = b;
+    return call(msg)->ret.test_ret;
 }
 #endif
@@ -9,29 +9,58 @@
 #ifdef DEBUG
 
 #include "ipc.h"
+#include "stats.h"
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
-void ipc_test()
+static int compare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+void ipc_test(unsigned rounds)
 {
     const char *mem_name = "ipcm";
-    const char *sem_name = "ipcs";
-    if (ipc_init(mem_name, sem_name) != 0)
+    uint64_t *latency = NULL, start, total = 0;
+    unsigned i;
+    int a, b, c;
+
+    if (ipc_init(mem_name) != 0)
+        goto error;
+    if (rounds == 0)
+        rounds = 1;
+    latency = malloc(rounds * sizeof(uint64_t));
+    if (latency == NULL)
         goto error;
 
     srand((unsigned)time(NULL));
-    int a = rand();
-    int b = rand();
-    int c = test(a, b);
-    if (c == a + b)
-        fprintf(stderr, "IPC test succeed: %d + %d = %d.\n", a, b, c);
-    else
-        fprintf(stderr, "IPC test failed: %d + %d != %d.\n", a, b, c);
+    for (i = 0; i < rounds; i++)
+    {
+        a = rand() / 2;
+        b = rand() / 2;
+        start = stats_clock();
+        c = test(a, b);
+        latency[i] = stats_clock() - start;
+        total += latency[i];
+        if (c != a + b)
+        {
+            fprintf(stderr, "IPC test failed: %d + %d != %d.\n", a, b, c);
+            goto error;
+        }
+    }
+    qsort(latency, rounds, sizeof(uint64_t), compare);
+    fprintf(stderr, "IPC test succeed: %u round trips, mean %.2fus, "
+            "p50 %.2fus, p99 %.2fus, max %.2fus.\n", rounds,
+            total / 1e3 / rounds, latency[rounds / 2] / 1e3,
+            latency[(uint64_t)rounds * 99 / 100] / 1e3,
+            latency[rounds - 1] / 1e3);
 
 error:
+    free(latency);
     ipc_close();
 }
 
@@ -12,8 +12,10 @@
 #include <unistd.h>
 #include <string.h>
 #include <sys/stat.h>
+#include "affinity.h"
 #include "httpd.h"
 #include "ipc.h"
+#include "log.h"
 
 #define PAGE "<html><head><title>404 not found</title></head><body>404 not found</body></html>"
 
@@ -124,16 +126,98 @@ int
 main (int argc, char *const *argv)
 {
     struct httpd_daemon *d;
+    enum HTTPD_Backend backend = HTTPD_BACKEND_IPC;
+    enum HTTPD_EventLoop event_loop = HTTPD_EVENT_LOOP_AUTO;
+    int shared_pools = HTTPD_NO;
+    int cpu = -1;
+    unsigned threads = 1;
+    unsigned budget = 32;
+    unsigned timeout = 30;
+#ifdef DEBUG
+    unsigned rounds = 0;
+#endif
+    int opt;
 
-    if (argc != 2)
+    while ((opt = getopt (argc, argv, "b:e:za:n:k:T:t:")) != -1)
+        switch (opt)
+        {
+            case 'b':
+                if (0 == strcmp (optarg, "direct"))
+                    backend = HTTPD_BACKEND_DIRECT;
+                else if (0 == strcmp (optarg, "ipc"))
+                    backend = HTTPD_BACKEND_IPC;
+                else if (0 == strcmp (optarg, "hybrid"))
+                    backend = HTTPD_BACKEND_HYBRID;
+                else
+                    goto usage;
+                break;
+            case 'e':
+                if (0 == strcmp (optarg, "select"))
+                    event_loop = HTTPD_EVENT_LOOP_SELECT;
+                else if (0 == strcmp (optarg, "poll"))
+                    event_loop = HTTPD_EVENT_LOOP_POLL;
+                else if (0 == strcmp (optarg, "epoll"))
+                    event_loop = HTTPD_EVENT_LOOP_EPOLL;
+                else if (0 == strcmp (optarg, "uring"))
+                    event_loop = HTTPD_EVENT_LOOP_URING;
+                else if (0 == strcmp (optarg, "backend"))
+                    event_loop = HTTPD_EVENT_LOOP_BACKEND;
+                else
+                    goto usage;
+                break;
+            case 'z':
+                shared_pools = HTTPD_YES;
+                break;
+            case 'a':
+                cpu = atoi (optarg);
+                break;
+            case 'n':
+                threads = (unsigned) atoi (optarg);
+                break;
+            case 'k':
+                budget = (unsigned) atoi (optarg);
+                break;
+            case 'T':
+                timeout = (unsigned) atoi (optarg);
+                break;
+#ifdef DEBUG
+            case 't':
+                rounds = (unsigned) atoi (optarg);
+                break;
+#endif
+            default:
+                goto usage;
+        }
+#ifdef DEBUG
+    if (0 != rounds)
     {
-        printf ("%s PORT\n", argv[0]);
-        return 1;
+        log_init ();
+        if (cpu >= 0)
+            affinity_pin (pthread_self (), cpu);
+        ipc_test (rounds);
+        log_close ();
+        return 0;
     }
-    d = create_daemon (atoi (argv[1]), &ahc_echo, PAGE);
+#endif
+    if (optind != argc - 1)
+        goto usage;
+    log_init ();
+    d = create_daemon (atoi (argv[optind]), &ahc_echo, PAGE,
+                       HTTPD_OPTION_BACKEND, backend,
+                       HTTPD_OPTION_EVENT_LOOP, event_loop,
+                       HTTPD_OPTION_SHARED_POOLS, shared_pools,
+                       HTTPD_OPTION_CPU, cpu,
+                       HTTPD_OPTION_THREAD_POOL_SIZE, threads,
+                       HTTPD_OPTION_ACCEPT_BUDGET, budget,
+                       HTTPD_OPTION_CONNECTION_TIMEOUT, timeout,
+                       HTTPD_OPTION_END);
     if (d == NULL)
         return 1;
     pause();
     stop_daemon (d);
     return 0;
+
+usage:
+    printf ("%s [-b ipc|direct|hybrid] [-e select|poll|epoll|uring|backend] [-z] [-a cpu] [-n threads] [-k accepts] [-T timeout] PORT\n", argv[0]);
+    return 1;
 }
@@ -21,22 +21,45 @@
  */
 #define ROUND_TO_ALIGN(n) ((n+(ALIGN_SIZE-1)) & (~(ALIGN_SIZE-1)))
 
+/**
+ * Pools are recycled, so fault their pages in once and for all.
+ */
+#ifdef MAP_POPULATE
+#define POOL_MAP_FLAGS (MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE)
+#else
+#define POOL_MAP_FLAGS (MAP_PRIVATE | MAP_ANONYMOUS)
+#endif
+
 struct MemoryPool {
     char* memory;
     size_t size;
     size_t pos;
     size_t end;
     httpd_status is_mmap;
+    const struct httpd_backend* shared;
 };
 
-struct MemoryPool* httpd_pool_create(size_t max) {
+struct MemoryPool* httpd_pool_create(size_t max,
+                                     const struct httpd_backend* backend) {
     struct MemoryPool* pool;
     
     pool = malloc(sizeof(struct MemoryPool));
     if (NULL == pool) return NULL;
     
+    pool->shared = NULL;
+    if (NULL != backend && NULL != backend->pool_allocate) {
+        pool->memory = backend->pool_allocate(max);
+        if (NULL != pool->memory) {
+            pool->shared = backend;
+            pool->is_mmap = HTTPD_NO;
+            pool->size = max;
+            pool->pos = 0;
+            pool->end = max;
+            return pool;
+        }
+    }
     pool->memory = mmap(NULL, max, PROT_READ | PROT_WRITE,
-                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                        POOL_MAP_FLAGS, -1, 0);
     if (MAP_FAILED == pool->memory || NULL == pool->memory) {
         pool->memory = malloc(max);
         if (NULL == pool->memory) {
@@ -56,13 +79,22 @@ struct MemoryPool* httpd_pool_create(size_t max) {
 void httpd_pool_destroy(struct MemoryPool* pool) {
     if (NULL == pool)
         return;
-    if (HTTPD_NO == pool->is_mmap)
+    if (NULL != pool->shared)
+        pool->shared->pool_release(pool->memory, pool->size);
+    else if (HTTPD_NO == pool->is_mmap)
         free(pool->memory);
     else
         munmap(pool->memory, pool->size);
     free(pool);
 }
 
+void httpd_pool_recycle(struct MemoryPool* pool) {
+    memset(pool->memory, 0, pool->pos);
+    memset(&pool->memory[pool->end], 0, pool->size - pool->end);
+    pool->pos = 0;
+    pool->end = pool->size;
+}
+
 void* httpd_pool_allocate(struct MemoryPool* pool,
                           size_t size, httpd_status from_end) {
     void* ret;
@@ -35,7 +35,8 @@ HTTPD_destroy_response (struct httpd_response *response)
     if (NULL == response)
         return;
     // mutex?
-    // response->crfc?
+    if (NULL != response->crfc)
+        response->crfc (response->crc_cls);
     while (NULL != response->first_header)
     {
         pos = response->first_header;
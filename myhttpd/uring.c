@@ -0,0 +1,222 @@
+//
+//  uring.c
+//  myhttpd
+//
+//  Created by Yishuai Li on 02/09/2017.
+//  Copyright © 2017 DeepSpec. All rights reserved.
+//
+
+#define _GNU_SOURCE
+
+#include "uring.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+
+#define PROBE_OPS 0x100
+
+static const int uring_ops[] = {
+    IORING_OP_ACCEPT,
+    IORING_OP_POLL_ADD,
+    IORING_OP_POLL_REMOVE
+};
+
+static bool supported(int fd)
+{
+    struct io_uring_probe *probe;
+    bool ok = true;
+    size_t i;
+
+    probe = calloc(1, sizeof(*probe) +
+                      PROBE_OPS * sizeof(struct io_uring_probe_op));
+    if (probe == NULL)
+        return false;
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+                probe, PROBE_OPS) != 0)
+        ok = false;
+    for (i = 0; ok && i < sizeof(uring_ops) / sizeof(*uring_ops); i++)
+        if (uring_ops[i] > probe->last_op ||
+            !(probe->ops[uring_ops[i]].flags & IO_URING_OP_SUPPORTED))
+            ok = false;
+    free(probe);
+    return ok;
+}
+
+int uring_open(uring_t *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    unsigned char *mem;
+    size_t sq_size, cq_size;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->mem = MAP_FAILED;
+    ring->sqes = MAP_FAILED;
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+        goto error;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(params.features & IORING_FEAT_EXT_ARG) ||
+        !supported(ring->fd))
+    {
+        errno = ENOSYS;
+        goto error;
+    }
+
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes +
+              params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->mem_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->mem = mmap(NULL, ring->mem_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->mem == MAP_FAILED)
+        goto error;
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto error;
+
+    mem = ring->mem;
+    ring->sq_head = (unsigned *)(mem + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(mem + params.sq_off.tail);
+    ring->sq_array = (unsigned *)(mem + params.sq_off.array);
+    ring->sq_mask = *(unsigned *)(mem + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_pending = *ring->sq_tail;
+    ring->cq_head = (unsigned *)(mem + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(mem + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(mem + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(mem + params.cq_off.cqes);
+    return 0;
+
+error:
+    {
+        int err = errno;
+        uring_close(ring);
+        errno = err;
+    }
+    return -1;
+}
+
+void uring_close(uring_t *ring)
+{
+    if (ring->sqes != MAP_FAILED && ring->sqes != NULL)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->mem != MAP_FAILED && ring->mem != NULL)
+        munmap(ring->mem, ring->mem_size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+struct io_uring_sqe *uring_sqe(uring_t *ring)
+{
+    struct io_uring_sqe *sqe;
+    unsigned index;
+
+    if (ring->sq_pending - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) ==
+        ring->sq_entries)
+    {
+        if (uring_wait(ring, 0, 0) < 0 ||
+            ring->sq_pending -
+            __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) ==
+            ring->sq_entries)
+            return NULL;
+    }
+    index = ring->sq_pending & ring->sq_mask;
+    ring->sq_array[index] = index;
+    sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_pending++;
+    return sqe;
+}
+
+int uring_wait(uring_t *ring, int wait, int timeout)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned submit = ring->sq_pending - *ring->sq_tail;
+    int r;
+
+    __atomic_store_n(ring->sq_tail, ring->sq_pending, __ATOMIC_RELEASE);
+    if (!wait)
+    {
+        if (submit == 0)
+            return 0;
+        return (int)syscall(__NR_io_uring_enter, ring->fd, submit, 0, 0,
+                            NULL, 0);
+    }
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000L;
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+    r = (int)syscall(__NR_io_uring_enter, ring->fd, submit, 1,
+                     IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                     &arg, sizeof(arg));
+    /* a timeout or a signal only ends the wait */
+    if (r < 0 && (errno == ETIME || errno == EINTR))
+        return 0;
+    return r;
+}
+
+struct io_uring_cqe *uring_cqe(uring_t *ring)
+{
+    unsigned head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#else
+
+int uring_open(uring_t *ring, unsigned entries)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+    errno = ENOSYS;
+    return -1;
+}
+
+void uring_close(uring_t *ring)
+{
+}
+
+struct io_uring_sqe *uring_sqe(uring_t *ring)
+{
+    return NULL;
+}
+
+int uring_wait(uring_t *ring, int wait, int timeout)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+struct io_uring_cqe *uring_cqe(uring_t *ring)
+{
+    return NULL;
+}
+
+void uring_cqe_seen(uring_t *ring)
+{
+}
+
+#endif